@@ -0,0 +1,1114 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef BF_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+#include "buffer.h"
+
+/*
+ * Each benchmark prints a JSON object on its own line:
+ *
+ *   {"name": "append/64", "build_id": "v1.0-3-g8b0a727", "duration_ns": ...,
+ *    "ops": ..., "bytes": ..., "ns_per_op": ..., "bytes_per_sec": ...,
+ *    "mallocs": ..., "reallocs": ..., "frees": ...}
+ *
+ * ns_per_op and bytes_per_sec are null when the benchmark does not count
+ * operations or bytes. Allocation counters only cover the timed part of the
+ * benchmark. Results of different builds can be compared by name.
+ */
+
+struct bfb_counters {
+    size_t nb_mallocs;
+    size_t nb_reallocs;
+    size_t nb_frees;
+};
+
+struct bfb_pipeline {
+    struct bf_queue *queue;
+
+    struct bf_buffer *buf;
+    pthread_mutex_t mutex;
+
+    size_t record_sz;
+    size_t nb_bytes;
+};
+
+struct bfb_log {
+    struct bf_log *log;
+
+    struct bf_buffer *buf;
+    pthread_mutex_t *mutex;
+
+    size_t nb_records;
+    int id;
+};
+
+static struct bfb_counters bfb_counters;
+
+static const char bfb_payload[64];
+
+static void *bfb_malloc(size_t);
+static void *bfb_calloc(size_t, size_t);
+static void *bfb_realloc(void *, size_t);
+static void bfb_free(void *);
+
+static uint64_t bfb_now(void);
+static uint64_t bfb_start(void);
+static void bfb_report(const char *, size_t, size_t, uint64_t);
+
+static void bfb_growth(const char *, const struct bf_growth_policy *, size_t);
+static void bfb_format_printf(size_t);
+static void bfb_format_u64(size_t);
+static void bfb_append(size_t);
+static void bfb_insert_middle(size_t, size_t);
+static void bfb_skip_repack(size_t);
+static void bfb_pipe(size_t, size_t);
+static void bfb_churn(size_t);
+static void bfb_search(size_t, size_t);
+static void bfb_small(const char *, size_t, size_t);
+static void bfb_transfer(size_t, size_t);
+static void bfb_large(const char *, struct bf_buffer *, size_t);
+static void bfb_uring(const char *, int, size_t, size_t);
+static void bfb_uring_sync(size_t, size_t);
+static void bfb_fan_out(const char *, int, size_t, size_t, size_t);
+static void bfb_pipeline(const char *, int, size_t, size_t);
+static void *bfb_pipeline_queue_producer(void *);
+static void *bfb_pipeline_mutex_producer(void *);
+static void bfb_pin_thread(int);
+static void bfb_log(const char *, int, int, size_t);
+static void *bfb_log_producer(void *);
+static struct bf_buffer *bfb_filter_input(size_t);
+static void bfb_filter(const char *, enum bf_filter_codec, size_t, size_t);
+#ifdef BF_WITH_ZLIB
+static void bfb_filter_copy(size_t, size_t);
+#endif
+static void bfb_hash(const char *, enum bf_hash_type, int, size_t, size_t);
+
+int
+main(int argc, char **argv) {
+    struct bf_memory_allocator allocator = {
+        .malloc = bfb_malloc,
+        .free = bfb_free,
+        .calloc = bfb_calloc,
+        .realloc = bfb_realloc,
+    };
+    struct bf_growth_policy exact_policy = {
+        .factor = 1.0,
+        .min_step = 0,
+    };
+    struct bf_growth_policy mremap_policy = {
+        .factor = 2.0,
+        .min_step = 32,
+        .mmap_threshold = 1024 * 1024,
+    };
+    struct bf_buffer *buf;
+    char name[64];
+    size_t nb_ops;
+    int nb_threads;
+
+    bf_set_memory_allocator(&allocator);
+
+    for (nb_ops = 1000; nb_ops <= 1000000; nb_ops *= 10) {
+        bfb_growth("growth/exact", &exact_policy, nb_ops);
+        bfb_growth("growth/geometric", NULL, nb_ops);
+    }
+
+    bfb_format_printf(1000000);
+    bfb_format_u64(1000000);
+
+    bfb_append(1000000);
+    bfb_insert_middle(4096, 1000000);
+    bfb_skip_repack(1000000);
+    bfb_pipe(4096, 200000);
+    bfb_churn(1000000);
+
+    bfb_search(1024 * 1024, 200);
+
+    bfb_small("small/heap", 0, 1000000);
+    bfb_small("small/inline", 64, 1000000);
+    bfb_small("small/stack", SIZE_MAX, 1000000);
+
+    bfb_transfer(16 * 1024 * 1024, 20);
+
+    bfb_large("large/heap", bf_buffer_new(0), 256 * 1024 * 1024);
+
+    buf = bf_buffer_new(0);
+    bf_buffer_set_growth_policy(buf, &mremap_policy);
+    bfb_large("large/mremap", buf, 256 * 1024 * 1024);
+
+    bfb_large("large/aligned",
+              bf_buffer_new_aligned(0, 0, 0), 256 * 1024 * 1024);
+    bfb_large("large/huge_pages",
+              bf_buffer_new_aligned(0, 0, BF_BUFFER_HUGE_PAGES),
+              256 * 1024 * 1024);
+
+    bfb_uring_sync(64, 2000);
+    bfb_uring("uring/native", 0, 64, 2000);
+    bfb_uring("uring/fallback", BF_URING_FALLBACK, 64, 2000);
+
+    bfb_fan_out("fan_out/copy", 0, 64 * 1024, 64, 1000);
+    bfb_fan_out("fan_out/slice", 1, 64 * 1024, 64, 1000);
+
+    bfb_pipeline("pipeline/mutex", 0, 64, 256 * 1024 * 1024);
+    bfb_pipeline("pipeline/queue", 1, 64, 256 * 1024 * 1024);
+
+    for (nb_threads = 1; nb_threads <= 8; nb_threads *= 2) {
+        snprintf(name, sizeof(name), "log/mutex/%d", nb_threads);
+        bfb_log(name, 0, nb_threads, 200000);
+        snprintf(name, sizeof(name), "log/lock_free/%d", nb_threads);
+        bfb_log(name, 1, nb_threads, 200000);
+    }
+
+    bfb_filter("filter/lz", BF_FILTER_LZ, 16 * 1024 * 1024, 10);
+#ifdef BF_WITH_ZLIB
+    bfb_filter_copy(16 * 1024 * 1024, 10);
+    bfb_filter("filter/deflate/stream", BF_FILTER_DEFLATE,
+               16 * 1024 * 1024, 10);
+#endif
+
+    bfb_hash("hash/crc32c/rescan", BF_HASH_CRC32C, 0, 16 * 1024, 20000);
+    bfb_hash("hash/crc32c/incremental", BF_HASH_CRC32C, 1, 16 * 1024, 20000);
+    bfb_hash("hash/xxh64/rescan", BF_HASH_XXH64, 0, 16 * 1024, 20000);
+    bfb_hash("hash/xxh64/incremental", BF_HASH_XXH64, 1, 16 * 1024, 20000);
+
+    return 0;
+}
+
+static void *
+bfb_malloc(size_t sz) {
+    __atomic_add_fetch(&bfb_counters.nb_mallocs, 1, __ATOMIC_RELAXED);
+    return malloc(sz);
+}
+
+static void *
+bfb_calloc(size_t nb, size_t sz) {
+    __atomic_add_fetch(&bfb_counters.nb_mallocs, 1, __ATOMIC_RELAXED);
+    return calloc(nb, sz);
+}
+
+static void *
+bfb_realloc(void *ptr, size_t sz) {
+    __atomic_add_fetch(&bfb_counters.nb_reallocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, sz);
+}
+
+static void
+bfb_free(void *ptr) {
+    if (ptr)
+        __atomic_add_fetch(&bfb_counters.nb_frees, 1, __ATOMIC_RELAXED);
+
+    free(ptr);
+}
+
+static uint64_t
+bfb_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t
+bfb_start(void) {
+    memset(&bfb_counters, 0, sizeof(struct bfb_counters));
+    return bfb_now();
+}
+
+static void
+bfb_report(const char *name, size_t nb_ops, size_t nb_bytes,
+           uint64_t duration) {
+    if (duration == 0)
+        duration = 1;
+
+    printf("{\"name\": \"%s\", \"build_id\": \"%s\", "
+           "\"duration_ns\": %" PRIu64 ", \"ops\": %zu, \"bytes\": %zu",
+           name, bf_build_id(), duration, nb_ops, nb_bytes);
+
+    if (nb_ops > 0) {
+        printf(", \"ns_per_op\": %.2f", (double)duration / (double)nb_ops);
+    } else {
+        printf(", \"ns_per_op\": null");
+    }
+
+    if (nb_bytes > 0) {
+        printf(", \"bytes_per_sec\": %.0f",
+               (double)nb_bytes * 1e9 / (double)duration);
+    } else {
+        printf(", \"bytes_per_sec\": null");
+    }
+
+    printf(", \"mallocs\": %zu, \"reallocs\": %zu, \"frees\": %zu}\n",
+           bfb_counters.nb_mallocs, bfb_counters.nb_reallocs,
+           bfb_counters.nb_frees);
+    fflush(stdout);
+}
+
+static void
+bfb_growth(const char *name, const struct bf_growth_policy *policy,
+           size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+    bf_buffer_set_growth_policy(buf, policy);
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++)
+        bf_buffer_add_printf(buf, "%08zu", i);
+    bfb_report(name, nb_ops, 0, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_format_printf(size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        bf_buffer_add_printf(buf, "%zu", i * 7919);
+        if (bf_buffer_length(buf) > 65536)
+            bf_buffer_clear(buf);
+    }
+    bfb_report("format/printf", nb_ops, 0, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_format_u64(size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        bf_buffer_add_u64(buf, i * 7919);
+        if (bf_buffer_length(buf) > 65536)
+            bf_buffer_clear(buf);
+    }
+    bfb_report("format/u64", nb_ops, 0, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_append(size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++)
+        bf_buffer_add(buf, bfb_payload, sizeof(bfb_payload));
+    bfb_report("append/64", nb_ops, nb_ops * sizeof(bfb_payload),
+               bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_insert_middle(size_t sz, size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+    for (i = 0; i < sz; i += sizeof(bfb_payload))
+        bf_buffer_add(buf, bfb_payload, sizeof(bfb_payload));
+
+    /* Each insertion moves the second half of the buffer. */
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        bf_buffer_insert(buf, sz / 2, bfb_payload, 16);
+        bf_buffer_truncate(buf, sz);
+    }
+    bfb_report("insert/middle", nb_ops, nb_ops * 16, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_skip_repack(size_t nb_ops) {
+    static char block[1000];
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+
+    /* A few bytes always stay in the buffer, so the space before them is
+     * only reclaimed by repacking. */
+    bf_buffer_add(buf, block, 24);
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        bf_buffer_add(buf, block, sizeof(block));
+        bf_buffer_skip(buf, sizeof(block));
+    }
+    bfb_report("skip_repack", nb_ops, nb_ops * sizeof(block),
+               bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+static void
+bfb_pipe(size_t sz, size_t nb_ops) {
+    struct bf_buffer *in, *out;
+    uint64_t start;
+    size_t i;
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        perror("cannot create pipe");
+        exit(1);
+    }
+
+    in = bf_buffer_new(sz);
+    out = bf_buffer_new(sz);
+    memset(bf_buffer_reserve(out, sz), 'a', sz);
+
+    /* Messages are smaller than the capacity of the pipe, so writes never
+     * block. */
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        bf_buffer_reserve(out, sz);
+        bf_buffer_increase_length(out, sz);
+
+        while (bf_buffer_length(out) > 0)
+            bf_buffer_write(out, fds[1]);
+
+        while (bf_buffer_length(in) < sz)
+            bf_buffer_read(in, fds[0], sz - bf_buffer_length(in));
+
+        bf_buffer_clear(in);
+    }
+    bfb_report("pipe/read_write", nb_ops, nb_ops * sz, bfb_now() - start);
+
+    bf_buffer_delete(in);
+    bf_buffer_delete(out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+bfb_churn(size_t nb_ops) {
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i, j, nb_bytes;
+
+    nb_bytes = 0;
+
+    /* Short-lived buffers of various sizes, as created for each message
+     * by a server. */
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        buf = bf_buffer_new(0);
+
+        for (j = 0; j <= i % 32; j++)
+            bf_buffer_add(buf, bfb_payload, sizeof(bfb_payload));
+        nb_bytes += bf_buffer_length(buf);
+
+        bf_buffer_delete(buf);
+    }
+    bfb_report("churn/new_delete", nb_ops, nb_bytes, bfb_now() - start);
+}
+
+static void
+bfb_search(size_t sz, size_t nb_loops) {
+    struct bf_buffer *buf;
+    const char *data;
+    uint64_t start;
+    size_t i, len;
+    ssize_t ret;
+
+    buf = bf_buffer_new(sz + 1);
+
+    /* Bytes which are searched for only appear at the very end, and the
+     * content is null-terminated for the string functions of the C
+     * library. */
+    for (i = 0; i < sz - 16; i++)
+        bf_buffer_add(buf, "a", 1);
+    bf_buffer_add_string(buf, "bcd\r\n\r\n-------");
+    bf_buffer_add(buf, "\0", 1);
+
+    data = bf_buffer_data(buf);
+    len = bf_buffer_length(buf) - 1;
+
+#define BFB_SEARCH(name_, expr_)                                   \
+    do {                                                           \
+        start = bfb_start();                                       \
+        for (i = 0; i < nb_loops; i++) {                           \
+            ret = (ssize_t)(expr_);                                \
+            __asm__ volatile("" : : "r"(ret) : "memory");          \
+        }                                                          \
+        bfb_report(name_, 0, len * nb_loops, bfb_now() - start);   \
+    } while (0)
+
+    BFB_SEARCH("search/find/memchr", memchr(data, 'b', len) != NULL);
+    BFB_SEARCH("search/find", bf_buffer_find(buf, 0, 'b'));
+
+    BFB_SEARCH("search/find_any/strcspn", strcspn(data, "\r\n"));
+    BFB_SEARCH("search/find_any", bf_buffer_find_any(buf, 0, "\r\n", 2));
+
+    BFB_SEARCH("search/find_not_any/strspn", strspn(data, "a "));
+    BFB_SEARCH("search/find_not_any",
+               bf_buffer_find_not_any(buf, 0, "a ", 2));
+
+    BFB_SEARCH("search/find_mem/memmem",
+               memmem(data, len, "\r\n\r\n", 4) != NULL);
+    BFB_SEARCH("search/find_mem", bf_buffer_find_mem(buf, 0, "\r\n\r\n", 4));
+
+#undef BFB_SEARCH
+
+    bf_buffer_delete(buf);
+}
+
+/* Each operation creates a buffer, formats a short key into it and deletes
+ * it. An inline size of SIZE_MAX selects a buffer stored on the stack. */
+
+static void
+bfb_small(const char *name, size_t inline_size, size_t nb_ops) {
+    BF_BUFFER_STORAGE(storage, 64);
+    struct bf_buffer *buf;
+    uint64_t start;
+    size_t i;
+
+    start = bfb_start();
+    for (i = 0; i < nb_ops; i++) {
+        if (inline_size == SIZE_MAX) {
+            buf = bf_buffer_init_inline(&storage, sizeof(storage));
+        } else if (inline_size > 0) {
+            buf = bf_buffer_new_inline(inline_size);
+        } else {
+            buf = bf_buffer_new(0);
+        }
+
+        bf_buffer_add_string(buf, "session:");
+        bf_buffer_add_u64(buf, i);
+
+        bf_buffer_delete(buf);
+    }
+    bfb_report(name, nb_ops, 0, bfb_now() - start);
+}
+
+static void
+bfb_transfer(size_t sz, size_t nb_loops) {
+    struct bf_buffer *buf;
+    struct bf_relay *relay;
+    char path[] = "/tmp/libbuffer-bench.XXXXXX";
+    uint64_t start;
+    off_t offset;
+    int fd, null_fd;
+    size_t i;
+
+    fd = mkstemp(path);
+    null_fd = open("/dev/null", O_WRONLY);
+    if (fd == -1 || null_fd == -1) {
+        perror("cannot open files");
+        exit(1);
+    }
+
+    unlink(path);
+
+    buf = bf_buffer_new(sz);
+    memset(bf_buffer_reserve(buf, sz), 'a', sz);
+    bf_buffer_increase_length(buf, sz);
+    while (bf_buffer_length(buf) > 0)
+        bf_buffer_write(buf, fd);
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while (bf_buffer_read(buf, fd, 65536) > 0) {
+            while (bf_buffer_length(buf) > 0)
+                bf_buffer_write(buf, null_fd);
+        }
+    }
+    bfb_report("transfer/read_write", 0, sz * nb_loops, bfb_now() - start);
+
+    relay = bf_relay_new();
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while (bf_relay_read(relay, fd, 65536) > 0) {
+            while (bf_relay_length(relay) > 0)
+                bf_relay_write(relay, null_fd);
+        }
+    }
+    bfb_report("transfer/relay", 0, sz * nb_loops, bfb_now() - start);
+
+    bf_relay_delete(relay);
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        offset = 0;
+        while (bf_send_file(null_fd, fd, &offset, sz) > 0)
+            continue;
+    }
+    bfb_report("transfer/send_file", 0, sz * nb_loops, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+    close(null_fd);
+    close(fd);
+}
+
+/* Large buffers are filled by appending 64KB blocks, then read at
+ * pseudo-random offsets which are far enough from each other to miss the
+ * TLB on almost every access when using regular pages. */
+
+static void
+bfb_large(const char *name, struct bf_buffer *buf, size_t sz) {
+    char report_name[64];
+    static char block[65536];
+    const unsigned char *data;
+    uint64_t start, sum;
+    size_t i, offset, nb_reads;
+
+    start = bfb_start();
+    for (i = 0; i < sz; i += sizeof(block))
+        bf_buffer_add(buf, block, sizeof(block));
+    snprintf(report_name, sizeof(report_name), "%s/fill", name);
+    bfb_report(report_name, 0, sz, bfb_now() - start);
+
+    data = bf_buffer_data(buf);
+    nb_reads = 20000000;
+
+    sum = 0;
+    offset = 0;
+
+    start = bfb_start();
+    for (i = 0; i < nb_reads; i++) {
+        offset = (offset + 1000003 * 64) % sz;
+        sum += data[offset];
+    }
+    __asm__ volatile("" : : "r"(sum) : "memory");
+    snprintf(report_name, sizeof(report_name), "%s/random_read", name);
+    bfb_report(report_name, nb_reads, 0, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
+
+/* Each round writes 64 bytes to each of nb_pipes pipes, then reads them
+ * back; each write and each read counts as one operation. */
+
+static void
+bfb_uring_sync(size_t nb_pipes, size_t nb_rounds) {
+    struct bf_buffer *buf;
+    int (*fds)[2];
+    uint64_t start;
+    size_t i, j;
+
+    fds = calloc(nb_pipes, sizeof(*fds));
+    for (i = 0; i < nb_pipes; i++)
+        pipe(fds[i]);
+
+    buf = bf_buffer_new(0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_rounds; i++) {
+        for (j = 0; j < nb_pipes; j++) {
+            bf_buffer_add(buf, bfb_payload, 64);
+            bf_buffer_write(buf, fds[j][1]);
+        }
+
+        for (j = 0; j < nb_pipes; j++) {
+            bf_buffer_read(buf, fds[j][0], 64);
+            bf_buffer_clear(buf);
+        }
+    }
+    bfb_report("uring/read_write", nb_pipes * nb_rounds * 2, 0,
+               bfb_now() - start);
+
+    bf_buffer_delete(buf);
+
+    for (i = 0; i < nb_pipes; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    free(fds);
+}
+
+static void
+bfb_uring(const char *name, int flags, size_t nb_pipes, size_t nb_rounds) {
+    struct bf_uring_completion completion;
+    struct bf_buffer **bufs;
+    struct bf_uring *uring;
+    int (*fds)[2];
+    uint64_t start;
+    size_t i, j;
+
+    fds = calloc(nb_pipes, sizeof(*fds));
+    bufs = calloc(nb_pipes, sizeof(*bufs));
+    for (i = 0; i < nb_pipes; i++) {
+        pipe(fds[i]);
+        bufs[i] = bf_buffer_new(64);
+    }
+
+    uring = bf_uring_new((unsigned int)nb_pipes, flags);
+    bf_uring_register_buffers(uring, bufs, nb_pipes);
+
+    start = bfb_start();
+    for (i = 0; i < nb_rounds; i++) {
+        for (j = 0; j < nb_pipes; j++) {
+            bf_buffer_add(bufs[j], bfb_payload, 64);
+            bf_uring_queue_write(uring, bufs[j], fds[j][1], NULL);
+        }
+
+        bf_uring_submit(uring, (unsigned int)nb_pipes);
+        while (bf_uring_next_completion(uring, &completion) == 1)
+            continue;
+
+        for (j = 0; j < nb_pipes; j++)
+            bf_uring_queue_read(uring, bufs[j], fds[j][0], 64, NULL);
+
+        bf_uring_submit(uring, (unsigned int)nb_pipes);
+        while (bf_uring_next_completion(uring, &completion) == 1)
+            bf_buffer_clear(completion.buf);
+    }
+    bfb_report(name, nb_pipes * nb_rounds * 2, 0, bfb_now() - start);
+
+    bf_uring_delete(uring);
+
+    for (i = 0; i < nb_pipes; i++) {
+        bf_buffer_delete(bufs[i]);
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    free(bufs);
+    free(fds);
+}
+
+/* Each loop appends a payload to the chain of every subscriber, either by
+ * copying it or by adding a slice, then empties the chains. */
+
+static void
+bfb_fan_out(const char *name, int use_slices, size_t sz,
+            size_t nb_subscribers, size_t nb_loops) {
+    struct bf_chain **chains;
+    struct bf_buffer *buf;
+    struct bf_slice slice;
+    uint64_t start;
+    size_t i, j;
+
+    chains = calloc(nb_subscribers, sizeof(struct bf_chain *));
+    for (j = 0; j < nb_subscribers; j++)
+        chains[j] = bf_chain_new(0);
+
+    buf = bf_buffer_new(sz);
+    while (bf_buffer_length(buf) < sz)
+        bf_buffer_add(buf, bfb_payload, sizeof(bfb_payload));
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        if (use_slices) {
+            bf_buffer_slice(buf, 0, bf_buffer_length(buf), &slice);
+            for (j = 0; j < nb_subscribers; j++)
+                bf_chain_add_slice(chains[j], &slice);
+            bf_slice_release(&slice);
+        } else {
+            for (j = 0; j < nb_subscribers; j++)
+                bf_chain_add_buffer(chains[j], buf);
+        }
+
+        for (j = 0; j < nb_subscribers; j++)
+            bf_chain_clear(chains[j]);
+    }
+    bfb_report(name, 0, sz * nb_subscribers * nb_loops, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+
+    for (j = 0; j < nb_subscribers; j++)
+        bf_chain_delete(chains[j]);
+    free(chains);
+}
+
+/* A producer thread pinned to one core sends records to a consumer thread
+ * pinned to another core, either through a queue or through a buffer
+ * protected by a mutex. */
+
+static void
+bfb_pipeline(const char *name, int use_queue, size_t record_sz,
+             size_t nb_bytes) {
+    struct bfb_pipeline pipeline;
+    pthread_t thread;
+    uint64_t start;
+    size_t i, len;
+
+    memset(&pipeline, 0, sizeof(struct bfb_pipeline));
+    pipeline.record_sz = record_sz;
+    pipeline.nb_bytes = nb_bytes;
+
+    if (use_queue) {
+        pipeline.queue = bf_queue_new(1024 * 1024);
+    } else {
+        pipeline.buf = bf_buffer_new(1024 * 1024);
+        pthread_mutex_init(&pipeline.mutex, NULL);
+    }
+
+    bfb_pin_thread(0);
+
+    start = bfb_start();
+
+    pthread_create(&thread, NULL,
+                   use_queue ? bfb_pipeline_queue_producer
+                             : bfb_pipeline_mutex_producer,
+                   &pipeline);
+
+    for (i = 0; i < nb_bytes; i += len) {
+        if (use_queue) {
+            len = bf_queue_length(pipeline.queue);
+            bf_queue_skip(pipeline.queue, len);
+        } else {
+            pthread_mutex_lock(&pipeline.mutex);
+            len = bf_buffer_length(pipeline.buf);
+            bf_buffer_skip(pipeline.buf, len);
+            pthread_mutex_unlock(&pipeline.mutex);
+        }
+
+        if (len == 0)
+            sched_yield();
+    }
+
+    pthread_join(thread, NULL);
+
+    bfb_report(name, 0, nb_bytes, bfb_now() - start);
+
+    if (use_queue) {
+        bf_queue_delete(pipeline.queue);
+    } else {
+        bf_buffer_delete(pipeline.buf);
+        pthread_mutex_destroy(&pipeline.mutex);
+    }
+}
+
+static void *
+bfb_pipeline_queue_producer(void *arg) {
+    struct bfb_pipeline *pipeline;
+    size_t i, j, batch_sz;
+    char *ptr;
+
+    pipeline = arg;
+    bfb_pin_thread(1);
+
+    /* Records are committed by batches of 16. */
+    batch_sz = pipeline->record_sz * 16;
+
+    for (i = 0; i < pipeline->nb_bytes; i += batch_sz) {
+        while (!(ptr = bf_queue_reserve(pipeline->queue, batch_sz)))
+            sched_yield();
+
+        for (j = 0; j < batch_sz; j += pipeline->record_sz)
+            memcpy(ptr + j, bfb_payload, pipeline->record_sz);
+
+        bf_queue_increase_length(pipeline->queue, batch_sz);
+    }
+
+    return NULL;
+}
+
+static void *
+bfb_pipeline_mutex_producer(void *arg) {
+    struct bfb_pipeline *pipeline;
+    size_t i, j, batch_sz;
+    char *ptr;
+    int added;
+
+    pipeline = arg;
+    bfb_pin_thread(1);
+
+    batch_sz = pipeline->record_sz * 16;
+
+    for (i = 0; i < pipeline->nb_bytes; i += batch_sz) {
+        added = 0;
+
+        while (!added) {
+            pthread_mutex_lock(&pipeline->mutex);
+
+            if (bf_buffer_length(pipeline->buf) < 1024 * 1024) {
+                ptr = bf_buffer_reserve(pipeline->buf, batch_sz);
+
+                for (j = 0; j < batch_sz; j += pipeline->record_sz)
+                    memcpy(ptr + j, bfb_payload, pipeline->record_sz);
+
+                bf_buffer_increase_length(pipeline->buf, batch_sz);
+                added = 1;
+            }
+
+            pthread_mutex_unlock(&pipeline->mutex);
+
+            if (!added)
+                sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static void
+bfb_pin_thread(int idx) {
+    cpu_set_t set;
+    long nb_cpus;
+
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_cpus < 1)
+        nb_cpus = 1;
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t)(idx % nb_cpus), &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+/* Each producer thread appends formatted lines, either to a log or to a
+ * buffer protected by a mutex, while the main thread writes them to
+ * /dev/null. */
+
+static void
+bfb_log(const char *name, int use_log, int nb_threads, size_t nb_records) {
+    struct bfb_log ctx, producers[8];
+    pthread_t threads[8];
+    pthread_mutex_t mutex;
+    uint64_t start;
+    size_t total, nb_bytes;
+    ssize_t ret;
+    int i, fd;
+
+    fd = open("/dev/null", O_WRONLY);
+
+    memset(&ctx, 0, sizeof(struct bfb_log));
+    ctx.nb_records = nb_records;
+
+    if (use_log) {
+        ctx.log = bf_log_new(1024 * 1024);
+    } else {
+        ctx.buf = bf_buffer_new(0);
+        ctx.mutex = &mutex;
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    /* Every line is 32 bytes long. */
+    total = (size_t)nb_threads * nb_records * 32;
+    nb_bytes = 0;
+
+    start = bfb_start();
+
+    for (i = 0; i < nb_threads; i++) {
+        producers[i] = ctx;
+        producers[i].id = i;
+        pthread_create(&threads[i], NULL, bfb_log_producer, &producers[i]);
+    }
+
+    while (nb_bytes < total) {
+        if (use_log) {
+            ret = bf_log_write(ctx.log, fd);
+        } else {
+            pthread_mutex_lock(&mutex);
+            ret = bf_buffer_write(ctx.buf, fd);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        if (ret > 0) {
+            nb_bytes += (size_t)ret;
+        } else {
+            sched_yield();
+        }
+    }
+
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    bfb_report(name, (size_t)nb_threads * nb_records, 0, bfb_now() - start);
+
+    if (use_log) {
+        bf_log_delete(ctx.log);
+    } else {
+        bf_buffer_delete(ctx.buf);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    close(fd);
+}
+
+static void *
+bfb_log_producer(void *arg) {
+    struct bfb_log *producer;
+    size_t i;
+
+    producer = arg;
+
+    for (i = 0; i < producer->nb_records; i++) {
+        if (producer->log) {
+            bf_log_add_printf(producer->log, "worker %d: request %08zx done\n",
+                              producer->id, i);
+        } else {
+            pthread_mutex_lock(producer->mutex);
+            bf_buffer_add_printf(producer->buf,
+                                 "worker %d: request %08zx done\n",
+                                 producer->id, i);
+            pthread_mutex_unlock(producer->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/* Responses are compressed, either with a filter writing directly to the
+ * output buffer, or by extracting the content of the response and
+ * compressing it to a temporary buffer which is then copied. */
+
+static struct bf_buffer *
+bfb_filter_input(size_t sz) {
+    struct bf_buffer *buf;
+    size_t i;
+
+    buf = bf_buffer_new(sz);
+    for (i = 0; bf_buffer_length(buf) < sz; i++)
+        bf_buffer_add_printf(buf, "{\"id\": %zu, \"name\": \"item-%zu\"}\n",
+                             i, i % 1000);
+
+    return buf;
+}
+
+static void
+bfb_filter(const char *name, enum bf_filter_codec codec, size_t sz,
+           size_t nb_loops) {
+    struct bf_buffer *response, *in, *out;
+    struct bf_filter *filter;
+    uint64_t start;
+    size_t i;
+
+    response = bfb_filter_input(sz);
+    in = bf_buffer_new(0);
+    out = bf_buffer_new(0);
+
+    filter = bf_filter_new(codec, BF_FILTER_COMPRESS, 0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        bf_buffer_add_buffer(in, response);
+
+        bf_filter_reset(filter);
+        bf_filter_process(filter, in, out, BF_FILTER_FINISH);
+        bf_buffer_clear(out);
+    }
+    bfb_report(name, 0, sz * nb_loops, bfb_now() - start);
+
+    bf_filter_delete(filter);
+
+    bf_buffer_delete(response);
+    bf_buffer_delete(in);
+    bf_buffer_delete(out);
+}
+
+#ifdef BF_WITH_ZLIB
+static void
+bfb_filter_copy(size_t sz, size_t nb_loops) {
+    struct bf_buffer *response, *in, *out;
+    uint64_t start;
+    size_t i;
+
+    response = bfb_filter_input(sz);
+    in = bf_buffer_new(0);
+    out = bf_buffer_new(0);
+
+    start = bfb_start();
+    for (i = 0; i < nb_loops; i++) {
+        unsigned char *data, *tmp;
+        uLongf tmp_len;
+        size_t len;
+
+        bf_buffer_add_buffer(in, response);
+
+        data = bf_buffer_extract(in, &len);
+
+        tmp_len = compressBound((uLong)len);
+        tmp = malloc(tmp_len);
+        compress(tmp, &tmp_len, data, (uLong)len);
+
+        bf_buffer_add(out, tmp, tmp_len);
+        bf_buffer_clear(out);
+
+        free(tmp);
+        bf_free(data);
+    }
+    bfb_report("filter/deflate/copy", 0, sz * nb_loops, bfb_now() - start);
+
+    bf_buffer_delete(response);
+    bf_buffer_delete(in);
+    bf_buffer_delete(out);
+}
+#endif
+
+static void
+bfb_hash(const char *name, enum bf_hash_type type, int incremental,
+         size_t frame_sz, size_t nb_frames) {
+    struct bf_buffer *buf;
+    struct bf_hash hash;
+    uint64_t start;
+    size_t i, j;
+
+    buf = bf_buffer_new(frame_sz);
+
+    start = bfb_start();
+    for (i = 0; i < nb_frames; i++) {
+        bf_hash_init(&hash, type, 0);
+        if (incremental)
+            bf_buffer_set_hash(buf, &hash);
+
+        for (j = 0; j < frame_sz; j += sizeof(bfb_payload))
+            bf_buffer_add(buf, bfb_payload, sizeof(bfb_payload));
+
+        if (!incremental) {
+            bf_hash_update(&hash, bf_buffer_data(buf),
+                           bf_buffer_length(buf));
+        }
+
+        bf_hash_digest(&hash);
+
+        bf_buffer_set_hash(buf, NULL);
+        bf_buffer_clear(buf);
+    }
+    bfb_report(name, 0, frame_sz * nb_frames, bfb_now() - start);
+
+    bf_buffer_delete(buf);
+}
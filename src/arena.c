@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_ARENA_DEFAULT_BLOCK_SIZE 65536U
+#define BF_ARENA_ALIGNMENT          16U
+
+/*
+ * An arena is a list of blocks in which memory is allocated by bumping a
+ * pointer. Deallocation does nothing, except for the last allocation of the
+ * current block which can be extended or rolled back; this is enough for
+ * buffers growing one at a time to be reallocated in place. All memory is
+ * released at once when the arena is reset or deleted.
+ */
+
+struct bf_arena_block {
+    struct bf_arena_block *next;
+
+    size_t sz;
+    size_t used;
+
+    char data[];
+};
+
+struct bf_arena {
+    struct bf_arena_block *blocks;
+    size_t block_size;
+
+    char *last;
+
+    struct bf_allocator allocator;
+};
+
+static void *bf_arena_allocate(void *, size_t);
+static void bf_arena_deallocate(void *, void *, size_t);
+static void *bf_arena_reallocate(void *, void *, size_t, size_t);
+
+static size_t bf_arena_block_offset(const struct bf_arena_block *);
+static struct bf_arena_block *bf_arena_add_block(struct bf_arena *, size_t);
+
+struct bf_arena *
+bf_arena_new(size_t block_size) {
+    struct bf_arena *arena;
+
+    arena = bf_malloc(sizeof(struct bf_arena));
+    if (!arena)
+        return NULL;
+
+    memset(arena, 0, sizeof(struct bf_arena));
+
+    if (block_size == 0)
+        block_size = BF_ARENA_DEFAULT_BLOCK_SIZE;
+    arena->block_size = block_size;
+
+    arena->allocator.allocate = bf_arena_allocate;
+    arena->allocator.deallocate = bf_arena_deallocate;
+    arena->allocator.reallocate = bf_arena_reallocate;
+    arena->allocator.ctx = arena;
+
+    return arena;
+}
+
+void
+bf_arena_delete(struct bf_arena *arena) {
+    if (!arena)
+        return;
+
+    bf_arena_reset(arena);
+    bf_free(arena);
+}
+
+void
+bf_arena_reset(struct bf_arena *arena) {
+    struct bf_arena_block *block, *next;
+
+    block = arena->blocks;
+    while (block) {
+        next = block->next;
+        bf_free(block);
+        block = next;
+    }
+
+    arena->blocks = NULL;
+    arena->last = NULL;
+}
+
+const struct bf_allocator *
+bf_arena_allocator(struct bf_arena *arena) {
+    return &arena->allocator;
+}
+
+static void *
+bf_arena_allocate(void *ctx, size_t sz) {
+    struct bf_arena *arena;
+    struct bf_arena_block *block;
+    size_t offset;
+
+    arena = ctx;
+
+    block = arena->blocks;
+    if (block) {
+        offset = bf_arena_block_offset(block);
+        if (offset > block->sz || block->sz - offset < sz)
+            block = NULL;
+    }
+
+    if (!block) {
+        block = bf_arena_add_block(arena, sz);
+        if (!block)
+            return NULL;
+
+        offset = bf_arena_block_offset(block);
+    }
+
+    block->used = offset + sz;
+    arena->last = block->data + offset;
+
+    return arena->last;
+}
+
+static void
+bf_arena_deallocate(void *ctx, void *ptr, size_t sz) {
+    struct bf_arena *arena;
+
+    arena = ctx;
+
+    if (ptr && ptr == arena->last) {
+        arena->blocks->used = (size_t)(arena->last - arena->blocks->data);
+        arena->last = NULL;
+    }
+}
+
+static void *
+bf_arena_reallocate(void *ctx, void *ptr, size_t old_sz, size_t sz) {
+    struct bf_arena *arena;
+    struct bf_arena_block *block;
+    void *nptr;
+
+    arena = ctx;
+
+    if (!ptr)
+        return bf_arena_allocate(ctx, sz);
+
+    if (ptr == arena->last) {
+        size_t offset;
+
+        block = arena->blocks;
+        offset = (size_t)(arena->last - block->data);
+
+        if (block->sz - offset >= sz) {
+            block->used = offset + sz;
+            return ptr;
+        }
+    } else if (sz <= old_sz) {
+        return ptr;
+    }
+
+    nptr = bf_arena_allocate(ctx, sz);
+    if (!nptr)
+        return NULL;
+
+    memcpy(nptr, ptr, (old_sz < sz) ? old_sz : sz);
+    return nptr;
+}
+
+static size_t
+bf_arena_block_offset(const struct bf_arena_block *block) {
+    uintptr_t addr;
+
+    addr = (uintptr_t)(block->data + block->used);
+    addr = (addr + BF_ARENA_ALIGNMENT - 1)
+         & ~(uintptr_t)(BF_ARENA_ALIGNMENT - 1);
+
+    return (size_t)(addr - (uintptr_t)block->data);
+}
+
+static struct bf_arena_block *
+bf_arena_add_block(struct bf_arena *arena, size_t sz) {
+    struct bf_arena_block *block;
+    size_t block_size;
+
+    block_size = arena->block_size;
+    if (sz > SIZE_MAX - BF_ARENA_ALIGNMENT - sizeof(struct bf_arena_block)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (block_size < sz + BF_ARENA_ALIGNMENT)
+        block_size = sz + BF_ARENA_ALIGNMENT;
+
+    block = bf_malloc(sizeof(struct bf_arena_block) + block_size);
+    if (!block)
+        return NULL;
+
+    block->sz = block_size;
+    block->used = 0;
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    return block;
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_UVARINT_MAX_SIZE 10U
+
+static int bf_buffer_put_be(struct bf_buffer *, uint64_t, size_t);
+static int bf_buffer_put_le(struct bf_buffer *, uint64_t, size_t);
+static int bf_reader_get_be(struct bf_reader *, uint64_t *, size_t);
+static int bf_reader_get_le(struct bf_reader *, uint64_t *, size_t);
+
+int
+bf_buffer_put_u8(struct bf_buffer *buf, uint8_t value) {
+    return bf_buffer_add(buf, &value, 1);
+}
+
+int
+bf_buffer_put_be16(struct bf_buffer *buf, uint16_t value) {
+    return bf_buffer_put_be(buf, value, 2);
+}
+
+int
+bf_buffer_put_be32(struct bf_buffer *buf, uint32_t value) {
+    return bf_buffer_put_be(buf, value, 4);
+}
+
+int
+bf_buffer_put_be64(struct bf_buffer *buf, uint64_t value) {
+    return bf_buffer_put_be(buf, value, 8);
+}
+
+int
+bf_buffer_put_le16(struct bf_buffer *buf, uint16_t value) {
+    return bf_buffer_put_le(buf, value, 2);
+}
+
+int
+bf_buffer_put_le32(struct bf_buffer *buf, uint32_t value) {
+    return bf_buffer_put_le(buf, value, 4);
+}
+
+int
+bf_buffer_put_le64(struct bf_buffer *buf, uint64_t value) {
+    return bf_buffer_put_le(buf, value, 8);
+}
+
+int
+bf_buffer_put_uvarint(struct bf_buffer *buf, uint64_t value) {
+    unsigned char *ptr;
+    size_t len;
+
+    ptr = bf_buffer_reserve(buf, BF_UVARINT_MAX_SIZE);
+    if (!ptr)
+        return -1;
+
+    len = 0;
+    while (value >= 0x80) {
+        ptr[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    ptr[len++] = (unsigned char)value;
+
+    return bf_buffer_increase_length(buf, len);
+}
+
+int
+bf_buffer_put_svarint(struct bf_buffer *buf, int64_t value) {
+    uint64_t zigzag;
+
+    zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    return bf_buffer_put_uvarint(buf, zigzag);
+}
+
+int
+bf_buffer_put_blob(struct bf_buffer *buf, const void *data, size_t sz) {
+    if (bf_buffer_put_uvarint(buf, sz) == -1)
+        return -1;
+
+    return bf_buffer_add(buf, data, sz);
+}
+
+void
+bf_reader_init(struct bf_reader *reader, struct bf_buffer *buf) {
+    reader->buf = buf;
+    reader->data = bf_buffer_data(buf);
+    reader->len = bf_buffer_length(buf);
+    reader->pos = 0;
+}
+
+size_t
+bf_reader_position(const struct bf_reader *reader) {
+    return reader->pos;
+}
+
+size_t
+bf_reader_remaining(const struct bf_reader *reader) {
+    return reader->len - reader->pos;
+}
+
+void
+bf_reader_rewind(struct bf_reader *reader) {
+    reader->pos = 0;
+}
+
+void
+bf_reader_commit(struct bf_reader *reader) {
+    bf_buffer_skip(reader->buf, reader->pos);
+    bf_reader_init(reader, reader->buf);
+}
+
+int
+bf_reader_skip(struct bf_reader *reader, size_t n) {
+    if (n > reader->len - reader->pos) {
+        bf_set_error("truncated data");
+        return -1;
+    }
+
+    reader->pos += n;
+    return 0;
+}
+
+int
+bf_reader_get_u8(struct bf_reader *reader, uint8_t *pvalue) {
+    if (reader->pos >= reader->len) {
+        bf_set_error("truncated data");
+        return -1;
+    }
+
+    *pvalue = reader->data[reader->pos++];
+    return 0;
+}
+
+int
+bf_reader_get_be16(struct bf_reader *reader, uint16_t *pvalue) {
+    uint64_t value;
+
+    if (bf_reader_get_be(reader, &value, 2) == -1)
+        return -1;
+
+    *pvalue = (uint16_t)value;
+    return 0;
+}
+
+int
+bf_reader_get_be32(struct bf_reader *reader, uint32_t *pvalue) {
+    uint64_t value;
+
+    if (bf_reader_get_be(reader, &value, 4) == -1)
+        return -1;
+
+    *pvalue = (uint32_t)value;
+    return 0;
+}
+
+int
+bf_reader_get_be64(struct bf_reader *reader, uint64_t *pvalue) {
+    return bf_reader_get_be(reader, pvalue, 8);
+}
+
+int
+bf_reader_get_le16(struct bf_reader *reader, uint16_t *pvalue) {
+    uint64_t value;
+
+    if (bf_reader_get_le(reader, &value, 2) == -1)
+        return -1;
+
+    *pvalue = (uint16_t)value;
+    return 0;
+}
+
+int
+bf_reader_get_le32(struct bf_reader *reader, uint32_t *pvalue) {
+    uint64_t value;
+
+    if (bf_reader_get_le(reader, &value, 4) == -1)
+        return -1;
+
+    *pvalue = (uint32_t)value;
+    return 0;
+}
+
+int
+bf_reader_get_le64(struct bf_reader *reader, uint64_t *pvalue) {
+    return bf_reader_get_le(reader, pvalue, 8);
+}
+
+int
+bf_reader_get_uvarint(struct bf_reader *reader, uint64_t *pvalue) {
+    uint64_t value;
+    unsigned int shift;
+    size_t pos;
+
+    value = 0;
+    shift = 0;
+
+    for (pos = reader->pos; pos < reader->len; pos++) {
+        unsigned char byte;
+
+        byte = reader->data[pos];
+
+        if (shift == 63 && byte > 1) {
+            bf_set_error("invalid varint");
+            return -1;
+        }
+
+        value |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (byte < 0x80) {
+            reader->pos = pos + 1;
+            *pvalue = value;
+            return 0;
+        }
+
+        shift += 7;
+    }
+
+    bf_set_error("truncated data");
+    return -1;
+}
+
+int
+bf_reader_get_svarint(struct bf_reader *reader, int64_t *pvalue) {
+    uint64_t zigzag;
+
+    if (bf_reader_get_uvarint(reader, &zigzag) == -1)
+        return -1;
+
+    *pvalue = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return 0;
+}
+
+int
+bf_reader_get_blob(struct bf_reader *reader,
+                   const void **pdata, size_t *plen) {
+    uint64_t len;
+    size_t pos;
+
+    pos = reader->pos;
+
+    if (bf_reader_get_uvarint(reader, &len) == -1)
+        return -1;
+
+    if (len > reader->len - reader->pos) {
+        reader->pos = pos;
+        bf_set_error("truncated data");
+        return -1;
+    }
+
+    *pdata = reader->data + reader->pos;
+    *plen = (size_t)len;
+
+    reader->pos += (size_t)len;
+    return 0;
+}
+
+static int
+bf_buffer_put_be(struct bf_buffer *buf, uint64_t value, size_t sz) {
+    unsigned char *ptr;
+    size_t i;
+
+    ptr = bf_buffer_reserve(buf, sz);
+    if (!ptr)
+        return -1;
+
+    for (i = sz; i > 0; i--) {
+        ptr[i - 1] = (unsigned char)value;
+        value >>= 8;
+    }
+
+    return bf_buffer_increase_length(buf, sz);
+}
+
+static int
+bf_buffer_put_le(struct bf_buffer *buf, uint64_t value, size_t sz) {
+    unsigned char *ptr;
+    size_t i;
+
+    ptr = bf_buffer_reserve(buf, sz);
+    if (!ptr)
+        return -1;
+
+    for (i = 0; i < sz; i++) {
+        ptr[i] = (unsigned char)value;
+        value >>= 8;
+    }
+
+    return bf_buffer_increase_length(buf, sz);
+}
+
+static int
+bf_reader_get_be(struct bf_reader *reader, uint64_t *pvalue, size_t sz) {
+    const unsigned char *ptr;
+    uint64_t value;
+    size_t i;
+
+    if (sz > reader->len - reader->pos) {
+        bf_set_error("truncated data");
+        return -1;
+    }
+
+    ptr = reader->data + reader->pos;
+
+    value = 0;
+    for (i = 0; i < sz; i++)
+        value = (value << 8) | ptr[i];
+
+    reader->pos += sz;
+
+    *pvalue = value;
+    return 0;
+}
+
+static int
+bf_reader_get_le(struct bf_reader *reader, uint64_t *pvalue, size_t sz) {
+    const unsigned char *ptr;
+    uint64_t value;
+    size_t i;
+
+    if (sz > reader->len - reader->pos) {
+        bf_set_error("truncated data");
+        return -1;
+    }
+
+    ptr = reader->data + reader->pos;
+
+    value = 0;
+    for (i = sz; i > 0; i--)
+        value = (value << 8) | ptr[i - 1];
+
+    reader->pos += sz;
+
+    *pvalue = value;
+    return 0;
+}
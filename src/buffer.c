@@ -14,20 +14,58 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef BF_PLATFORM_LINUX
+#   define _GNU_SOURCE
+#endif
+
 #include <errno.h>
+#include <float.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "internal.h"
 #include "buffer.h"
 
+static size_t bf_buffer_next_size(const struct bf_buffer *, size_t);
+static size_t bf_format_u64(char *, uint64_t);
+static int bf_buffer_should_compact(const struct bf_buffer *, size_t, size_t);
+static int bf_buffer_is_idle(const struct bf_buffer *,
+                             const struct bf_trim_policy *, size_t);
+static void bf_buffer_auto_trim(struct bf_buffer *);
 static void bf_buffer_repack(struct bf_buffer *);
 static int bf_buffer_resize(struct bf_buffer *, size_t);
 static int bf_buffer_grow(struct bf_buffer *, size_t);
 static int bf_buffer_ensure_free_space(struct bf_buffer *, size_t);
+static int bf_buffer_resize_aligned(struct bf_buffer *, size_t);
+static int bf_buffer_resize_map(struct bf_buffer *, size_t);
+static int bf_buffer_resize_huge_map(struct bf_buffer *, size_t);
+static int bf_buffer_should_map(const struct bf_buffer *, size_t);
+static int bf_buffer_move_to_map(struct bf_buffer *, size_t);
+static int bf_buffer_spill(struct bf_buffer *, size_t);
+static void bf_buffer_release_data(struct bf_buffer *);
+static void bf_buffer_reset_storage(struct bf_buffer *);
+static int bf_buffer_make_writable(struct bf_buffer *);
+static int bf_buffer_move_to_heap(struct bf_buffer *);
+static int bf_buffer_make_shared(struct bf_buffer *);
+static void bf_buffer_adopt(struct bf_buffer *, struct bf_shared *,
+                            const char *, size_t);
+static int bf_buffer_can_append_shared(const struct bf_buffer *, size_t);
+static int bf_buffer_can_take_back(const struct bf_buffer *,
+                                   const struct bf_shared *);
+static int bf_buffer_unshare(struct bf_buffer *, size_t);
+static void bf_shared_retain(struct bf_shared *);
+static void bf_shared_release(struct bf_shared *);
+static void bf_buffer_commit(struct bf_buffer *, size_t);
+#ifdef BF_WITH_STATS
+static void bf_buffer_update_peak_size(struct bf_buffer *);
+#endif
 
 /*
  *                       sz
@@ -39,32 +77,429 @@ static int bf_buffer_ensure_free_space(struct bf_buffer *, size_t);
  *  +------+--------------------------+--------+
  *  |      |         content          |        |
  *  +------+--------------------------+--------+
+ *
+ * The data of a buffer are usually allocated on the heap, but they can also
+ * be a read-only mapping of a file. In that case, the content is copied to
+ * the heap the first time the buffer is modified.
+ *
+ * Buffers created with an alignment use aligned heap memory, and buffers
+ * using huge pages use anonymous memory mappings. Since neither realloc()
+ * nor the allocator of the buffer can preserve these properties, growing
+ * them always allocates new memory and copies data.
+ *
+ * Heap buffers growing past the mmap threshold of their growth policy are
+ * moved to an anonymous memory mapping which is then resized with mremap(),
+ * so that the kernel moves page table entries instead of copying data. When
+ * such a buffer shrinks, the pages past its new size are released but the
+ * address range is kept, so map_sz can be larger than sz.
+ *
+ * Inline buffers store their data right after the buffer structure, in the
+ * same allocation, or in memory provided by the caller (external buffers).
+ * When the content does not fit anymore, it is moved to the heap; the
+ * inline area is used again once the data of the buffer are released.
+ *
+ * Slicing a buffer or sharing it moves its data to shared storage: a
+ * reference counted header which remembers how to free the data, and which
+ * is referenced by each slice and by each buffer using the data. Shared data
+ * are never modified. The buffer which was sliced (the owner) can still
+ * append data in place after the last byte referenced by a slice (the frozen
+ * offset); any other modification copies the content first, unless the
+ * buffer holds the only reference left, in which case it takes the data
+ * back.
  */
 
+#define BF_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+enum bf_buffer_storage {
+    BF_STORAGE_HEAP = 0,
+    BF_STORAGE_FILE_MAP,
+    BF_STORAGE_ALIGNED,
+    BF_STORAGE_ANON_MAP,
+    BF_STORAGE_INLINE,
+    BF_STORAGE_SHARED,
+};
+
+struct bf_shared {
+    unsigned int refcount;
+
+    char *data;
+    size_t sz;
+    size_t map_sz;
+
+    enum bf_buffer_storage storage;
+    size_t alignment;
+    const struct bf_allocator *allocator;
+
+    struct bf_buffer *owner;
+    size_t frozen;
+};
+
 struct bf_buffer {
     char *data;
     size_t sz;
     size_t skip;
     size_t len;
+
+    enum bf_buffer_storage storage;
+    size_t alignment;
+    int flags;
+    size_t map_sz;
+
+    const struct bf_allocator *allocator;
+
+    const struct bf_growth_policy *growth_policy;
+    const struct bf_compaction_policy *compaction_policy;
+    const struct bf_trim_policy *trim_policy;
+
+    struct bf_compaction_stats compaction_stats;
+    size_t nb_idle_ops;
+    size_t trim_peak_len;
+
+    struct bf_shared *shared;
+    enum bf_buffer_storage unshared_storage;
+
+    struct bf_hash *hash;
+
+#ifdef BF_WITH_STATS
+    struct bf_buffer_stats stats;
+#endif
+
+    size_t inline_sz;
+    int external;
+    char inline_data[];
 };
 
+typedef char bf_buffer_header_size_check[
+    (sizeof(struct bf_buffer) <= BF_BUFFER_HEADER_SIZE) ? 1 : -1];
+
+static void bf_storage_free(enum bf_buffer_storage, char *, size_t, size_t,
+                            const struct bf_allocator *);
+static enum bf_buffer_storage bf_storage_after_release(enum bf_buffer_storage,
+                                                       int);
+
+#define BF_DEFAULT_GROWTH_POLICY \
+    {                            \
+        .factor = 2.0,           \
+        .min_step = 32,          \
+        .round_to = 0,           \
+        .max_size = 0,           \
+        .mmap_threshold = 0      \
+    }
+
+static const struct bf_growth_policy bf_builtin_growth_policy =
+    BF_DEFAULT_GROWTH_POLICY;
+
+static struct bf_growth_policy bf_default_growth_policy =
+    BF_DEFAULT_GROWTH_POLICY;
+
+#define BF_DEFAULT_COMPACTION_POLICY    \
+    {                                   \
+        .mode = BF_COMPACTION_EAGER,    \
+        .threshold = 0.0                \
+    }
+
+static const struct bf_compaction_policy bf_builtin_compaction_policy =
+    BF_DEFAULT_COMPACTION_POLICY;
+
+static struct bf_compaction_policy bf_default_compaction_policy =
+    BF_DEFAULT_COMPACTION_POLICY;
+
+#define BF_DEFAULT_TRIM_POLICY    \
+    {                             \
+        .floor = 0,               \
+        .low_water = 0.0,         \
+        .nb_idle_ops = 0          \
+    }
+
+static const struct bf_trim_policy bf_builtin_trim_policy =
+    BF_DEFAULT_TRIM_POLICY;
+
+static struct bf_trim_policy bf_default_trim_policy =
+    BF_DEFAULT_TRIM_POLICY;
+
+/* Statistics are only collected when libbuffer is built with BF_WITH_STATS;
+ * otherwise the macros expand to nothing and their arguments are not
+ * evaluated. Each counter is updated both in the buffer and in the global
+ * statistics, the latter with relaxed atomic operations since buffers can be
+ * used by different threads. */
+#ifdef BF_WITH_STATS
+static struct bf_buffer_stats bf_global_stats;
+
+#   define BF_STATS_ADD(buf_, field_, n_)                          \
+    do {                                                           \
+        (buf_)->stats.field_ += (n_);                              \
+        __atomic_add_fetch(&bf_global_stats.field_, (n_),          \
+                           __ATOMIC_RELAXED);                      \
+    } while (0)
+
+#   define BF_STATS_UPDATE_PEAK_SIZE(buf_) \
+    bf_buffer_update_peak_size(buf_)
+#else
+#   define BF_STATS_ADD(buf_, field_, n_) do {} while (0)
+#   define BF_STATS_UPDATE_PEAK_SIZE(buf_) do {} while (0)
+#endif
+
+void
+bf_set_default_growth_policy(const struct bf_growth_policy *policy) {
+    if (policy) {
+        bf_default_growth_policy = *policy;
+    } else {
+        bf_default_growth_policy = bf_builtin_growth_policy;
+    }
+}
+
+void
+bf_set_default_compaction_policy(const struct bf_compaction_policy *policy) {
+    if (policy) {
+        bf_default_compaction_policy = *policy;
+    } else {
+        bf_default_compaction_policy = bf_builtin_compaction_policy;
+    }
+}
+
+void
+bf_set_default_trim_policy(const struct bf_trim_policy *policy) {
+    if (policy) {
+        bf_default_trim_policy = *policy;
+    } else {
+        bf_default_trim_policy = bf_builtin_trim_policy;
+    }
+}
+
+void
+bf_get_buffer_stats(struct bf_buffer_stats *stats) {
+#ifdef BF_WITH_STATS
+#   define BF_STATS_LOAD(field_) \
+    stats->field_ = __atomic_load_n(&bf_global_stats.field_, __ATOMIC_RELAXED)
+
+    BF_STATS_LOAD(nb_reallocs);
+    BF_STATS_LOAD(realloc_bytes);
+    BF_STATS_LOAD(nb_repacks);
+    BF_STATS_LOAD(memmove_bytes);
+    BF_STATS_LOAD(peak_size);
+    BF_STATS_LOAD(nb_reads);
+    BF_STATS_LOAD(read_bytes);
+    BF_STATS_LOAD(nb_writes);
+    BF_STATS_LOAD(write_bytes);
+
+#   undef BF_STATS_LOAD
+#else
+    memset(stats, 0, sizeof(struct bf_buffer_stats));
+#endif
+}
+
+void
+bf_reset_buffer_stats(void) {
+#ifdef BF_WITH_STATS
+#   define BF_STATS_RESET(field_) \
+    __atomic_store_n(&bf_global_stats.field_, 0, __ATOMIC_RELAXED)
+
+    BF_STATS_RESET(nb_reallocs);
+    BF_STATS_RESET(realloc_bytes);
+    BF_STATS_RESET(nb_repacks);
+    BF_STATS_RESET(memmove_bytes);
+    BF_STATS_RESET(peak_size);
+    BF_STATS_RESET(nb_reads);
+    BF_STATS_RESET(read_bytes);
+    BF_STATS_RESET(nb_writes);
+    BF_STATS_RESET(write_bytes);
+
+#   undef BF_STATS_RESET
+#endif
+}
+
 struct bf_buffer *
 bf_buffer_new(size_t initial_size) {
+    return bf_buffer_new_with_allocator(initial_size, NULL);
+}
+
+struct bf_buffer *
+bf_buffer_new_with_allocator(size_t initial_size,
+                             const struct bf_allocator *allocator) {
+    struct bf_buffer *buf;
+
+    buf = bf_allocator_malloc(allocator, sizeof(struct bf_buffer));
+    if (!buf)
+        return NULL;
+
+    memset(buf, 0, sizeof(struct bf_buffer));
+
+    buf->allocator = allocator;
+
+    if (initial_size > 0) {
+        if (bf_buffer_resize(buf, initial_size) == -1) {
+            bf_allocator_free(allocator, buf, sizeof(struct bf_buffer));
+            return NULL;
+        }
+
+        BF_STATS_UPDATE_PEAK_SIZE(buf);
+    }
+
+    return buf;
+}
+
+struct bf_buffer *
+bf_buffer_new_inline(size_t inline_size) {
     struct bf_buffer *buf;
 
-    buf = bf_malloc(sizeof(struct bf_buffer));
+    if (inline_size > SIZE_MAX - sizeof(struct bf_buffer)) {
+        bf_set_error("inline size too large");
+        return NULL;
+    }
+
+    buf = bf_malloc(sizeof(struct bf_buffer) + inline_size);
     if (!buf)
         return NULL;
 
     memset(buf, 0, sizeof(struct bf_buffer));
 
+    buf->inline_sz = inline_size;
+    bf_buffer_reset_storage(buf);
+
+    return buf;
+}
+
+struct bf_buffer *
+bf_buffer_init_inline(void *storage, size_t size) {
+    struct bf_buffer *buf;
+
+    if (size < sizeof(struct bf_buffer)) {
+        bf_set_error("storage too small");
+        return NULL;
+    }
+
+    buf = storage;
+    memset(buf, 0, sizeof(struct bf_buffer));
+
+    buf->inline_sz = size - sizeof(struct bf_buffer);
+    buf->external = 1;
+    bf_buffer_reset_storage(buf);
+
+    return buf;
+}
+
+struct bf_buffer *
+bf_buffer_new_aligned(size_t initial_size, size_t alignment, int flags) {
+    struct bf_buffer *buf;
+    long page_size;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size == -1)
+        page_size = 4096;
+
+    if (alignment == 0)
+        alignment = (size_t)page_size;
+
+    if ((alignment & (alignment - 1)) != 0) {
+        bf_set_error("alignment is not a power of two");
+        return NULL;
+    }
+
+    /* posix_memalign() requires a multiple of the size of a pointer. */
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+
+    buf = bf_buffer_new(0);
+    if (!buf)
+        return NULL;
+
+    buf->storage = BF_STORAGE_ALIGNED;
+    buf->alignment = alignment;
+
+#ifdef BF_PLATFORM_LINUX
+    if (flags & (BF_BUFFER_HUGE_PAGES | BF_BUFFER_HUGETLB)) {
+        if (alignment > BF_HUGE_PAGE_SIZE) {
+            bf_set_error("alignment too large for huge pages");
+            bf_buffer_delete(buf);
+            return NULL;
+        }
+
+        buf->storage = BF_STORAGE_ANON_MAP;
+        buf->flags = flags;
+    }
+#endif
+
     if (initial_size > 0) {
         if (bf_buffer_resize(buf, initial_size) == -1) {
-            bf_free(buf);
+            bf_buffer_delete(buf);
             return NULL;
         }
+
+        BF_STATS_UPDATE_PEAK_SIZE(buf);
+    }
+
+    return buf;
+}
+
+struct bf_buffer *
+bf_buffer_new_mmap(const char *path) {
+    struct bf_buffer *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        bf_set_error("cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    buf = bf_buffer_new_mmap_fd(fd);
+
+    /* The mapping stays valid after the file descriptor is closed. */
+    close(fd);
+
+    return buf;
+}
+
+struct bf_buffer *
+bf_buffer_new_mmap_fd(int fd) {
+    struct bf_buffer *buf;
+    struct stat st;
+    void *data;
+    size_t sz;
+
+    if (fstat(fd, &st) == -1) {
+        bf_set_error("cannot stat file: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        bf_set_error("cannot map a file which is not a regular file");
+        return NULL;
+    }
+
+    if ((uintmax_t)st.st_size > SIZE_MAX) {
+        bf_set_error("file too large");
+        return NULL;
     }
 
+    sz = (size_t)st.st_size;
+
+    buf = bf_buffer_new(0);
+    if (!buf)
+        return NULL;
+
+    /* Empty files cannot be mapped, they are represented by an empty heap
+     * buffer. */
+    if (sz == 0)
+        return buf;
+
+    data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        bf_set_error("cannot map file: %s", strerror(errno));
+        bf_buffer_delete(buf);
+        return NULL;
+    }
+
+    /* Buffers are consumed from the beginning to the end, so the kernel can
+     * read ahead aggressively. These are only hints and can fail safely. */
+    posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(data, sz, POSIX_MADV_WILLNEED);
+
+    buf->data = data;
+    buf->sz = sz;
+    buf->len = sz;
+    buf->storage = BF_STORAGE_FILE_MAP;
+
     return buf;
 }
 
@@ -73,10 +508,68 @@ bf_buffer_delete(struct bf_buffer *buf) {
     if (!buf)
         return;
 
-    bf_free(buf->data);
-    buf->data = NULL;
+    bf_buffer_release_data(buf);
+
+    if (!buf->external) {
+        bf_allocator_free(buf->allocator, buf,
+                          sizeof(struct bf_buffer) + buf->inline_sz);
+    }
+}
+
+void
+bf_buffer_set_growth_policy(struct bf_buffer *buf,
+                            const struct bf_growth_policy *policy) {
+    buf->growth_policy = policy;
+}
+
+void
+bf_buffer_set_compaction_policy(struct bf_buffer *buf,
+                                const struct bf_compaction_policy *policy) {
+    buf->compaction_policy = policy;
+}
+
+void
+bf_buffer_set_trim_policy(struct bf_buffer *buf,
+                          const struct bf_trim_policy *policy) {
+    buf->trim_policy = policy;
+    buf->nb_idle_ops = 0;
+    buf->trim_peak_len = buf->len;
+}
+
+void
+bf_buffer_get_compaction_stats(const struct bf_buffer *buf,
+                               struct bf_compaction_stats *stats) {
+    *stats = buf->compaction_stats;
+}
+
+void
+bf_buffer_set_hash(struct bf_buffer *buf, struct bf_hash *hash) {
+    buf->hash = hash;
+}
 
-    bf_free(buf);
+void
+bf_buffer_get_stats(const struct bf_buffer *buf,
+                    struct bf_buffer_stats *stats) {
+#ifdef BF_WITH_STATS
+    *stats = buf->stats;
+#else
+    memset(stats, 0, sizeof(struct bf_buffer_stats));
+#endif
+}
+
+void
+bf_buffer_reset_stats(struct bf_buffer *buf) {
+#ifdef BF_WITH_STATS
+    memset(&buf->stats, 0, sizeof(struct bf_buffer_stats));
+    buf->stats.peak_size = buf->sz;
+#endif
+}
+
+void
+bf_buffer_get_storage(const struct bf_buffer *buf, void **pdata,
+                      size_t *psz) {
+    *pdata = buf->data;
+    *psz = buf->sz;
 }
 
 void *
@@ -101,18 +594,63 @@ bf_buffer_free_space(const struct bf_buffer *buf) {
 
 void
 bf_buffer_reset(struct bf_buffer *buf) {
-    bf_free(buf->data);
-    buf->data = NULL;
+    bf_buffer_release_data(buf);
+    bf_buffer_reset_storage(buf);
 
-    buf->sz = 0;
     buf->skip = 0;
     buf->len = 0;
 }
 
+int
+bf_buffer_trim(struct bf_buffer *buf, size_t sz) {
+    if (sz < buf->len)
+        sz = buf->len;
+
+    if (sz >= buf->sz)
+        return 0;
+
+    /* Inline storage is part of the buffer, and the memory of file
+     * mappings and shared data does not belong to the buffer. */
+    if (buf->storage == BF_STORAGE_INLINE
+     || buf->storage == BF_STORAGE_FILE_MAP
+     || buf->storage == BF_STORAGE_SHARED) {
+        return 0;
+    }
+
+    if (sz == 0 || (buf->inline_sz > 0 && sz <= buf->inline_sz)) {
+        if (buf->len > 0)
+            memcpy(buf->inline_data, buf->data + buf->skip, buf->len);
+
+        bf_buffer_release_data(buf);
+        bf_buffer_reset_storage(buf);
+
+        buf->skip = 0;
+        return 0;
+    }
+
+    bf_buffer_repack(buf);
+
+    return bf_buffer_resize(buf, sz);
+}
+
 void
 bf_buffer_clear(struct bf_buffer *buf) {
+    if (buf->storage == BF_STORAGE_FILE_MAP) {
+        /* There is no point in keeping a file mapping without content. */
+        bf_buffer_release_data(buf);
+        buf->sz = 0;
+    } else if (buf->storage == BF_STORAGE_SHARED
+            && __atomic_load_n(&buf->shared->refcount, __ATOMIC_ACQUIRE) > 1) {
+        /* Shared data would have to be copied anyway before new data can be
+         * added. */
+        bf_buffer_release_data(buf);
+        bf_buffer_reset_storage(buf);
+    }
+
     buf->skip = 0;
     buf->len = 0;
+
+    bf_buffer_auto_trim(buf);
 }
 
 void
@@ -124,6 +662,8 @@ bf_buffer_truncate(struct bf_buffer *buf, size_t sz) {
 
     if (buf->len == 0)
         buf->skip = 0;
+
+    bf_buffer_auto_trim(buf);
 }
 
 void *
@@ -141,7 +681,7 @@ bf_buffer_increase_length(struct bf_buffer *buf, size_t n) {
         return -1;
     }
 
-    buf->len += n;
+    bf_buffer_commit(buf, n);
     return 0;
 }
 
@@ -149,7 +689,6 @@ int
 bf_buffer_insert(struct bf_buffer *buf, size_t offset, const void *data,
                  size_t sz) {
     char *ndata;
-    size_t nsz;
 
     if (sz == 0)
         return 0;
@@ -159,36 +698,30 @@ bf_buffer_insert(struct bf_buffer *buf, size_t offset, const void *data,
         return -1;
     }
 
-    if (!buf->data) {
-        nsz = sz;
-        if (nsz < 32)
-            nsz = 32;
-
-        buf->sz = sz;
-        buf->data = bf_malloc(sz);
-        if (!buf->data)
-            return -1;
-    } else if (bf_buffer_free_space(buf) < sz) {
-        bf_buffer_repack(buf);
+    /* The hash is computed incrementally, it can only follow data added at
+     * the end of the buffer. */
+    if (offset < buf->len && buf->hash) {
+        bf_set_error("cannot insert data before the end of a hashed buffer");
+        return -1;
+    }
 
-        if (bf_buffer_free_space(buf) < sz) {
-            if (sz > buf->sz) {
-                nsz = buf->sz + sz;
-            } else {
-                nsz = buf->sz * 2;
-            }
+    if (offset < buf->len && bf_buffer_make_writable(buf) == -1)
+        return -1;
 
-            if (bf_buffer_resize(buf, nsz) == -1)
-                return -1;
-        }
-    }
+    if (bf_buffer_ensure_free_space(buf, sz) == -1)
+        return -1;
 
     ndata = buf->data + buf->skip + offset;
 
-    if (offset < buf->len)
+    if (offset < buf->len) {
         memmove(ndata + sz, ndata, buf->len - offset);
+        BF_STATS_ADD(buf, memmove_bytes, buf->len - offset);
+    }
     memcpy(ndata, data, sz);
 
+    if (buf->hash)
+        bf_hash_update(buf->hash, data, sz);
+
     buf->len += sz;
     return 0;
 }
@@ -224,7 +757,8 @@ bf_buffer_add_vprintf(struct bf_buffer *buf, const char *fmt, va_list ap) {
 
     /* We need to make space for \0 because vsnprintf() needs it, even
      * though we will ignore it. */
-    bf_buffer_ensure_free_space(buf, fmt_len + 1);
+    if (bf_buffer_ensure_free_space(buf, fmt_len + 1) == -1)
+        return -1;
 
     for (;;) {
         int ret;
@@ -243,11 +777,12 @@ bf_buffer_add_vprintf(struct bf_buffer *buf, const char *fmt, va_list ap) {
         }
 
         if ((size_t)ret < free_space) {
-            buf->len += (size_t)ret;
+            bf_buffer_commit(buf, (size_t)ret);
             return 0;
         }
 
-        bf_buffer_ensure_free_space(buf, (size_t)ret + 1);
+        if (bf_buffer_ensure_free_space(buf, (size_t)ret + 1) == -1)
+            return -1;
     }
 }
 
@@ -263,37 +798,146 @@ bf_buffer_add_printf(struct bf_buffer *buf, const char *fmt, ...) {
     return ret;
 }
 
-void
-bf_buffer_skip(struct bf_buffer *buf, size_t n) {
-    if (n > buf->len)
-        n = buf->len;
+int
+bf_buffer_add_u64(struct bf_buffer *buf, uint64_t value) {
+    char *ptr;
+    size_t len;
 
-    buf->len -= n;
-    buf->skip += n;
+    len = bf_format_u64(NULL, value);
 
-    if (buf->len == 0)
-        buf->skip = 0;
-}
+    ptr = bf_buffer_reserve(buf, len);
+    if (!ptr)
+        return -1;
 
-size_t
-bf_buffer_remove_before(struct bf_buffer *buf, size_t offset, size_t n) {
-    if (offset > buf->len)
-        offset = buf->len;
+    bf_format_u64(ptr, value);
+    bf_buffer_commit(buf, len);
 
-    if (n > offset)
-        n = offset;
+    return 0;
+}
 
-    if (n == 0)
-        return 0;
+int
+bf_buffer_add_i64(struct bf_buffer *buf, int64_t value) {
+    uint64_t uvalue;
+    char *ptr;
+    size_t len;
 
-    if (offset < buf->len) {
-        char *ptr;
+    if (value >= 0)
+        return bf_buffer_add_u64(buf, (uint64_t)value);
 
-        ptr = buf->data + buf->skip + offset;
-        memmove(ptr - n, ptr, buf->len - offset);
-    }
+    uvalue = (uint64_t)0 - (uint64_t)value;
+    len = bf_format_u64(NULL, uvalue);
 
-    buf->len -= n;
+    ptr = bf_buffer_reserve(buf, len + 1);
+    if (!ptr)
+        return -1;
+
+    ptr[0] = '-';
+    bf_format_u64(ptr + 1, uvalue);
+    bf_buffer_commit(buf, len + 1);
+
+    return 0;
+}
+
+int
+bf_buffer_add_hex(struct bf_buffer *buf, uint64_t value) {
+    return bf_buffer_add_hex_padded(buf, value, 0);
+}
+
+int
+bf_buffer_add_hex_padded(struct bf_buffer *buf, uint64_t value,
+                         size_t width) {
+    static const char digits[] = "0123456789abcdef";
+    size_t len, i;
+    uint64_t tmp;
+    char *ptr;
+
+    len = 1;
+    for (tmp = value >> 4; tmp > 0; tmp >>= 4)
+        len++;
+
+    if (width > len)
+        len = width;
+
+    ptr = bf_buffer_reserve(buf, len);
+    if (!ptr)
+        return -1;
+
+    for (i = len; i > 0; i--) {
+        ptr[i - 1] = digits[value & 0xf];
+        value >>= 4;
+    }
+
+    bf_buffer_commit(buf, len);
+    return 0;
+}
+
+int
+bf_buffer_add_double(struct bf_buffer *buf, double value) {
+    char tmp[32];
+    int precision, ret;
+
+    if (value != value)
+        return bf_buffer_add(buf, "nan", 3);
+
+    if (value > DBL_MAX)
+        return bf_buffer_add(buf, "inf", 3);
+    if (value < -DBL_MAX)
+        return bf_buffer_add(buf, "-inf", 4);
+
+    /* Use the smallest precision which reads back as the same value; 17
+     * significant digits are always enough for a double. */
+    ret = 0;
+    for (precision = 15; precision <= 17; precision++) {
+        ret = snprintf(tmp, sizeof(tmp), "%.*g", precision, value);
+        if (ret < 0 || (size_t)ret >= sizeof(tmp)) {
+            bf_set_error("cannot format number");
+            return -1;
+        }
+
+        if (strtod(tmp, NULL) == value)
+            break;
+    }
+
+    return bf_buffer_add(buf, tmp, (size_t)ret);
+}
+
+void
+bf_buffer_skip(struct bf_buffer *buf, size_t n) {
+    if (n > buf->len)
+        n = buf->len;
+
+    buf->len -= n;
+    buf->skip += n;
+
+    if (buf->len == 0)
+        buf->skip = 0;
+
+    bf_buffer_auto_trim(buf);
+}
+
+size_t
+bf_buffer_remove_before(struct bf_buffer *buf, size_t offset, size_t n) {
+    if (offset > buf->len)
+        offset = buf->len;
+
+    if (n > offset)
+        n = offset;
+
+    if (n == 0)
+        return 0;
+
+    if (bf_buffer_make_writable(buf) == -1)
+        return 0;
+
+    if (offset < buf->len) {
+        char *ptr;
+
+        ptr = buf->data + buf->skip + offset;
+        memmove(ptr - n, ptr, buf->len - offset);
+        BF_STATS_ADD(buf, memmove_bytes, buf->len - offset);
+    }
+
+    buf->len -= n;
 
     if (buf->len == 0)
         buf->skip = 0;
@@ -314,8 +958,12 @@ bf_buffer_remove_after(struct bf_buffer *buf, size_t offset, size_t n) {
     if (n == 0)
         return 0;
 
+    if (bf_buffer_make_writable(buf) == -1)
+        return 0;
+
     ptr = buf->data + buf->skip + offset;
     memmove(ptr, ptr + n, buf->len - offset - n);
+    BF_STATS_ADD(buf, memmove_bytes, buf->len - offset - n);
 
     buf->len -= n;
 
@@ -339,17 +987,31 @@ bf_buffer_extract(struct bf_buffer *buf, size_t *plen) {
         return NULL;
     }
 
-    bf_buffer_repack(buf);
+    if (buf->storage == BF_STORAGE_HEAP) {
+        bf_buffer_repack(buf);
 
-    data = bf_realloc(buf->data, buf->len);
-    if (!data)
-        return NULL;
+        data = bf_allocator_realloc(buf->allocator, buf->data, buf->sz,
+                                    buf->len);
+        if (!data)
+            return NULL;
+    } else {
+        /* The caller frees the memory with the allocator of the buffer, so
+         * the content cannot be returned as it is. */
+        data = bf_allocator_malloc(buf->allocator, buf->len);
+        if (!data)
+            return NULL;
+
+        memcpy(data, buf->data + buf->skip, buf->len);
+        bf_buffer_release_data(buf);
+    }
 
     if (plen)
         *plen = buf->len;
 
     buf->data = NULL;
-    buf->sz = 0;
+    bf_buffer_reset_storage(buf);
+
+    buf->skip = 0;
     buf->len = 0;
 
     return data;
@@ -393,6 +1055,103 @@ bf_buffer_dup_string(const struct bf_buffer *buf) {
     return str;
 }
 
+int
+bf_buffer_slice(struct bf_buffer *buf, size_t offset, size_t len,
+                struct bf_slice *slice) {
+    struct bf_shared *shared;
+    size_t end;
+
+    if (offset > buf->len || len > buf->len - offset) {
+        bf_set_error("invalid slice");
+        return -1;
+    }
+
+    memset(slice, 0, sizeof(struct bf_slice));
+
+    if (len == 0)
+        return 0;
+
+    if (bf_buffer_make_shared(buf) == -1)
+        return -1;
+
+    shared = buf->shared;
+
+    /* Only the owner can append data in place, so it is the only buffer
+     * which can reference data past the frozen offset. */
+    end = buf->skip + offset + len;
+    if (shared->owner == buf && end > shared->frozen)
+        shared->frozen = end;
+
+    bf_shared_retain(shared);
+
+    slice->shared = shared;
+    slice->data = buf->data + buf->skip + offset;
+    slice->len = len;
+
+    return 0;
+}
+
+struct bf_buffer *
+bf_buffer_share(struct bf_buffer *buf) {
+    struct bf_buffer *nbuf;
+    struct bf_shared *shared;
+    size_t end;
+
+    nbuf = bf_buffer_new_with_allocator(0, buf->allocator);
+    if (!nbuf)
+        return NULL;
+
+    if (buf->len == 0)
+        return nbuf;
+
+    if (bf_buffer_make_shared(buf) == -1) {
+        bf_buffer_delete(nbuf);
+        return NULL;
+    }
+
+    shared = buf->shared;
+
+    end = buf->skip + buf->len;
+    if (shared->owner == buf && end > shared->frozen)
+        shared->frozen = end;
+
+    bf_buffer_adopt(nbuf, shared, buf->data + buf->skip, buf->len);
+    return nbuf;
+}
+
+int
+bf_buffer_add_slice(struct bf_buffer *buf, const struct bf_slice *slice) {
+    if (slice->len == 0)
+        return 0;
+
+    if (buf->len > 0)
+        return bf_buffer_add(buf, slice->data, slice->len);
+
+    bf_buffer_release_data(buf);
+    bf_buffer_adopt(buf, slice->shared, slice->data, slice->len);
+
+    if (buf->hash)
+        bf_hash_update(buf->hash, slice->data, slice->len);
+
+    return 0;
+}
+
+void
+bf_slice_dup(const struct bf_slice *slice, struct bf_slice *nslice) {
+    if (slice->shared)
+        bf_shared_retain(slice->shared);
+
+    *nslice = *slice;
+}
+
+void
+bf_slice_release(struct bf_slice *slice) {
+    if (slice->shared)
+        bf_shared_release(slice->shared);
+
+    memset(slice, 0, sizeof(struct bf_slice));
+}
+
 ssize_t
 bf_buffer_read(struct bf_buffer *buf, int fd, size_t n) {
     ssize_t ret;
@@ -403,8 +1162,12 @@ bf_buffer_read(struct bf_buffer *buf, int fd, size_t n) {
         return -1;
 
     ret = read(fd, ptr, n);
-    if (ret > 0)
-        buf->len += (size_t)ret;
+    BF_STATS_ADD(buf, nb_reads, 1);
+
+    if (ret > 0) {
+        BF_STATS_ADD(buf, read_bytes, (size_t)ret);
+        bf_buffer_commit(buf, (size_t)ret);
+    }
 
     return ret;
 }
@@ -414,16 +1177,170 @@ bf_buffer_write(struct bf_buffer *buf, int fd) {
     ssize_t ret;
 
     ret = write(fd, buf->data + buf->skip, buf->len);
+    BF_STATS_ADD(buf, nb_writes, 1);
+
     if (ret > 0) {
+        BF_STATS_ADD(buf, write_bytes, (size_t)ret);
         buf->len -= (size_t)ret;
 
         if (buf->len == 0)
             buf->skip = 0;
+
+        bf_buffer_auto_trim(buf);
     }
 
     return ret;
 }
 
+static size_t
+bf_buffer_next_size(const struct bf_buffer *buf, size_t min_size) {
+    const struct bf_growth_policy *policy;
+    double dsz;
+    size_t sz;
+
+    policy = buf->growth_policy;
+    if (!policy)
+        policy = &bf_default_growth_policy;
+
+    sz = buf->sz;
+
+    if (policy->factor > 1.0) {
+        dsz = (double)buf->sz * policy->factor;
+        sz = (dsz >= (double)SIZE_MAX) ? SIZE_MAX : (size_t)dsz;
+    }
+
+    if (sz - buf->sz < policy->min_step) {
+        if (buf->sz > SIZE_MAX - policy->min_step) {
+            sz = SIZE_MAX;
+        } else {
+            sz = buf->sz + policy->min_step;
+        }
+    }
+
+    if (sz < min_size)
+        sz = min_size;
+
+    if (policy->round_to > 0 && sz % policy->round_to > 0) {
+        if (sz / policy->round_to < SIZE_MAX / policy->round_to)
+            sz = (sz / policy->round_to + 1) * policy->round_to;
+    }
+
+    if (policy->max_size > 0 && sz > policy->max_size)
+        sz = policy->max_size;
+
+    return sz;
+}
+
+static size_t
+bf_format_u64(char *ptr, uint64_t value) {
+    static const char digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    uint64_t tmp;
+    size_t len, i;
+
+    len = 1;
+    for (tmp = value; tmp >= 10; tmp /= 10)
+        len++;
+
+    if (!ptr)
+        return len;
+
+    i = len;
+
+    while (value >= 100) {
+        size_t idx;
+
+        idx = (size_t)(value % 100) * 2;
+        value /= 100;
+
+        ptr[--i] = digits[idx + 1];
+        ptr[--i] = digits[idx];
+    }
+
+    if (value >= 10) {
+        ptr[--i] = digits[value * 2 + 1];
+        ptr[--i] = digits[value * 2];
+    } else {
+        ptr[--i] = (char)('0' + value);
+    }
+
+    return len;
+}
+
+static int
+bf_buffer_should_compact(const struct bf_buffer *buf, size_t sz,
+                         size_t free_space) {
+    const struct bf_compaction_policy *policy;
+
+    policy = buf->compaction_policy;
+    if (!policy)
+        policy = &bf_default_compaction_policy;
+
+    switch (policy->mode) {
+    case BF_COMPACTION_EAGER:
+        return 1;
+
+    case BF_COMPACTION_THRESHOLD:
+        return (double)buf->skip >= policy->threshold * (double)buf->sz;
+
+    case BF_COMPACTION_LAZY:
+        /* Only compact if it avoids growing the buffer; the content would
+         * be copied by the reallocation anyway. */
+        return free_space + buf->skip >= sz;
+    }
+
+    return 0;
+}
+
+static int
+bf_buffer_is_idle(const struct bf_buffer *buf,
+                  const struct bf_trim_policy *policy, size_t level) {
+    return (double)level <= policy->low_water * (double)buf->sz;
+}
+
+static void
+bf_buffer_auto_trim(struct bf_buffer *buf) {
+    const struct bf_trim_policy *policy;
+    size_t target;
+
+    policy = buf->trim_policy;
+    if (!policy)
+        policy = &bf_default_trim_policy;
+
+    if (policy->nb_idle_ops == 0)
+        return;
+
+    if (!bf_buffer_is_idle(buf, policy, buf->len)) {
+        buf->nb_idle_ops = 0;
+        return;
+    }
+
+    if (++buf->nb_idle_ops < policy->nb_idle_ops)
+        return;
+
+    buf->nb_idle_ops = 0;
+
+    /* The buffer must keep enough space for the largest content it had to
+     * store since the previous check, and is only trimmed if it is at least
+     * twice as large as that, so that a buffer whose usage oscillates is
+     * never shrunk and grown back repeatedly. */
+    target = (buf->len > policy->floor) ? buf->len : policy->floor;
+    if (buf->trim_peak_len > target)
+        target = buf->trim_peak_len;
+
+    buf->trim_peak_len = buf->len;
+
+    if (buf->sz / 2 < target)
+        return;
+
+    /* Failing to shrink a buffer is harmless. */
+    bf_buffer_trim(buf, target);
+}
+
 static void
 bf_buffer_repack(struct bf_buffer *buf) {
     if (buf->skip == 0)
@@ -431,21 +1348,44 @@ bf_buffer_repack(struct bf_buffer *buf) {
 
     memmove(buf->data, buf->data + buf->skip, buf->len);
     buf->skip = 0;
+
+    buf->compaction_stats.nb_compactions++;
+    buf->compaction_stats.bytes_moved += buf->len;
+
+    BF_STATS_ADD(buf, nb_repacks, 1);
+    BF_STATS_ADD(buf, memmove_bytes, buf->len);
 }
 
 static int
 bf_buffer_resize(struct bf_buffer *buf, size_t sz) {
     char *ndata;
 
+    if (buf->storage == BF_STORAGE_INLINE)
+        return bf_buffer_spill(buf, sz);
+    if (buf->storage == BF_STORAGE_ALIGNED)
+        return bf_buffer_resize_aligned(buf, sz);
+    if (buf->storage == BF_STORAGE_ANON_MAP)
+        return bf_buffer_resize_map(buf, sz);
+
+    if (bf_buffer_should_map(buf, sz))
+        return bf_buffer_move_to_map(buf, sz);
+
     if (buf->data) {
-        ndata = bf_realloc(buf->data, sz);
+        ndata = bf_allocator_realloc(buf->allocator, buf->data, buf->sz, sz);
+        if (!ndata)
+            return -1;
+
+        /* realloc() only copies data when it cannot resize the memory area
+         * in place. */
+        BF_STATS_ADD(buf, nb_reallocs, 1);
+        if (ndata != buf->data)
+            BF_STATS_ADD(buf, realloc_bytes, (sz < buf->sz) ? sz : buf->sz);
     } else {
-        ndata = bf_malloc(sz);
+        ndata = bf_allocator_malloc(buf->allocator, sz);
+        if (!ndata)
+            return -1;
     }
 
-    if (!ndata)
-        return -1;
-
     buf->data = ndata;
     buf->sz = sz;
     return 0;
@@ -453,16 +1393,619 @@ bf_buffer_resize(struct bf_buffer *buf, size_t sz) {
 
 static int
 bf_buffer_grow(struct bf_buffer *buf, size_t sz) {
-    return bf_buffer_resize(buf, buf->sz + sz);
+    size_t min_size, nsz;
+
+    if (sz > SIZE_MAX - buf->sz) {
+        bf_set_error("buffer size too large");
+        return -1;
+    }
+
+    min_size = buf->sz + sz;
+
+    nsz = bf_buffer_next_size(buf, min_size);
+    if (nsz < min_size) {
+        bf_set_error("buffer size limit reached");
+        return -1;
+    }
+
+    if (bf_buffer_resize(buf, nsz) == -1)
+        return -1;
+
+    BF_STATS_UPDATE_PEAK_SIZE(buf);
+    return 0;
 }
 
 static int
 bf_buffer_ensure_free_space(struct bf_buffer *buf, size_t sz) {
     size_t free_space;
 
+    if (buf->len + sz > buf->trim_peak_len)
+        buf->trim_peak_len = buf->len + sz;
+
+    if (buf->nb_idle_ops > 0) {
+        const struct bf_trim_policy *policy;
+
+        policy = buf->trim_policy;
+        if (!policy)
+            policy = &bf_default_trim_policy;
+
+        /* Any operation which needs more than the low-water mark restarts
+         * the idle period. */
+        if (!bf_buffer_is_idle(buf, policy, buf->len + sz))
+            buf->nb_idle_ops = 0;
+    }
+
+    if (buf->storage == BF_STORAGE_SHARED) {
+        if (bf_buffer_can_append_shared(buf, sz))
+            return 0;
+
+        if (bf_buffer_unshare(buf, sz) == -1)
+            return -1;
+    }
+
+    if (bf_buffer_make_writable(buf) == -1)
+        return -1;
+
     free_space = bf_buffer_free_space(buf);
-    if (free_space < sz)
-        return bf_buffer_grow(buf, sz - free_space);
+    if (free_space >= sz)
+        return 0;
+
+    if (buf->skip > 0 && bf_buffer_should_compact(buf, sz, free_space)) {
+        if (free_space + buf->skip >= sz) {
+            /* Compacting is enough: count the memory we would have
+             * allocated by growing the buffer instead. */
+            buf->compaction_stats.bytes_avoided +=
+                bf_buffer_next_size(buf, buf->sz + sz - free_space) - buf->sz;
+        }
+
+        bf_buffer_repack(buf);
+
+        free_space = bf_buffer_free_space(buf);
+        if (free_space >= sz)
+            return 0;
+    }
+
+    return bf_buffer_grow(buf, sz - free_space);
+}
+
+static int
+bf_buffer_resize_aligned(struct bf_buffer *buf, size_t sz) {
+    void *ndata;
+    int ret;
 
+    ret = posix_memalign(&ndata, buf->alignment, sz);
+    if (ret != 0) {
+        bf_set_error("cannot allocate %zu bytes: %s", sz, strerror(ret));
+        return -1;
+    }
+
+    if (buf->data) {
+        memcpy(ndata, buf->data, (buf->skip + buf->len < sz)
+                                 ? buf->skip + buf->len : sz);
+        free(buf->data);
+
+        BF_STATS_ADD(buf, nb_reallocs, 1);
+        BF_STATS_ADD(buf, realloc_bytes, (buf->skip + buf->len < sz)
+                                         ? buf->skip + buf->len : sz);
+    }
+
+    buf->data = ndata;
+    buf->sz = sz;
+    return 0;
+}
+
+#ifdef BF_PLATFORM_LINUX
+static int
+bf_buffer_resize_map(struct bf_buffer *buf, size_t sz) {
+    size_t page_size;
+    char *ndata;
+
+    if (buf->flags & (BF_BUFFER_HUGE_PAGES | BF_BUFFER_HUGETLB))
+        return bf_buffer_resize_huge_map(buf, sz);
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (sz > SIZE_MAX - page_size) {
+        bf_set_error("buffer size too large");
+        return -1;
+    }
+
+    sz = (sz + page_size - 1) & ~(page_size - 1);
+
+    if (!buf->data) {
+        ndata = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ndata == MAP_FAILED) {
+            bf_set_error("cannot map memory: %s", strerror(errno));
+            return -1;
+        }
+
+        buf->map_sz = sz;
+    } else if (sz <= buf->map_sz) {
+        /* Pages released by a previous shrink are mapped again lazily by
+         * the kernel when they are accessed. */
+        if (sz < buf->sz)
+            madvise(buf->data + sz, buf->map_sz - sz, MADV_DONTNEED);
+
+        ndata = buf->data;
+    } else {
+        ndata = mremap(buf->data, buf->map_sz, sz, MREMAP_MAYMOVE);
+        if (ndata == MAP_FAILED) {
+            bf_set_error("cannot remap memory: %s", strerror(errno));
+            return -1;
+        }
+
+        /* The kernel moves page table entries, no data are copied. */
+        BF_STATS_ADD(buf, nb_reallocs, 1);
+
+        buf->map_sz = sz;
+    }
+
+    buf->data = ndata;
+    buf->sz = sz;
+    return 0;
+}
+
+static int
+bf_buffer_resize_huge_map(struct bf_buffer *buf, size_t sz) {
+    size_t page_size, map_sz;
+    char *addr, *ndata;
+
+    page_size = BF_HUGE_PAGE_SIZE;
+
+    if (sz > SIZE_MAX - page_size * 2) {
+        bf_set_error("buffer size too large");
+        return -1;
+    }
+
+    sz = (sz + page_size - 1) & ~(page_size - 1);
+
+    ndata = MAP_FAILED;
+
+    if (buf->flags & BF_BUFFER_HUGETLB) {
+        ndata = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+
+    if (ndata == MAP_FAILED) {
+        /* Transparent huge pages are only used for memory aligned on the
+         * size of a huge page, so we map more memory than needed and unmap
+         * what is before and after the aligned area. This is also the
+         * fallback when there are no reserved huge pages. */
+        map_sz = sz + page_size;
+
+        addr = mmap(NULL, map_sz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            bf_set_error("cannot map memory: %s", strerror(errno));
+            return -1;
+        }
+
+        ndata = (char *)(((uintptr_t)addr + page_size - 1)
+                         & ~(uintptr_t)(page_size - 1));
+
+        if (ndata > addr)
+            munmap(addr, (size_t)(ndata - addr));
+        if (ndata + sz < addr + map_sz)
+            munmap(ndata + sz, (size_t)(addr + map_sz - (ndata + sz)));
+
+        madvise(ndata, sz, MADV_HUGEPAGE);
+    }
+
+    if (buf->data) {
+        memcpy(ndata, buf->data, (buf->skip + buf->len < sz)
+                                 ? buf->skip + buf->len : sz);
+        munmap(buf->data, buf->map_sz);
+
+        BF_STATS_ADD(buf, nb_reallocs, 1);
+        BF_STATS_ADD(buf, realloc_bytes, (buf->skip + buf->len < sz)
+                                         ? buf->skip + buf->len : sz);
+    }
+
+    buf->data = ndata;
+    buf->sz = sz;
+    buf->map_sz = sz;
+    return 0;
+}
+
+static int
+bf_buffer_should_map(const struct bf_buffer *buf, size_t sz) {
+    const struct bf_growth_policy *policy;
+
+    policy = buf->growth_policy;
+    if (!policy)
+        policy = &bf_default_growth_policy;
+
+    return policy->mmap_threshold > 0 && sz >= policy->mmap_threshold;
+}
+
+static int
+bf_buffer_move_to_map(struct bf_buffer *buf, size_t sz) {
+    char *odata;
+    size_t osz;
+
+    odata = buf->data;
+    osz = buf->sz;
+
+    buf->data = NULL;
+    buf->storage = BF_STORAGE_ANON_MAP;
+    buf->flags = 0;
+
+    if (bf_buffer_resize_map(buf, sz) == -1) {
+        buf->data = odata;
+        buf->storage = BF_STORAGE_HEAP;
+        return -1;
+    }
+
+    if (odata) {
+        memcpy(buf->data, odata, buf->skip + buf->len);
+        bf_allocator_free(buf->allocator, odata, osz);
+
+        BF_STATS_ADD(buf, nb_reallocs, 1);
+        BF_STATS_ADD(buf, realloc_bytes, buf->skip + buf->len);
+    }
+
+    return 0;
+}
+#else
+static int
+bf_buffer_resize_map(struct bf_buffer *buf, size_t sz) {
+    bf_set_error("huge pages are not supported on this platform");
+    return -1;
+}
+
+static int
+bf_buffer_resize_huge_map(struct bf_buffer *buf, size_t sz) {
+    return bf_buffer_resize_map(buf, sz);
+}
+
+static int
+bf_buffer_should_map(const struct bf_buffer *buf, size_t sz) {
+    return 0;
+}
+
+static int
+bf_buffer_move_to_map(struct bf_buffer *buf, size_t sz) {
+    return bf_buffer_resize_map(buf, sz);
+}
+#endif
+
+static int
+bf_buffer_spill(struct bf_buffer *buf, size_t sz) {
+    char *odata;
+
+    odata = buf->data;
+
+    buf->data = NULL;
+    buf->storage = BF_STORAGE_HEAP;
+
+    if (bf_buffer_resize(buf, sz) == -1) {
+        buf->data = odata;
+        buf->storage = BF_STORAGE_INLINE;
+        return -1;
+    }
+
+    memcpy(buf->data, odata, buf->skip + buf->len);
+
+    BF_STATS_ADD(buf, nb_reallocs, 1);
+    BF_STATS_ADD(buf, realloc_bytes, buf->skip + buf->len);
+    return 0;
+}
+
+static void
+bf_buffer_release_data(struct bf_buffer *buf) {
+    struct bf_shared *shared;
+
+    if (!buf->data)
+        return;
+
+    if (buf->storage == BF_STORAGE_SHARED) {
+        shared = buf->shared;
+
+        if (__atomic_load_n(&shared->owner, __ATOMIC_RELAXED) == buf)
+            __atomic_store_n(&shared->owner, NULL, __ATOMIC_RELAXED);
+
+        buf->storage = buf->unshared_storage;
+        buf->shared = NULL;
+
+        bf_shared_release(shared);
+    } else {
+        bf_storage_free(buf->storage, buf->data, buf->sz, buf->map_sz,
+                        buf->allocator);
+        buf->storage = bf_storage_after_release(buf->storage, buf->flags);
+    }
+
+    buf->data = NULL;
+}
+
+static void
+bf_storage_free(enum bf_buffer_storage storage, char *data, size_t sz,
+                size_t map_sz, const struct bf_allocator *allocator) {
+    switch (storage) {
+    case BF_STORAGE_HEAP:
+        bf_allocator_free(allocator, data, sz);
+        break;
+
+    case BF_STORAGE_FILE_MAP:
+        munmap(data, sz);
+        break;
+
+    case BF_STORAGE_ALIGNED:
+        free(data);
+        break;
+
+    case BF_STORAGE_ANON_MAP:
+        munmap(data, map_sz);
+        break;
+
+    case BF_STORAGE_INLINE:
+    case BF_STORAGE_SHARED:
+        break;
+    }
+}
+
+static enum bf_buffer_storage
+bf_storage_after_release(enum bf_buffer_storage storage, int flags) {
+    /* File mappings, and buffers which were moved to a mapping because of
+     * their size, go back to the heap. */
+    if (storage == BF_STORAGE_FILE_MAP)
+        return BF_STORAGE_HEAP;
+    if (storage == BF_STORAGE_ANON_MAP && flags == 0)
+        return BF_STORAGE_HEAP;
+
+    return storage;
+}
+
+static void
+bf_buffer_reset_storage(struct bf_buffer *buf) {
+    if (buf->inline_sz > 0) {
+        buf->data = buf->inline_data;
+        buf->sz = buf->inline_sz;
+        buf->storage = BF_STORAGE_INLINE;
+    } else {
+        buf->sz = 0;
+    }
+}
+
+static int
+bf_buffer_make_writable(struct bf_buffer *buf) {
+    if (buf->storage == BF_STORAGE_SHARED && bf_buffer_unshare(buf, 0) == -1)
+        return -1;
+
+    if (buf->storage != BF_STORAGE_FILE_MAP)
+        return 0;
+
+    return bf_buffer_move_to_heap(buf);
+}
+
+static int
+bf_buffer_move_to_heap(struct bf_buffer *buf) {
+    char *data;
+    size_t sz;
+
+    /* Only the content is copied: data which were skipped are not needed
+     * anymore. */
+    sz = buf->len;
+    data = NULL;
+
+    if (sz > 0) {
+        data = bf_allocator_malloc(buf->allocator, sz);
+        if (!data)
+            return -1;
+
+        memcpy(data, buf->data + buf->skip, sz);
+    }
+
+    bf_buffer_release_data(buf);
+
+    buf->storage = BF_STORAGE_HEAP;
+
+    buf->data = data;
+    buf->sz = sz;
+    buf->skip = 0;
+
+    return 0;
+}
+
+static int
+bf_buffer_make_shared(struct bf_buffer *buf) {
+    struct bf_shared *shared;
+
+    if (buf->storage == BF_STORAGE_SHARED)
+        return 0;
+
+    /* The inline area goes away with the buffer. */
+    if (buf->storage == BF_STORAGE_INLINE) {
+        if (bf_buffer_spill(buf, buf->sz) == -1)
+            return -1;
+    }
+
+    shared = bf_malloc(sizeof(struct bf_shared));
+    if (!shared)
+        return -1;
+
+    memset(shared, 0, sizeof(struct bf_shared));
+
+    shared->refcount = 1;
+
+    shared->data = buf->data;
+    shared->sz = buf->sz;
+    shared->map_sz = buf->map_sz;
+
+    shared->storage = buf->storage;
+    shared->alignment = buf->alignment;
+    shared->allocator = buf->allocator;
+
+    shared->owner = buf;
+
+    buf->unshared_storage = bf_storage_after_release(buf->storage,
+                                                     buf->flags);
+    buf->storage = BF_STORAGE_SHARED;
+    buf->shared = shared;
+
+    return 0;
+}
+
+static void
+bf_buffer_adopt(struct bf_buffer *buf, struct bf_shared *shared,
+                const char *data, size_t len) {
+    bf_shared_retain(shared);
+
+    buf->unshared_storage = buf->storage;
+    buf->storage = BF_STORAGE_SHARED;
+    buf->shared = shared;
+
+    buf->data = shared->data;
+    buf->sz = shared->sz;
+    buf->skip = (size_t)(data - shared->data);
+    buf->len = len;
+}
+
+static int
+bf_buffer_can_append_shared(const struct bf_buffer *buf, size_t sz) {
+    const struct bf_shared *shared;
+
+    shared = buf->shared;
+
+    return __atomic_load_n(&shared->owner, __ATOMIC_RELAXED) == buf
+        && buf->skip + buf->len >= shared->frozen
+        && bf_buffer_free_space(buf) >= sz;
+}
+
+static int
+bf_buffer_can_take_back(const struct bf_buffer *buf,
+                        const struct bf_shared *shared) {
+    enum bf_buffer_storage storage;
+
+    /* The buffer must be able to grow and free the data the same way their
+     * original buffer would have. */
+    storage = buf->unshared_storage;
+
+    switch (shared->storage) {
+    case BF_STORAGE_HEAP:
+        return (storage == BF_STORAGE_HEAP || storage == BF_STORAGE_INLINE)
+            && shared->allocator == buf->allocator;
+
+    case BF_STORAGE_FILE_MAP:
+        return storage == BF_STORAGE_HEAP || storage == BF_STORAGE_INLINE;
+
+    case BF_STORAGE_ALIGNED:
+        return storage == BF_STORAGE_ALIGNED
+            && shared->alignment == buf->alignment;
+
+    case BF_STORAGE_ANON_MAP:
+        return storage == BF_STORAGE_HEAP || storage == BF_STORAGE_INLINE
+            || storage == BF_STORAGE_ANON_MAP;
+
+    case BF_STORAGE_INLINE:
+    case BF_STORAGE_SHARED:
+        break;
+    }
+
+    return 0;
+}
+
+static int
+bf_buffer_unshare(struct bf_buffer *buf, size_t extra) {
+    struct bf_shared *shared;
+    char *odata;
+    size_t osz, oskip, len;
+
+    shared = buf->shared;
+
+    if (__atomic_load_n(&shared->refcount, __ATOMIC_ACQUIRE) == 1
+     && bf_buffer_can_take_back(buf, shared)) {
+        /* Nobody else references the data anymore, there is no need to
+         * copy them. */
+        buf->storage = shared->storage;
+        buf->map_sz = shared->map_sz;
+        buf->shared = NULL;
+
+        bf_free(shared);
+        return 0;
+    }
+
+    if (extra > SIZE_MAX - buf->len) {
+        bf_set_error("buffer size too large");
+        return -1;
+    }
+
+    odata = buf->data;
+    osz = buf->sz;
+    oskip = buf->skip;
+    len = buf->len;
+
+    buf->storage = buf->unshared_storage;
+    buf->shared = NULL;
+
+    buf->data = NULL;
+    buf->skip = 0;
+    buf->len = 0;
+    bf_buffer_reset_storage(buf);
+
+    if (buf->sz < len + extra) {
+        if (bf_buffer_grow(buf, len + extra - buf->sz) == -1) {
+            buf->storage = BF_STORAGE_SHARED;
+            buf->shared = shared;
+
+            buf->data = odata;
+            buf->sz = osz;
+            buf->skip = oskip;
+            buf->len = len;
+            return -1;
+        }
+    }
+
+    memcpy(buf->data, odata + oskip, len);
+    buf->len = len;
+
+    if (__atomic_load_n(&shared->owner, __ATOMIC_RELAXED) == buf)
+        __atomic_store_n(&shared->owner, NULL, __ATOMIC_RELAXED);
+
+    bf_shared_release(shared);
     return 0;
 }
+
+static void
+bf_shared_retain(struct bf_shared *shared) {
+    __atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+bf_shared_release(struct bf_shared *shared) {
+    if (__atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    bf_storage_free(shared->storage, shared->data, shared->sz,
+                    shared->map_sz, shared->allocator);
+    bf_free(shared);
+}
+
+static void
+bf_buffer_commit(struct bf_buffer *buf, size_t n) {
+    /* Data written in the free space are hashed right away, while they are
+     * still in the cache. */
+    if (buf->hash)
+        bf_hash_update(buf->hash, buf->data + buf->skip + buf->len, n);
+
+    buf->len += n;
+}
+
+#ifdef BF_WITH_STATS
+static void
+bf_buffer_update_peak_size(struct bf_buffer *buf) {
+    size_t peak_size;
+
+    if (buf->sz > buf->stats.peak_size)
+        buf->stats.peak_size = buf->sz;
+
+    peak_size = __atomic_load_n(&bf_global_stats.peak_size, __ATOMIC_RELAXED);
+    while (buf->sz > peak_size) {
+        if (__atomic_compare_exchange_n(&bf_global_stats.peak_size,
+                                        &peak_size, buf->sz, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+#endif
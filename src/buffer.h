@@ -18,8 +18,22 @@
 #define LIBBUFFER_BUFFER_H
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <sys/types.h>
+
+#define BF_BUFFER_HEADER_SIZE 256
+
+/* Declare storage suitable for bf_buffer_init_inline() with room for
+ * inline_size_ bytes of content. */
+#define BF_BUFFER_STORAGE(name_, inline_size_)                   \
+    union {                                                      \
+        long double align_;                                      \
+        void *ptr_;                                              \
+        char data_[BF_BUFFER_HEADER_SIZE + (inline_size_)];      \
+    } name_
+
 struct bf_memory_allocator {
    void *(*malloc)(size_t);
    void (*free)(void *);
@@ -29,6 +43,154 @@ struct bf_memory_allocator {
 
 extern struct bf_memory_allocator *bf_default_memory_allocator;
 
+#define BF_MEMORY_NB_SIZE_CLASSES 64
+
+struct bf_memory_stats {
+    size_t nb_allocs;
+    size_t nb_reallocs;
+    size_t nb_frees;
+
+    size_t live_bytes;
+    size_t peak_bytes;
+
+    size_t size_classes[BF_MEMORY_NB_SIZE_CLASSES];
+};
+
+struct bf_memory_site {
+    const char *name;
+
+    size_t nb_allocs;
+    size_t total_bytes;
+    size_t live_bytes;
+};
+
+struct bf_allocator {
+    void *(*allocate)(void *, size_t);
+    void (*deallocate)(void *, void *, size_t);
+    void *(*reallocate)(void *, void *, size_t, size_t);
+
+    void *ctx;
+};
+
+struct bf_growth_policy {
+    double factor;
+    size_t min_step;
+    size_t round_to;
+    size_t max_size;
+    size_t mmap_threshold;
+};
+
+enum bf_compaction_mode {
+    BF_COMPACTION_EAGER,
+    BF_COMPACTION_THRESHOLD,
+    BF_COMPACTION_LAZY,
+};
+
+struct bf_compaction_policy {
+    enum bf_compaction_mode mode;
+    double threshold;
+};
+
+struct bf_trim_policy {
+    size_t floor;
+    double low_water;
+    size_t nb_idle_ops;
+};
+
+struct bf_compaction_stats {
+    size_t nb_compactions;
+    size_t bytes_moved;
+    size_t bytes_avoided;
+};
+
+struct bf_buffer_stats {
+    size_t nb_reallocs;
+    size_t realloc_bytes;
+    size_t nb_repacks;
+    size_t memmove_bytes;
+    size_t peak_size;
+
+    size_t nb_reads;
+    size_t read_bytes;
+    size_t nb_writes;
+    size_t write_bytes;
+};
+
+struct bf_reader {
+    struct bf_buffer *buf;
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+};
+
+struct bf_slice {
+    struct bf_shared *shared;
+    const void *data;
+    size_t len;
+};
+
+enum bf_hash_type {
+    BF_HASH_CRC32C,
+    BF_HASH_XXH64,
+};
+
+struct bf_hash {
+    enum bf_hash_type type;
+    uint64_t seed;
+    uint64_t len;
+
+    uint64_t state[4];
+    unsigned char tail[32];
+    size_t tail_sz;
+};
+
+struct bf_buffer_pool_stats {
+    size_t nb_hits;
+    size_t nb_misses;
+};
+
+enum bf_buffer_flag {
+    BF_BUFFER_HUGE_PAGES = 0x01,
+    BF_BUFFER_HUGETLB    = 0x02,
+};
+
+enum bf_uring_flag {
+    BF_URING_FALLBACK = 0x01,
+};
+
+enum bf_uring_op {
+    BF_URING_READ,
+    BF_URING_WRITE,
+};
+
+struct bf_uring_completion {
+    struct bf_buffer *buf;
+    int fd;
+    enum bf_uring_op op;
+
+    ssize_t result;
+    int error;
+
+    void *udata;
+};
+
+enum bf_filter_codec {
+    BF_FILTER_DEFLATE,
+    BF_FILTER_GZIP,
+    BF_FILTER_LZ,
+};
+
+enum bf_filter_mode {
+    BF_FILTER_COMPRESS,
+    BF_FILTER_DECOMPRESS,
+};
+
+enum bf_filter_flush {
+    BF_FILTER_NO_FLUSH,
+    BF_FILTER_FLUSH,
+    BF_FILTER_FINISH,
+};
+
 const char *bf_version(void);
 const char *bf_build_id(void);
 
@@ -41,15 +203,59 @@ void bf_free(void *);
 void *bf_calloc(size_t, size_t);
 void *bf_realloc(void *, size_t);
 
+void bf_get_memory_stats(struct bf_memory_stats *);
+size_t bf_get_memory_sites(struct bf_memory_site *, size_t);
+void bf_reset_memory_stats(void);
+int bf_dump_memory_trace(struct bf_buffer *);
+
+void bf_set_default_growth_policy(const struct bf_growth_policy *);
+void bf_set_default_compaction_policy(const struct bf_compaction_policy *);
+void bf_set_default_trim_policy(const struct bf_trim_policy *);
+
+void bf_get_buffer_stats(struct bf_buffer_stats *);
+void bf_reset_buffer_stats(void);
+
+uint32_t bf_crc32c(uint32_t, const void *, size_t);
+uint64_t bf_xxh64(const void *, size_t, uint64_t);
+
+void bf_hash_init(struct bf_hash *, enum bf_hash_type, uint64_t);
+void bf_hash_update(struct bf_hash *, const void *, size_t);
+uint64_t bf_hash_digest(const struct bf_hash *);
+
+struct bf_arena *bf_arena_new(size_t);
+void bf_arena_delete(struct bf_arena *);
+void bf_arena_reset(struct bf_arena *);
+const struct bf_allocator *bf_arena_allocator(struct bf_arena *);
+
 struct bf_buffer *bf_buffer_new(size_t);
+struct bf_buffer *bf_buffer_new_with_allocator(size_t,
+                                               const struct bf_allocator *);
+struct bf_buffer *bf_buffer_new_inline(size_t);
+struct bf_buffer *bf_buffer_init_inline(void *, size_t);
+struct bf_buffer *bf_buffer_new_aligned(size_t, size_t, int);
+struct bf_buffer *bf_buffer_new_mmap(const char *);
+struct bf_buffer *bf_buffer_new_mmap_fd(int);
 void bf_buffer_delete(struct bf_buffer *);
 
+void bf_buffer_set_growth_policy(struct bf_buffer *,
+                                 const struct bf_growth_policy *);
+void bf_buffer_set_compaction_policy(struct bf_buffer *,
+                                     const struct bf_compaction_policy *);
+void bf_buffer_set_trim_policy(struct bf_buffer *,
+                               const struct bf_trim_policy *);
+void bf_buffer_get_compaction_stats(const struct bf_buffer *,
+                                    struct bf_compaction_stats *);
+void bf_buffer_set_hash(struct bf_buffer *, struct bf_hash *);
+void bf_buffer_get_stats(const struct bf_buffer *, struct bf_buffer_stats *);
+void bf_buffer_reset_stats(struct bf_buffer *);
+
 void *bf_buffer_data(const struct bf_buffer *);
 size_t bf_buffer_length(const struct bf_buffer *);
 size_t bf_buffer_size(const struct bf_buffer *);
 size_t bf_buffer_free_space(const struct bf_buffer *);
 
 void bf_buffer_reset(struct bf_buffer *);
+int bf_buffer_trim(struct bf_buffer *, size_t);
 void bf_buffer_clear(struct bf_buffer *);
 void bf_buffer_truncate(struct bf_buffer *, size_t);
 
@@ -62,18 +268,185 @@ int bf_buffer_add_string(struct bf_buffer *, const char *);
 int bf_buffer_add_vprintf(struct bf_buffer *, const char *, va_list);
 int bf_buffer_add_printf(struct bf_buffer *, const char *, ...)
     __attribute__((format(printf, 2, 3)));
+int bf_buffer_add_u64(struct bf_buffer *, uint64_t);
+int bf_buffer_add_i64(struct bf_buffer *, int64_t);
+int bf_buffer_add_hex(struct bf_buffer *, uint64_t);
+int bf_buffer_add_hex_padded(struct bf_buffer *, uint64_t, size_t);
+int bf_buffer_add_double(struct bf_buffer *, double);
 
 void bf_buffer_skip(struct bf_buffer *, size_t);
 size_t bf_buffer_remove_before(struct bf_buffer *, size_t, size_t);
 size_t bf_buffer_remove_after(struct bf_buffer *, size_t, size_t);
 size_t bf_buffer_remove(struct bf_buffer *, size_t);
 
+ssize_t bf_buffer_find(const struct bf_buffer *, size_t, int);
+ssize_t bf_buffer_find_any(const struct bf_buffer *, size_t,
+                           const char *, size_t);
+ssize_t bf_buffer_find_not_any(const struct bf_buffer *, size_t,
+                               const char *, size_t);
+ssize_t bf_buffer_find_mem(const struct bf_buffer *, size_t,
+                           const void *, size_t);
+ssize_t bf_buffer_find_string(const struct bf_buffer *, size_t, const char *);
+
 void *bf_buffer_extract(struct bf_buffer *, size_t *);
 char *bf_buffer_extract_string(struct bf_buffer *, size_t *);
 void *bf_buffer_dup(const struct bf_buffer *);
 char *bf_buffer_dup_string(const struct bf_buffer *);
 
+int bf_buffer_slice(struct bf_buffer *, size_t, size_t, struct bf_slice *);
+struct bf_buffer *bf_buffer_share(struct bf_buffer *);
+int bf_buffer_add_slice(struct bf_buffer *, const struct bf_slice *);
+
+void bf_slice_dup(const struct bf_slice *, struct bf_slice *);
+void bf_slice_release(struct bf_slice *);
+
 ssize_t bf_buffer_read(struct bf_buffer *, int, size_t);
 ssize_t bf_buffer_write(struct bf_buffer *, int);
+ssize_t bf_buffer_vmsplice(struct bf_buffer *, int, struct bf_slice *);
+
+int bf_buffer_put_u8(struct bf_buffer *, uint8_t);
+int bf_buffer_put_be16(struct bf_buffer *, uint16_t);
+int bf_buffer_put_be32(struct bf_buffer *, uint32_t);
+int bf_buffer_put_be64(struct bf_buffer *, uint64_t);
+int bf_buffer_put_le16(struct bf_buffer *, uint16_t);
+int bf_buffer_put_le32(struct bf_buffer *, uint32_t);
+int bf_buffer_put_le64(struct bf_buffer *, uint64_t);
+int bf_buffer_put_uvarint(struct bf_buffer *, uint64_t);
+int bf_buffer_put_svarint(struct bf_buffer *, int64_t);
+int bf_buffer_put_blob(struct bf_buffer *, const void *, size_t);
+
+void bf_reader_init(struct bf_reader *, struct bf_buffer *);
+size_t bf_reader_position(const struct bf_reader *);
+size_t bf_reader_remaining(const struct bf_reader *);
+void bf_reader_rewind(struct bf_reader *);
+void bf_reader_commit(struct bf_reader *);
+
+int bf_reader_skip(struct bf_reader *, size_t);
+int bf_reader_get_u8(struct bf_reader *, uint8_t *);
+int bf_reader_get_be16(struct bf_reader *, uint16_t *);
+int bf_reader_get_be32(struct bf_reader *, uint32_t *);
+int bf_reader_get_be64(struct bf_reader *, uint64_t *);
+int bf_reader_get_le16(struct bf_reader *, uint16_t *);
+int bf_reader_get_le32(struct bf_reader *, uint32_t *);
+int bf_reader_get_le64(struct bf_reader *, uint64_t *);
+int bf_reader_get_uvarint(struct bf_reader *, uint64_t *);
+int bf_reader_get_svarint(struct bf_reader *, int64_t *);
+int bf_reader_get_blob(struct bf_reader *, const void **, size_t *);
+
+struct bf_framer *bf_framer_new(struct bf_buffer *, const void *, size_t);
+void bf_framer_delete(struct bf_framer *);
+
+void bf_framer_reset(struct bf_framer *);
+int bf_framer_next(struct bf_framer *, const void **, size_t *);
+
+struct bf_buffer_pool *bf_buffer_pool_new(size_t);
+void bf_buffer_pool_delete(struct bf_buffer_pool *);
+
+struct bf_buffer *bf_buffer_pool_get(struct bf_buffer_pool *, size_t);
+void bf_buffer_pool_release(struct bf_buffer_pool *, struct bf_buffer *);
+void bf_buffer_pool_flush_thread_cache(struct bf_buffer_pool *);
+
+void bf_buffer_pool_get_stats(struct bf_buffer_pool *,
+                              struct bf_buffer_pool_stats *);
+
+struct bf_chain *bf_chain_new(size_t);
+void bf_chain_delete(struct bf_chain *);
+
+size_t bf_chain_length(const struct bf_chain *);
+size_t bf_chain_segment_size(const struct bf_chain *);
+
+void bf_chain_clear(struct bf_chain *);
+
+void *bf_chain_reserve(struct bf_chain *, size_t);
+int bf_chain_increase_length(struct bf_chain *, size_t);
+int bf_chain_add(struct bf_chain *, const void *, size_t);
+int bf_chain_add_buffer(struct bf_chain *, const struct bf_buffer *);
+int bf_chain_add_string(struct bf_chain *, const char *);
+int bf_chain_add_slice(struct bf_chain *, const struct bf_slice *);
+
+void bf_chain_skip(struct bf_chain *, size_t);
+
+ssize_t bf_chain_read(struct bf_chain *, int, size_t);
+ssize_t bf_chain_write(struct bf_chain *, int);
+
+struct bf_ring *bf_ring_new(size_t);
+void bf_ring_delete(struct bf_ring *);
+
+void *bf_ring_data(const struct bf_ring *);
+size_t bf_ring_length(const struct bf_ring *);
+size_t bf_ring_size(const struct bf_ring *);
+size_t bf_ring_free_space(const struct bf_ring *);
+
+void bf_ring_clear(struct bf_ring *);
+
+void *bf_ring_reserve(struct bf_ring *, size_t);
+int bf_ring_increase_length(struct bf_ring *, size_t);
+int bf_ring_add(struct bf_ring *, const void *, size_t);
+
+void bf_ring_skip(struct bf_ring *, size_t);
+
+ssize_t bf_ring_read(struct bf_ring *, int, size_t);
+ssize_t bf_ring_write(struct bf_ring *, int);
+
+struct bf_queue *bf_queue_new(size_t);
+void bf_queue_delete(struct bf_queue *);
+
+size_t bf_queue_size(const struct bf_queue *);
+
+size_t bf_queue_free_space(struct bf_queue *);
+void *bf_queue_reserve(struct bf_queue *, size_t);
+int bf_queue_increase_length(struct bf_queue *, size_t);
+int bf_queue_add(struct bf_queue *, const void *, size_t);
+ssize_t bf_queue_read(struct bf_queue *, int, size_t);
+
+void *bf_queue_data(const struct bf_queue *);
+size_t bf_queue_length(struct bf_queue *);
+void bf_queue_skip(struct bf_queue *, size_t);
+ssize_t bf_queue_write(struct bf_queue *, int);
+
+struct bf_log *bf_log_new(size_t);
+void bf_log_delete(struct bf_log *);
+
+size_t bf_log_size(const struct bf_log *);
+
+void *bf_log_reserve(struct bf_log *, size_t);
+int bf_log_commit(struct bf_log *, void *, size_t);
+int bf_log_add(struct bf_log *, const void *, size_t);
+int bf_log_add_vprintf(struct bf_log *, const char *, va_list);
+int bf_log_add_printf(struct bf_log *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+
+size_t bf_log_drain(struct bf_log *, struct bf_buffer *);
+ssize_t bf_log_write(struct bf_log *, int);
+
+struct bf_filter *bf_filter_new(enum bf_filter_codec, enum bf_filter_mode,
+                                int);
+void bf_filter_delete(struct bf_filter *);
+
+void bf_filter_reset(struct bf_filter *);
+int bf_filter_process(struct bf_filter *, struct bf_buffer *,
+                      struct bf_buffer *, enum bf_filter_flush);
+
+struct bf_relay *bf_relay_new(void);
+void bf_relay_delete(struct bf_relay *);
+
+size_t bf_relay_length(const struct bf_relay *);
+
+ssize_t bf_relay_read(struct bf_relay *, int, size_t);
+ssize_t bf_relay_write(struct bf_relay *, int);
+
+ssize_t bf_send_file(int, int, off_t *, size_t);
+
+struct bf_uring *bf_uring_new(unsigned int, int);
+void bf_uring_delete(struct bf_uring *);
+
+int bf_uring_is_native(const struct bf_uring *);
+int bf_uring_register_buffers(struct bf_uring *, struct bf_buffer **, size_t);
+
+int bf_uring_queue_read(struct bf_uring *, struct bf_buffer *, int, size_t,
+                        void *);
+int bf_uring_queue_write(struct bf_uring *, struct bf_buffer *, int, void *);
+int bf_uring_submit(struct bf_uring *, unsigned int);
+int bf_uring_next_completion(struct bf_uring *, struct bf_uring_completion *);
 
 #endif
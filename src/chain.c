@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#ifndef IOV_MAX
+#   define IOV_MAX 1024
+#endif
+
+#define BF_CHAIN_DEFAULT_SEGMENT_SIZE 16384U
+#define BF_CHAIN_MAX_FREE_SEGMENTS    4U
+
+/*
+ *         head                                           tail
+ *   +-------------+        +-------------+        +-------------+
+ *   |    |########| -----> |#############| -----> |#######|     |
+ *   +-------------+        +-------------+        +-------------+
+ *    skip   len                  len                 len    free
+ *
+ * Data are appended to the tail segment; a new segment is linked when it is
+ * full, so stored data are never moved. Segments emptied by bf_chain_skip()
+ * are kept in a small free list and reused before allocating new ones.
+ *
+ * Slices are linked as segments which point to the shared data instead of
+ * copying them; these segments have no free space and are freed as soon as
+ * they are emptied.
+ */
+
+struct bf_chain_segment {
+    struct bf_chain_segment *next;
+
+    char *ptr;
+    size_t sz;
+    size_t skip;
+    size_t len;
+
+    struct bf_slice slice;
+
+    char data[];
+};
+
+struct bf_chain {
+    struct bf_chain_segment *head;
+    struct bf_chain_segment *tail;
+
+    struct bf_chain_segment *free_segments;
+    size_t nb_free_segments;
+
+    size_t segment_size;
+    size_t len;
+};
+
+static struct bf_chain_segment *bf_chain_segment_get(struct bf_chain *);
+static void bf_chain_segment_link(struct bf_chain *,
+                                  struct bf_chain_segment *);
+static void bf_chain_segment_release(struct bf_chain *,
+                                     struct bf_chain_segment *);
+static struct bf_chain_segment *bf_chain_tail_with_free_space(struct bf_chain *);
+
+struct bf_chain *
+bf_chain_new(size_t segment_size) {
+    struct bf_chain *chain;
+
+    chain = bf_malloc(sizeof(struct bf_chain));
+    if (!chain)
+        return NULL;
+
+    memset(chain, 0, sizeof(struct bf_chain));
+
+    if (segment_size == 0)
+        segment_size = BF_CHAIN_DEFAULT_SEGMENT_SIZE;
+
+    chain->segment_size = segment_size;
+
+    return chain;
+}
+
+void
+bf_chain_delete(struct bf_chain *chain) {
+    struct bf_chain_segment *segment, *next;
+
+    if (!chain)
+        return;
+
+    segment = chain->head;
+    while (segment) {
+        next = segment->next;
+        bf_slice_release(&segment->slice);
+        bf_free(segment);
+        segment = next;
+    }
+
+    segment = chain->free_segments;
+    while (segment) {
+        next = segment->next;
+        bf_free(segment);
+        segment = next;
+    }
+
+    bf_free(chain);
+}
+
+size_t
+bf_chain_length(const struct bf_chain *chain) {
+    return chain->len;
+}
+
+size_t
+bf_chain_segment_size(const struct bf_chain *chain) {
+    return chain->segment_size;
+}
+
+void
+bf_chain_clear(struct bf_chain *chain) {
+    bf_chain_skip(chain, chain->len);
+}
+
+void *
+bf_chain_reserve(struct bf_chain *chain, size_t sz) {
+    struct bf_chain_segment *segment;
+
+    if (sz > chain->segment_size) {
+        bf_set_error("reservation larger than segment size");
+        return NULL;
+    }
+
+    segment = chain->tail;
+    if (!segment || segment->sz - segment->skip - segment->len < sz) {
+        segment = bf_chain_segment_get(chain);
+        if (!segment)
+            return NULL;
+    }
+
+    return segment->ptr + segment->skip + segment->len;
+}
+
+int
+bf_chain_increase_length(struct bf_chain *chain, size_t n) {
+    struct bf_chain_segment *segment;
+
+    segment = chain->tail;
+    if (!segment || n > segment->sz - segment->skip - segment->len) {
+        bf_set_error("length increment too large");
+        return -1;
+    }
+
+    segment->len += n;
+    chain->len += n;
+    return 0;
+}
+
+int
+bf_chain_add(struct bf_chain *chain, const void *data, size_t sz) {
+    const char *ptr;
+
+    ptr = data;
+
+    while (sz > 0) {
+        struct bf_chain_segment *segment;
+        size_t free_space, n;
+
+        segment = bf_chain_tail_with_free_space(chain);
+        if (!segment)
+            return -1;
+
+        free_space = segment->sz - segment->skip - segment->len;
+        n = (sz < free_space) ? sz : free_space;
+
+        memcpy(segment->ptr + segment->skip + segment->len, ptr, n);
+        segment->len += n;
+        chain->len += n;
+
+        ptr += n;
+        sz -= n;
+    }
+
+    return 0;
+}
+
+int
+bf_chain_add_buffer(struct bf_chain *chain, const struct bf_buffer *buf) {
+    return bf_chain_add(chain, bf_buffer_data(buf), bf_buffer_length(buf));
+}
+
+int
+bf_chain_add_string(struct bf_chain *chain, const char *str) {
+    return bf_chain_add(chain, str, strlen(str));
+}
+
+int
+bf_chain_add_slice(struct bf_chain *chain, const struct bf_slice *slice) {
+    struct bf_chain_segment *segment;
+
+    if (slice->len == 0)
+        return 0;
+
+    segment = bf_malloc(sizeof(struct bf_chain_segment));
+    if (!segment)
+        return -1;
+
+    bf_slice_dup(slice, &segment->slice);
+
+    /* The segment is never written to since it has no free space. */
+    segment->ptr = (char *)slice->data;
+    segment->sz = slice->len;
+    segment->skip = 0;
+    segment->len = slice->len;
+
+    bf_chain_segment_link(chain, segment);
+    chain->len += slice->len;
+
+    return 0;
+}
+
+void
+bf_chain_skip(struct bf_chain *chain, size_t n) {
+    if (n > chain->len)
+        n = chain->len;
+
+    chain->len -= n;
+
+    while (n > 0) {
+        struct bf_chain_segment *segment;
+
+        segment = chain->head;
+
+        if (n < segment->len) {
+            segment->skip += n;
+            segment->len -= n;
+            break;
+        }
+
+        n -= segment->len;
+
+        chain->head = segment->next;
+        if (!chain->head)
+            chain->tail = NULL;
+
+        bf_chain_segment_release(chain, segment);
+    }
+
+    if (chain->head && chain->head->len == 0 && chain->head == chain->tail)
+        chain->head->skip = 0;
+}
+
+ssize_t
+bf_chain_read(struct bf_chain *chain, int fd, size_t n) {
+    struct bf_chain_segment *segment;
+    size_t free_space;
+    ssize_t ret;
+
+    segment = bf_chain_tail_with_free_space(chain);
+    if (!segment)
+        return -1;
+
+    free_space = segment->sz - segment->skip - segment->len;
+    if (n > free_space)
+        n = free_space;
+
+    ret = read(fd, segment->ptr + segment->skip + segment->len, n);
+    if (ret > 0) {
+        segment->len += (size_t)ret;
+        chain->len += (size_t)ret;
+    }
+
+    return ret;
+}
+
+ssize_t
+bf_chain_write(struct bf_chain *chain, int fd) {
+    struct iovec iov[IOV_MAX];
+    struct bf_chain_segment *segment;
+    int nb_iov;
+    ssize_t ret;
+
+    nb_iov = 0;
+
+    segment = chain->head;
+    while (segment && nb_iov < IOV_MAX) {
+        if (segment->len > 0) {
+            iov[nb_iov].iov_base = segment->ptr + segment->skip;
+            iov[nb_iov].iov_len = segment->len;
+            nb_iov++;
+        }
+
+        segment = segment->next;
+    }
+
+    if (nb_iov == 0)
+        return 0;
+
+    ret = writev(fd, iov, nb_iov);
+    if (ret > 0)
+        bf_chain_skip(chain, (size_t)ret);
+
+    return ret;
+}
+
+static struct bf_chain_segment *
+bf_chain_segment_get(struct bf_chain *chain) {
+    struct bf_chain_segment *segment;
+
+    if (chain->free_segments) {
+        segment = chain->free_segments;
+        chain->free_segments = segment->next;
+        chain->nb_free_segments--;
+    } else {
+        segment = bf_malloc(sizeof(struct bf_chain_segment)
+                            + chain->segment_size);
+        if (!segment)
+            return NULL;
+    }
+
+    segment->ptr = segment->data;
+    segment->sz = chain->segment_size;
+    segment->skip = 0;
+    segment->len = 0;
+
+    memset(&segment->slice, 0, sizeof(struct bf_slice));
+
+    bf_chain_segment_link(chain, segment);
+    return segment;
+}
+
+static void
+bf_chain_segment_link(struct bf_chain *chain,
+                      struct bf_chain_segment *segment) {
+    segment->next = NULL;
+
+    if (chain->tail) {
+        chain->tail->next = segment;
+    } else {
+        chain->head = segment;
+    }
+
+    chain->tail = segment;
+}
+
+static void
+bf_chain_segment_release(struct bf_chain *chain,
+                         struct bf_chain_segment *segment) {
+    if (segment->slice.shared) {
+        bf_slice_release(&segment->slice);
+        bf_free(segment);
+        return;
+    }
+
+    if (chain->nb_free_segments >= BF_CHAIN_MAX_FREE_SEGMENTS) {
+        bf_free(segment);
+        return;
+    }
+
+    segment->next = chain->free_segments;
+    chain->free_segments = segment;
+    chain->nb_free_segments++;
+}
+
+static struct bf_chain_segment *
+bf_chain_tail_with_free_space(struct bf_chain *chain) {
+    struct bf_chain_segment *segment;
+
+    segment = chain->tail;
+    if (segment && segment->skip + segment->len < segment->sz)
+        return segment;
+
+    return bf_chain_segment_get(chain);
+}
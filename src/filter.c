@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BF_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_FILTER_CHUNK_SIZE 16384U
+
+#define BF_LZ_MAGIC          "BFLZ"
+#define BF_LZ_BLOCK_SIZE     65536U
+#define BF_LZ_HASH_BITS      12
+#define BF_LZ_MIN_MATCH      4U
+#define BF_LZ_LAST_LITERALS  5U
+#define BF_LZ_MF_LIMIT       12U
+#define BF_LZ_STORED         0x80000000U
+
+#define BF_LZ_BOUND(n_) ((n_) + (n_) / 255 + 16)
+
+/*
+ * A filter reads data from an input buffer and writes the result to an
+ * output buffer. Output data are written directly in the free space of the
+ * output buffer, at most BF_FILTER_CHUNK_SIZE bytes at a time for zlib
+ * codecs, and processed input data are skipped.
+ *
+ * The built-in LZ codec splits data into blocks of at most BF_LZ_BLOCK_SIZE
+ * bytes, each one compressed independently using the LZ4 block format:
+ *
+ *   stream = "BFLZ" block* end
+ *   block  = header:u32le data
+ *   end    = 0:u32le
+ *
+ * The header contains the size of the block data, with the highest bit set
+ * if the block is stored uncompressed. Blocks are compressed directly from
+ * the content of the input buffer, so the compressor waits for a full block
+ * unless it is asked to flush; the decompressor waits for a whole block to be
+ * available in the input buffer.
+ */
+
+struct bf_filter {
+    enum bf_filter_codec codec;
+    enum bf_filter_mode mode;
+    int level;
+
+    int started;
+    int finished;
+
+#ifdef BF_WITH_ZLIB
+    z_stream zs;
+#endif
+
+    uint16_t *lz_table;
+};
+
+static int bf_filter_process_lz(struct bf_filter *, struct bf_buffer *,
+                                struct bf_buffer *, enum bf_filter_flush);
+static int bf_filter_compress_lz(struct bf_filter *, struct bf_buffer *,
+                                 struct bf_buffer *, enum bf_filter_flush);
+static int bf_filter_decompress_lz(struct bf_filter *, struct bf_buffer *,
+                                   struct bf_buffer *);
+
+static size_t bf_lz_compress_block(uint16_t *, const uint8_t *, size_t,
+                                   uint8_t *);
+static int bf_lz_decompress_block(const uint8_t *, size_t, uint8_t *, size_t,
+                                  size_t *);
+static uint8_t *bf_lz_put_length(uint8_t *, size_t);
+static uint32_t bf_lz_read32(const uint8_t *);
+static void bf_lz_write32(uint8_t *, uint32_t);
+
+#ifdef BF_WITH_ZLIB
+static int bf_filter_init_zlib(struct bf_filter *);
+static int bf_filter_process_zlib(struct bf_filter *, struct bf_buffer *,
+                                  struct bf_buffer *, enum bf_filter_flush);
+#endif
+
+struct bf_filter *
+bf_filter_new(enum bf_filter_codec codec, enum bf_filter_mode mode,
+              int level) {
+    struct bf_filter *filter;
+
+    filter = bf_malloc(sizeof(struct bf_filter));
+    if (!filter)
+        return NULL;
+
+    memset(filter, 0, sizeof(struct bf_filter));
+
+    filter->codec = codec;
+    filter->mode = mode;
+    filter->level = level;
+
+    switch (codec) {
+    case BF_FILTER_DEFLATE:
+    case BF_FILTER_GZIP:
+#ifdef BF_WITH_ZLIB
+        if (bf_filter_init_zlib(filter) == -1) {
+            bf_free(filter);
+            return NULL;
+        }
+        break;
+#else
+        bf_set_error("zlib support is not available");
+        bf_free(filter);
+        return NULL;
+#endif
+
+    case BF_FILTER_LZ:
+        if (mode == BF_FILTER_COMPRESS) {
+            filter->lz_table =
+                bf_malloc((1U << BF_LZ_HASH_BITS) * sizeof(uint16_t));
+            if (!filter->lz_table) {
+                bf_free(filter);
+                return NULL;
+            }
+        }
+        break;
+    }
+
+    return filter;
+}
+
+void
+bf_filter_delete(struct bf_filter *filter) {
+    if (!filter)
+        return;
+
+#ifdef BF_WITH_ZLIB
+    if (filter->codec != BF_FILTER_LZ) {
+        if (filter->mode == BF_FILTER_COMPRESS) {
+            deflateEnd(&filter->zs);
+        } else {
+            inflateEnd(&filter->zs);
+        }
+    }
+#endif
+
+    bf_free(filter->lz_table);
+    bf_free(filter);
+}
+
+void
+bf_filter_reset(struct bf_filter *filter) {
+    filter->started = 0;
+    filter->finished = 0;
+
+#ifdef BF_WITH_ZLIB
+    if (filter->codec != BF_FILTER_LZ) {
+        if (filter->mode == BF_FILTER_COMPRESS) {
+            deflateReset(&filter->zs);
+        } else {
+            inflateReset(&filter->zs);
+        }
+    }
+#endif
+}
+
+int
+bf_filter_process(struct bf_filter *filter, struct bf_buffer *in,
+                  struct bf_buffer *out, enum bf_filter_flush flush) {
+    int ret;
+
+    if (filter->finished)
+        return 1;
+
+    if (filter->codec == BF_FILTER_LZ) {
+        ret = bf_filter_process_lz(filter, in, out, flush);
+    } else {
+#ifdef BF_WITH_ZLIB
+        ret = bf_filter_process_zlib(filter, in, out, flush);
+#else
+        ret = -1;
+#endif
+    }
+
+    if (ret == 0 && filter->mode == BF_FILTER_DECOMPRESS
+     && flush == BF_FILTER_FINISH) {
+        bf_set_error("truncated compressed data");
+        return -1;
+    }
+
+    return ret;
+}
+
+static int
+bf_filter_process_lz(struct bf_filter *filter, struct bf_buffer *in,
+                     struct bf_buffer *out, enum bf_filter_flush flush) {
+    if (filter->mode == BF_FILTER_COMPRESS)
+        return bf_filter_compress_lz(filter, in, out, flush);
+
+    return bf_filter_decompress_lz(filter, in, out);
+}
+
+static int
+bf_filter_compress_lz(struct bf_filter *filter, struct bf_buffer *in,
+                      struct bf_buffer *out, enum bf_filter_flush flush) {
+    if (!filter->started) {
+        if (bf_buffer_add(out, BF_LZ_MAGIC, 4) == -1)
+            return -1;
+
+        filter->started = 1;
+    }
+
+    for (;;) {
+        const uint8_t *data;
+        uint8_t *ptr;
+        size_t len, n, csize;
+
+        len = bf_buffer_length(in);
+
+        if (len >= BF_LZ_BLOCK_SIZE) {
+            n = BF_LZ_BLOCK_SIZE;
+        } else if (len > 0 && flush != BF_FILTER_NO_FLUSH) {
+            n = len;
+        } else {
+            break;
+        }
+
+        ptr = bf_buffer_reserve(out, 4 + BF_LZ_BOUND(n));
+        if (!ptr)
+            return -1;
+
+        data = bf_buffer_data(in);
+
+        csize = bf_lz_compress_block(filter->lz_table, data, n, ptr + 4);
+        if (csize >= n) {
+            memcpy(ptr + 4, data, n);
+            bf_lz_write32(ptr, (uint32_t)n | BF_LZ_STORED);
+            csize = n;
+        } else {
+            bf_lz_write32(ptr, (uint32_t)csize);
+        }
+
+        bf_buffer_increase_length(out, 4 + csize);
+        bf_buffer_skip(in, n);
+    }
+
+    if (flush == BF_FILTER_FINISH) {
+        if (bf_buffer_add(out, "\0\0\0\0", 4) == -1)
+            return -1;
+
+        filter->finished = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+bf_filter_decompress_lz(struct bf_filter *filter, struct bf_buffer *in,
+                        struct bf_buffer *out) {
+    const uint8_t *data;
+
+    if (!filter->started) {
+        if (bf_buffer_length(in) < 4)
+            return 0;
+
+        if (memcmp(bf_buffer_data(in), BF_LZ_MAGIC, 4) != 0) {
+            bf_set_error("invalid compressed data");
+            return -1;
+        }
+
+        bf_buffer_skip(in, 4);
+        filter->started = 1;
+    }
+
+    for (;;) {
+        uint32_t header;
+        uint8_t *ptr;
+        size_t csize, len;
+
+        if (bf_buffer_length(in) < 4)
+            return 0;
+
+        data = bf_buffer_data(in);
+
+        header = bf_lz_read32(data);
+        if (header == 0) {
+            bf_buffer_skip(in, 4);
+            filter->finished = 1;
+            return 1;
+        }
+
+        csize = header & ~BF_LZ_STORED;
+        if (csize > BF_LZ_BOUND(BF_LZ_BLOCK_SIZE)
+         || ((header & BF_LZ_STORED) && csize > BF_LZ_BLOCK_SIZE)) {
+            bf_set_error("invalid compressed block size");
+            return -1;
+        }
+
+        if (bf_buffer_length(in) - 4 < csize)
+            return 0;
+
+        ptr = bf_buffer_reserve(out, BF_LZ_BLOCK_SIZE);
+        if (!ptr)
+            return -1;
+
+        if (header & BF_LZ_STORED) {
+            memcpy(ptr, data + 4, csize);
+            len = csize;
+        } else if (bf_lz_decompress_block(data + 4, csize,
+                                          ptr, BF_LZ_BLOCK_SIZE, &len) == -1) {
+            bf_set_error("invalid compressed block");
+            return -1;
+        }
+
+        bf_buffer_increase_length(out, len);
+        bf_buffer_skip(in, 4 + csize);
+    }
+}
+
+static size_t
+bf_lz_compress_block(uint16_t *table, const uint8_t *src, size_t len,
+                     uint8_t *dst) {
+    size_t ip, anchor, limit, match_end;
+    uint8_t *op;
+
+    memset(table, 0, (1U << BF_LZ_HASH_BITS) * sizeof(uint16_t));
+
+    op = dst;
+    ip = 0;
+    anchor = 0;
+
+    /* The last match must start at least BF_LZ_MF_LIMIT bytes before the
+     * end of the block, and the last bytes are always literals. */
+    limit = (len > BF_LZ_MF_LIMIT) ? len - BF_LZ_MF_LIMIT : 0;
+    match_end = (len > BF_LZ_LAST_LITERALS) ? len - BF_LZ_LAST_LITERALS : 0;
+
+    while (ip < limit) {
+        uint32_t seq, hash;
+        size_t ref, match_len, lit_len, offset;
+        uint8_t *token;
+
+        seq = bf_lz_read32(src + ip);
+        hash = (seq * 2654435761U) >> (32 - BF_LZ_HASH_BITS);
+
+        ref = table[hash];
+        table[hash] = (uint16_t)ip;
+
+        if (ref >= ip || bf_lz_read32(src + ref) != seq) {
+            /* Skip faster through data which do not compress. */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        match_len = BF_LZ_MIN_MATCH;
+        while (ip + match_len < match_end
+            && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        lit_len = ip - anchor;
+        offset = ip - ref;
+
+        token = op++;
+
+        if (lit_len >= 15) {
+            *token = 15 << 4;
+            op = bf_lz_put_length(op, lit_len - 15);
+        } else {
+            *token = (uint8_t)(lit_len << 4);
+        }
+
+        memcpy(op, src + anchor, lit_len);
+        op += lit_len;
+
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+
+        if (match_len - BF_LZ_MIN_MATCH >= 15) {
+            *token |= 15;
+            op = bf_lz_put_length(op, match_len - BF_LZ_MIN_MATCH - 15);
+        } else {
+            *token |= (uint8_t)(match_len - BF_LZ_MIN_MATCH);
+        }
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    /* Last literals */
+    if (len - anchor >= 15) {
+        *op++ = 15 << 4;
+        op = bf_lz_put_length(op, len - anchor - 15);
+    } else {
+        *op++ = (uint8_t)((len - anchor) << 4);
+    }
+
+    memcpy(op, src + anchor, len - anchor);
+    op += len - anchor;
+
+    return (size_t)(op - dst);
+}
+
+static int
+bf_lz_decompress_block(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t cap, size_t *plen) {
+    size_t ip, op;
+
+    ip = 0;
+    op = 0;
+
+    while (ip < len) {
+        size_t lit_len, match_len, offset;
+        uint8_t token, byte;
+
+        token = src[ip++];
+
+        lit_len = token >> 4;
+        if (lit_len == 15) {
+            do {
+                if (ip >= len || lit_len > len)
+                    return -1;
+
+                byte = src[ip++];
+                lit_len += byte;
+            } while (byte == 255);
+        }
+
+        if (lit_len > len - ip || lit_len > cap - op)
+            return -1;
+
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+
+        offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op)
+            return -1;
+
+        match_len = token & 15;
+        if (match_len == 15) {
+            do {
+                if (ip >= len || match_len > cap)
+                    return -1;
+
+                byte = src[ip++];
+                match_len += byte;
+            } while (byte == 255);
+        }
+
+        match_len += BF_LZ_MIN_MATCH;
+        if (match_len > cap - op)
+            return -1;
+
+        if (offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+            op += match_len;
+        } else {
+            /* The match overlaps the data it produces. */
+            while (match_len-- > 0) {
+                dst[op] = dst[op - offset];
+                op++;
+            }
+        }
+    }
+
+    *plen = op;
+    return 0;
+}
+
+static uint8_t *
+bf_lz_put_length(uint8_t *ptr, size_t len) {
+    while (len >= 255) {
+        *ptr++ = 255;
+        len -= 255;
+    }
+
+    *ptr++ = (uint8_t)len;
+    return ptr;
+}
+
+static uint32_t
+bf_lz_read32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0]
+         | ((uint32_t)ptr[1] << 8)
+         | ((uint32_t)ptr[2] << 16)
+         | ((uint32_t)ptr[3] << 24);
+}
+
+static void
+bf_lz_write32(uint8_t *ptr, uint32_t value) {
+    ptr[0] = (uint8_t)value;
+    ptr[1] = (uint8_t)(value >> 8);
+    ptr[2] = (uint8_t)(value >> 16);
+    ptr[3] = (uint8_t)(value >> 24);
+}
+
+#ifdef BF_WITH_ZLIB
+static int
+bf_filter_init_zlib(struct bf_filter *filter) {
+    int window_bits, level, ret;
+
+    /* Adding 16 to the window size selects the gzip format. */
+    window_bits = (filter->codec == BF_FILTER_GZIP) ? 15 + 16 : 15;
+
+    if (filter->mode == BF_FILTER_COMPRESS) {
+        level = (filter->level == 0) ? Z_DEFAULT_COMPRESSION : filter->level;
+
+        ret = deflateInit2(&filter->zs, level, Z_DEFLATED, window_bits, 8,
+                           Z_DEFAULT_STRATEGY);
+    } else {
+        ret = inflateInit2(&filter->zs, window_bits);
+    }
+
+    if (ret != Z_OK) {
+        bf_set_error("cannot initialize zlib stream: %s",
+                     filter->zs.msg ? filter->zs.msg : zError(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bf_filter_process_zlib(struct bf_filter *filter, struct bf_buffer *in,
+                       struct bf_buffer *out, enum bf_filter_flush flush) {
+    z_stream *zs;
+
+    zs = &filter->zs;
+
+    for (;;) {
+        size_t len, avail_in;
+        int zflush, ret;
+        char *ptr;
+
+        len = bf_buffer_length(in);
+        avail_in = (len > UINT_MAX) ? UINT_MAX : len;
+
+        /* Flushing only makes sense once zlib has seen all the input. */
+        zflush = Z_NO_FLUSH;
+        if (avail_in == len) {
+            if (flush == BF_FILTER_FINISH) {
+                zflush = Z_FINISH;
+            } else if (flush == BF_FILTER_FLUSH) {
+                zflush = Z_SYNC_FLUSH;
+            }
+        }
+
+        ptr = bf_buffer_reserve(out, BF_FILTER_CHUNK_SIZE);
+        if (!ptr)
+            return -1;
+
+        zs->next_in = bf_buffer_data(in);
+        zs->avail_in = (uInt)avail_in;
+        zs->next_out = (Bytef *)ptr;
+        zs->avail_out = BF_FILTER_CHUNK_SIZE;
+
+        if (filter->mode == BF_FILTER_COMPRESS) {
+            ret = deflate(zs, zflush);
+        } else {
+            ret = inflate(zs, Z_NO_FLUSH);
+        }
+
+        bf_buffer_increase_length(out, BF_FILTER_CHUNK_SIZE - zs->avail_out);
+        bf_buffer_skip(in, avail_in - zs->avail_in);
+
+        if (ret == Z_STREAM_END) {
+            filter->finished = 1;
+            return 1;
+        }
+
+        if (ret == Z_BUF_ERROR)
+            return 0;
+
+        if (ret != Z_OK) {
+            bf_set_error("cannot process zlib stream: %s",
+                         zs->msg ? zs->msg : zError(ret));
+            return -1;
+        }
+
+        if (zs->avail_out > 0 && zs->avail_in == 0 && avail_in == len)
+            return 0;
+    }
+}
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+/*
+ * A framer remembers the offset at which its last unsuccessful search
+ * stopped, so that each byte of the buffer is only examined once no matter
+ * how many times data are appended before a delimiter arrives. The search
+ * restarts delim_sz - 1 bytes before the end of the content, since the
+ * beginning of the delimiter may already have been read.
+ */
+
+struct bf_framer {
+    struct bf_buffer *buf;
+
+    char *delim;
+    size_t delim_sz;
+
+    size_t scan_offset;
+    size_t record_sz;
+};
+
+struct bf_framer *
+bf_framer_new(struct bf_buffer *buf, const void *delim, size_t delim_sz) {
+    struct bf_framer *framer;
+
+    if (delim_sz == 0) {
+        bf_set_error("empty delimiter");
+        return NULL;
+    }
+
+    framer = bf_malloc(sizeof(struct bf_framer));
+    if (!framer)
+        return NULL;
+
+    memset(framer, 0, sizeof(struct bf_framer));
+
+    framer->delim = bf_malloc(delim_sz);
+    if (!framer->delim) {
+        bf_free(framer);
+        return NULL;
+    }
+
+    memcpy(framer->delim, delim, delim_sz);
+    framer->delim_sz = delim_sz;
+
+    framer->buf = buf;
+
+    return framer;
+}
+
+void
+bf_framer_delete(struct bf_framer *framer) {
+    if (!framer)
+        return;
+
+    bf_free(framer->delim);
+    bf_free(framer);
+}
+
+void
+bf_framer_reset(struct bf_framer *framer) {
+    framer->scan_offset = 0;
+    framer->record_sz = 0;
+}
+
+int
+bf_framer_next(struct bf_framer *framer, const void **pdata, size_t *plen) {
+    const char *data, *ptr;
+    size_t len;
+
+    if (framer->record_sz > 0) {
+        bf_buffer_skip(framer->buf, framer->record_sz);
+        framer->record_sz = 0;
+    }
+
+    data = bf_buffer_data(framer->buf);
+    len = bf_buffer_length(framer->buf);
+
+    if (framer->scan_offset > len)
+        framer->scan_offset = 0;
+
+    ptr = bf_memfind(data + framer->scan_offset, len - framer->scan_offset,
+                     framer->delim, framer->delim_sz);
+    if (!ptr) {
+        if (len >= framer->delim_sz)
+            framer->scan_offset = len - framer->delim_sz + 1;
+
+        return 0;
+    }
+
+    framer->scan_offset = 0;
+    framer->record_sz = (size_t)(ptr - data) + framer->delim_sz;
+
+    if (pdata)
+        *pdata = data;
+    if (plen)
+        *plen = (size_t)(ptr - data);
+
+    return 1;
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   define BF_HASH_SSE42
+#endif
+
+#define BF_CRC32C_POLY 0x82f63b78U
+
+#define BF_XXH64_P1 11400714785074694791ULL
+#define BF_XXH64_P2 14029467366897019727ULL
+#define BF_XXH64_P3  1609587929392839161ULL
+#define BF_XXH64_P4  9650029242287828579ULL
+#define BF_XXH64_P5  2870177450012600261ULL
+
+/*
+ * CRC32C uses the crc32 instruction of SSE4.2 when the processor supports
+ * it, and the slicing-by-8 algorithm otherwise. The implementation is
+ * selected, and the tables of the software implementation are built, the
+ * first time a checksum is computed.
+ *
+ * xxHash64 processes data by stripes of 32 bytes; the bytes of an
+ * incomplete stripe are kept in the state until more data are available or
+ * until the digest is computed.
+ */
+
+typedef uint32_t (*bf_crc32c_func)(uint32_t, const unsigned char *, size_t);
+
+static pthread_once_t bf_crc32c_once = PTHREAD_ONCE_INIT;
+static bf_crc32c_func bf_crc32c_impl;
+static uint32_t bf_crc32c_table[8][256];
+
+static void bf_crc32c_init(void);
+static uint32_t bf_crc32c_sw(uint32_t, const unsigned char *, size_t);
+#ifdef BF_HASH_SSE42
+static uint32_t bf_crc32c_sse42(uint32_t, const unsigned char *, size_t);
+#endif
+
+static uint64_t bf_xxh64_round(uint64_t, uint64_t);
+static uint64_t bf_xxh64_merge_round(uint64_t, uint64_t);
+static void bf_xxh64_stripes(uint64_t *, const unsigned char *, size_t);
+
+static uint64_t bf_rotl64(uint64_t, unsigned int);
+static uint64_t bf_read64le(const unsigned char *);
+static uint32_t bf_read32le(const unsigned char *);
+
+uint32_t
+bf_crc32c(uint32_t crc, const void *data, size_t sz) {
+    pthread_once(&bf_crc32c_once, bf_crc32c_init);
+
+    return ~bf_crc32c_impl(~crc, data, sz);
+}
+
+uint64_t
+bf_xxh64(const void *data, size_t sz, uint64_t seed) {
+    struct bf_hash hash;
+
+    bf_hash_init(&hash, BF_HASH_XXH64, seed);
+    bf_hash_update(&hash, data, sz);
+
+    return bf_hash_digest(&hash);
+}
+
+void
+bf_hash_init(struct bf_hash *hash, enum bf_hash_type type, uint64_t seed) {
+    memset(hash, 0, sizeof(struct bf_hash));
+
+    hash->type = type;
+    hash->seed = seed;
+
+    switch (type) {
+    case BF_HASH_CRC32C:
+        hash->state[0] = (uint32_t)seed;
+        break;
+
+    case BF_HASH_XXH64:
+        hash->state[0] = seed + BF_XXH64_P1 + BF_XXH64_P2;
+        hash->state[1] = seed + BF_XXH64_P2;
+        hash->state[2] = seed;
+        hash->state[3] = seed - BF_XXH64_P1;
+        break;
+    }
+}
+
+void
+bf_hash_update(struct bf_hash *hash, const void *data, size_t sz) {
+    const unsigned char *ptr;
+    size_t n;
+
+    if (sz == 0)
+        return;
+
+    hash->len += sz;
+
+    if (hash->type == BF_HASH_CRC32C) {
+        hash->state[0] = bf_crc32c((uint32_t)hash->state[0], data, sz);
+        return;
+    }
+
+    ptr = data;
+
+    if (hash->tail_sz > 0) {
+        n = sizeof(hash->tail) - hash->tail_sz;
+        if (n > sz)
+            n = sz;
+
+        memcpy(hash->tail + hash->tail_sz, ptr, n);
+        hash->tail_sz += n;
+        ptr += n;
+        sz -= n;
+
+        if (hash->tail_sz < sizeof(hash->tail))
+            return;
+
+        bf_xxh64_stripes(hash->state, hash->tail, sizeof(hash->tail));
+        hash->tail_sz = 0;
+    }
+
+    n = sz - sz % 32;
+    bf_xxh64_stripes(hash->state, ptr, n);
+
+    memcpy(hash->tail, ptr + n, sz - n);
+    hash->tail_sz = sz - n;
+}
+
+uint64_t
+bf_hash_digest(const struct bf_hash *hash) {
+    const unsigned char *ptr, *end;
+    const uint64_t *v;
+    uint64_t h;
+
+    if (hash->type == BF_HASH_CRC32C)
+        return hash->state[0];
+
+    v = hash->state;
+
+    if (hash->len >= 32) {
+        h = bf_rotl64(v[0], 1) + bf_rotl64(v[1], 7)
+          + bf_rotl64(v[2], 12) + bf_rotl64(v[3], 18);
+
+        h = bf_xxh64_merge_round(h, v[0]);
+        h = bf_xxh64_merge_round(h, v[1]);
+        h = bf_xxh64_merge_round(h, v[2]);
+        h = bf_xxh64_merge_round(h, v[3]);
+    } else {
+        h = hash->seed + BF_XXH64_P5;
+    }
+
+    h += hash->len;
+
+    ptr = hash->tail;
+    end = ptr + hash->tail_sz;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        h ^= bf_xxh64_round(0, bf_read64le(ptr));
+        h = bf_rotl64(h, 27) * BF_XXH64_P1 + BF_XXH64_P4;
+    }
+
+    if (ptr + 4 <= end) {
+        h ^= (uint64_t)bf_read32le(ptr) * BF_XXH64_P1;
+        h = bf_rotl64(h, 23) * BF_XXH64_P2 + BF_XXH64_P3;
+        ptr += 4;
+    }
+
+    for (; ptr < end; ptr++) {
+        h ^= (uint64_t)*ptr * BF_XXH64_P5;
+        h = bf_rotl64(h, 11) * BF_XXH64_P1;
+    }
+
+    h ^= h >> 33;
+    h *= BF_XXH64_P2;
+    h ^= h >> 29;
+    h *= BF_XXH64_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static void
+bf_crc32c_init(void) {
+    uint32_t crc;
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? BF_CRC32C_POLY : 0);
+
+        bf_crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = bf_crc32c_table[0][i];
+
+        for (j = 1; j < 8; j++) {
+            crc = (crc >> 8) ^ bf_crc32c_table[0][crc & 0xff];
+            bf_crc32c_table[j][i] = crc;
+        }
+    }
+
+    bf_crc32c_impl = bf_crc32c_sw;
+
+#ifdef BF_HASH_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        bf_crc32c_impl = bf_crc32c_sse42;
+#endif
+}
+
+static uint32_t
+bf_crc32c_sw(uint32_t crc, const unsigned char *ptr, size_t sz) {
+    const uint32_t (*t)[256];
+
+    t = bf_crc32c_table;
+
+    while (sz >= 8) {
+        uint32_t lo, hi;
+
+        lo = bf_read32le(ptr) ^ crc;
+        hi = bf_read32le(ptr + 4);
+
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+            ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+            ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+        ptr += 8;
+        sz -= 8;
+    }
+
+    while (sz-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *ptr++) & 0xff];
+
+    return crc;
+}
+
+#ifdef BF_HASH_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t
+bf_crc32c_sse42(uint32_t crc, const unsigned char *ptr, size_t sz) {
+    uint64_t crc64;
+
+    while (sz > 0 && ((uintptr_t)ptr & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *ptr++);
+        sz--;
+    }
+
+    crc64 = crc;
+
+    while (sz >= 8) {
+        crc64 = __builtin_ia32_crc32di(crc64, bf_read64le(ptr));
+        ptr += 8;
+        sz -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+
+    while (sz-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *ptr++);
+
+    return crc;
+}
+#endif
+
+static uint64_t
+bf_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * BF_XXH64_P2;
+    acc = bf_rotl64(acc, 31);
+    acc *= BF_XXH64_P1;
+
+    return acc;
+}
+
+static uint64_t
+bf_xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= bf_xxh64_round(0, value);
+    acc = acc * BF_XXH64_P1 + BF_XXH64_P4;
+
+    return acc;
+}
+
+static void
+bf_xxh64_stripes(uint64_t *v, const unsigned char *ptr, size_t sz) {
+    uint64_t v0, v1, v2, v3;
+    const unsigned char *end;
+
+    v0 = v[0];
+    v1 = v[1];
+    v2 = v[2];
+    v3 = v[3];
+
+    for (end = ptr + sz; ptr < end; ptr += 32) {
+        v0 = bf_xxh64_round(v0, bf_read64le(ptr));
+        v1 = bf_xxh64_round(v1, bf_read64le(ptr + 8));
+        v2 = bf_xxh64_round(v2, bf_read64le(ptr + 16));
+        v3 = bf_xxh64_round(v3, bf_read64le(ptr + 24));
+    }
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+}
+
+static uint64_t
+bf_rotl64(uint64_t value, unsigned int n) {
+    return (value << n) | (value >> (64 - n));
+}
+
+static uint64_t
+bf_read64le(const unsigned char *ptr) {
+    uint64_t value;
+
+    memcpy(&value, ptr, sizeof(uint64_t));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+
+    return value;
+}
+
+static uint32_t
+bf_read32le(const unsigned char *ptr) {
+    uint32_t value;
+
+    memcpy(&value, ptr, sizeof(uint32_t));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+
+    return value;
+}
@@ -17,7 +17,50 @@
 #ifndef LIBBUFFER_INTERNAL_H
 #define LIBBUFFER_INTERNAL_H
 
+#include <stddef.h>
+
+struct bf_allocator;
+struct bf_buffer;
+
 void bf_set_error(const char *fmt, ...)
     __attribute__((format(printf, 1, 2)));
 
+const void *bf_memfind_any(const void *, size_t, const char *, size_t);
+const void *bf_memfind_not_any(const void *, size_t, const char *, size_t);
+const void *bf_memfind(const void *, size_t, const void *, size_t);
+
+void *bf_allocator_malloc(const struct bf_allocator *, size_t);
+void bf_allocator_free(const struct bf_allocator *, void *, size_t);
+void *bf_allocator_realloc(const struct bf_allocator *, void *, size_t, size_t);
+
+void *bf_malloc_at(size_t, const char *);
+void *bf_calloc_at(size_t, size_t, const char *);
+void *bf_realloc_at(void *, size_t, const char *);
+void *bf_allocator_malloc_at(const struct bf_allocator *, size_t,
+                             const char *);
+void *bf_allocator_realloc_at(const struct bf_allocator *, void *,
+                              size_t, size_t, const char *);
+
+#ifdef BF_WITH_TRACE
+/* Allocations made by the library are attributed to the calling function.
+ * The public prototypes must be declared before the macros. */
+#   include "buffer.h"
+
+#   define bf_malloc(sz_) \
+    bf_malloc_at((sz_), __func__)
+#   define bf_calloc(nb_, sz_) \
+    bf_calloc_at((nb_), (sz_), __func__)
+#   define bf_realloc(ptr_, sz_) \
+    bf_realloc_at((ptr_), (sz_), __func__)
+#   define bf_allocator_malloc(allocator_, sz_) \
+    bf_allocator_malloc_at((allocator_), (sz_), __func__)
+#   define bf_allocator_realloc(allocator_, ptr_, old_sz_, sz_) \
+    bf_allocator_realloc_at((allocator_), (ptr_), (old_sz_), (sz_), __func__)
+#endif
+
+void bf_buffer_get_storage(const struct bf_buffer *, void **, size_t *);
+
+char *bf_mirror_map(size_t);
+void bf_mirror_unmap(char *, size_t);
+
 #endif
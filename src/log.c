@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#ifndef IOV_MAX
+#   define IOV_MAX 1024
+#endif
+
+#define BF_CACHE_LINE_SIZE 64U
+
+#define BF_LOG_HEADER_SIZE   8U
+#define BF_LOG_MAX_SIZE      ((size_t)1 << 31)
+#define BF_LOG_PRINTF_SIZE   256U
+
+/*
+ * A log is a ring buffer mapped twice (see ring.c) in which any number of
+ * producer threads append records, and from which a single consumer thread
+ * removes them.
+ *
+ *        head                                       tail
+ *         |                                          |
+ *   +-----+--------+-----+--------+-----+--------+---+----------+
+ *   |     | hdr    | ... | hdr    | ... | hdr    |...|          |
+ *   +-----+--------+-----+--------+-----+--------+---+----------+
+ *          committed      claimed        committed
+ *
+ * A producer claims a record by adding its size to tail with an atomic
+ * fetch-add, then waits for the consumer if the record is not entirely free
+ * yet. Each record starts with a 64 bit header: the high 32 bits contain the
+ * size of the record, the low 32 bits contain the length of the payload plus
+ * one, and are only stored, with release semantic, once the payload has been
+ * written. Records are padded to a multiple of the header size so that
+ * headers are always aligned.
+ *
+ * The consumer reads records from head until it finds one which is not
+ * committed yet. Consumed records are zeroed before head moves past them,
+ * so that the header of a record claimed later is never mistaken for a
+ * committed one.
+ */
+
+struct bf_log {
+    char *data;
+    size_t sz;
+    size_t mask;
+
+    char pad1[BF_CACHE_LINE_SIZE];
+
+    /* Producers */
+    size_t tail;
+
+    char pad2[BF_CACHE_LINE_SIZE];
+
+    /* Consumer */
+    size_t head;
+    size_t record_offset;
+
+    char pad3[BF_CACHE_LINE_SIZE];
+};
+
+static uint64_t *bf_log_header(const struct bf_log *, size_t);
+static size_t bf_log_next(const struct bf_log *, size_t,
+                          const char **, size_t *);
+static void bf_log_consume(struct bf_log *, size_t);
+
+struct bf_log *
+bf_log_new(size_t size) {
+    struct bf_log *log;
+    size_t page_size, sz;
+
+    if (size > BF_LOG_MAX_SIZE) {
+        bf_set_error("log size too large");
+        return NULL;
+    }
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    sz = page_size;
+    while (sz < size)
+        sz *= 2;
+
+    log = bf_malloc(sizeof(struct bf_log));
+    if (!log)
+        return NULL;
+
+    memset(log, 0, sizeof(struct bf_log));
+
+    log->data = bf_mirror_map(sz);
+    if (!log->data) {
+        bf_free(log);
+        return NULL;
+    }
+
+    log->sz = sz;
+    log->mask = sz - 1;
+
+    return log;
+}
+
+void
+bf_log_delete(struct bf_log *log) {
+    if (!log)
+        return;
+
+    bf_mirror_unmap(log->data, log->sz);
+    bf_free(log);
+}
+
+size_t
+bf_log_size(const struct bf_log *log) {
+    return log->sz;
+}
+
+void *
+bf_log_reserve(struct bf_log *log, size_t sz) {
+    size_t record_sz, pos;
+    uint64_t *header;
+
+    if (sz > log->sz - BF_LOG_HEADER_SIZE) {
+        bf_set_error("record too large");
+        return NULL;
+    }
+
+    record_sz = BF_LOG_HEADER_SIZE
+              + (sz + BF_LOG_HEADER_SIZE - 1) / BF_LOG_HEADER_SIZE
+              * BF_LOG_HEADER_SIZE;
+
+    pos = __atomic_fetch_add(&log->tail, record_sz, __ATOMIC_RELAXED);
+
+    /* Wait for the consumer to free the space we claimed. */
+    while (pos + record_sz - __atomic_load_n(&log->head, __ATOMIC_ACQUIRE)
+           > log->sz) {
+        sched_yield();
+    }
+
+    header = bf_log_header(log, pos);
+    __atomic_store_n(header, (uint64_t)record_sz << 32, __ATOMIC_RELAXED);
+
+    return header + 1;
+}
+
+int
+bf_log_commit(struct bf_log *log, void *ptr, size_t len) {
+    uint64_t *header;
+    size_t record_sz;
+
+    header = (uint64_t *)ptr - 1;
+    record_sz = (size_t)(*header >> 32);
+
+    if (len > record_sz - BF_LOG_HEADER_SIZE) {
+        /* The record must be committed anyway, otherwise the consumer would
+         * never move past it. */
+        __atomic_store_n(header, ((uint64_t)record_sz << 32) | 1,
+                         __ATOMIC_RELEASE);
+
+        bf_set_error("record length too large");
+        return -1;
+    }
+
+    __atomic_store_n(header, ((uint64_t)record_sz << 32) | (len + 1),
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+bf_log_add(struct bf_log *log, const void *data, size_t sz) {
+    char *ptr;
+
+    ptr = bf_log_reserve(log, sz);
+    if (!ptr)
+        return -1;
+
+    memcpy(ptr, data, sz);
+
+    return bf_log_commit(log, ptr, sz);
+}
+
+int
+bf_log_add_vprintf(struct bf_log *log, const char *fmt, va_list ap) {
+    char tmp[BF_LOG_PRINTF_SIZE];
+    va_list local_ap;
+    char *ptr;
+    int ret;
+
+    /* Most records are short: formatting them on the stack first means the
+     * format string is only processed once. */
+    va_copy(local_ap, ap);
+    ret = vsnprintf(tmp, sizeof(tmp), fmt, local_ap);
+    va_end(local_ap);
+
+    if (ret == -1) {
+        bf_set_error("cannot format string: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)ret < sizeof(tmp))
+        return bf_log_add(log, tmp, (size_t)ret);
+
+    /* vsnprintf() needs space for \0, which is not part of the record. */
+    ptr = bf_log_reserve(log, (size_t)ret + 1);
+    if (!ptr)
+        return -1;
+
+    va_copy(local_ap, ap);
+    vsnprintf(ptr, (size_t)ret + 1, fmt, local_ap);
+    va_end(local_ap);
+
+    return bf_log_commit(log, ptr, (size_t)ret);
+}
+
+int
+bf_log_add_printf(struct bf_log *log, const char *fmt, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = bf_log_add_vprintf(log, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+size_t
+bf_log_drain(struct bf_log *log, struct bf_buffer *buf) {
+    const char *data;
+    size_t pos, record_sz, len, total;
+
+    total = 0;
+    pos = log->head;
+
+    while ((record_sz = bf_log_next(log, pos, &data, &len)) > 0) {
+        if (pos == log->head) {
+            data += log->record_offset;
+            len -= log->record_offset;
+        }
+
+        if (bf_buffer_add(buf, data, len) == -1)
+            break;
+
+        total += len;
+        pos += record_sz;
+    }
+
+    bf_log_consume(log, total);
+    return total;
+}
+
+ssize_t
+bf_log_write(struct bf_log *log, int fd) {
+    struct iovec iov[IOV_MAX];
+    const char *data;
+    size_t pos, record_sz, len;
+    int nb_iov;
+    ssize_t ret;
+
+    nb_iov = 0;
+    pos = log->head;
+
+    while (nb_iov < IOV_MAX
+        && (record_sz = bf_log_next(log, pos, &data, &len)) > 0) {
+        if (pos == log->head) {
+            data += log->record_offset;
+            len -= log->record_offset;
+        }
+
+        if (len > 0) {
+            iov[nb_iov].iov_base = (char *)data;
+            iov[nb_iov].iov_len = len;
+            nb_iov++;
+        }
+
+        pos += record_sz;
+    }
+
+    if (nb_iov == 0) {
+        /* Committed empty records can be released right away. */
+        bf_log_consume(log, 0);
+        return 0;
+    }
+
+    ret = writev(fd, iov, nb_iov);
+    if (ret > 0)
+        bf_log_consume(log, (size_t)ret);
+
+    return ret;
+}
+
+static uint64_t *
+bf_log_header(const struct bf_log *log, size_t pos) {
+    return (uint64_t *)(log->data + (pos & log->mask));
+}
+
+static size_t
+bf_log_next(const struct bf_log *log, size_t pos,
+            const char **pdata, size_t *plen) {
+    uint64_t *header, value;
+
+    /* The whole ring may be committed, in which case pos wraps around to
+     * the first record. */
+    if (pos - log->head >= log->sz)
+        return 0;
+
+    header = bf_log_header(log, pos);
+
+    value = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+    if ((value & 0xffffffff) == 0)
+        return 0;
+
+    *pdata = (const char *)(header + 1);
+    *plen = (size_t)(value & 0xffffffff) - 1;
+
+    return (size_t)(value >> 32);
+}
+
+static void
+bf_log_consume(struct bf_log *log, size_t n) {
+    const char *data;
+    size_t pos, record_sz, len;
+
+    pos = log->head;
+
+    /* Release every record whose payload was entirely consumed, including
+     * empty ones. */
+    while ((record_sz = bf_log_next(log, pos, &data, &len)) > 0) {
+        len -= log->record_offset;
+        if (n < len) {
+            log->record_offset += n;
+            break;
+        }
+
+        n -= len;
+        log->record_offset = 0;
+
+        memset(bf_log_header(log, pos), 0, record_sz);
+        pos += record_sz;
+    }
+
+    __atomic_store_n(&log->head, pos, __ATOMIC_RELEASE);
+}
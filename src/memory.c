@@ -14,13 +14,23 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "internal.h"
 #include "buffer.h"
 
+/* Library functions call the allocation functions through the macros of
+ * internal.h when tracing is enabled; they are defined here. */
+#undef bf_malloc
+#undef bf_calloc
+#undef bf_realloc
+#undef bf_allocator_malloc
+#undef bf_allocator_realloc
+
 #define BF_DEFAULT_ALLOCATOR \
     {                        \
         .malloc = malloc,    \
@@ -37,6 +47,75 @@ static struct bf_memory_allocator bf_allocator = BF_DEFAULT_ALLOCATOR;
 
 struct bf_memory_allocator *bf_default_memory_allocator;
 
+/*
+ * When libbuffer is built with BF_WITH_TRACE, each block allocated with
+ * bf_malloc(), bf_calloc() or bf_realloc() is preceded by a header which
+ * contains the size requested and the call site which allocated it, so that
+ * bf_free() can update the statistics:
+ *
+ *   +--------+------------------------------+
+ *   | header | data                         |
+ *   +--------+------------------------------+
+ *            ^
+ *            pointer returned to the caller
+ *
+ * Call sites are the names of the library functions, passed by the macros of
+ * internal.h; allocations made by the application are attributed to a site
+ * named "(application)". Sites are stored in a fixed size open addressing
+ * table; once it is full, new sites are attributed to "(other)".
+ *
+ * Each operation is also recorded in a ring of events, overwriting the
+ * oldest ones. All counters are updated with relaxed atomic operations.
+ * Events written concurrently with a dump, or by threads racing around the
+ * ring, can be inconsistent: the trace is a diagnostic tool.
+ */
+
+#ifdef BF_WITH_TRACE
+#define BF_TRACE_HEADER_SIZE  16U
+#define BF_TRACE_NB_SITES     128U
+#define BF_TRACE_NB_EVENTS    4096U
+
+struct bf_trace_header {
+    size_t sz;
+    uint32_t site;
+};
+
+typedef char bf_trace_header_size_check[
+    (sizeof(struct bf_trace_header) <= BF_TRACE_HEADER_SIZE) ? 1 : -1];
+
+enum bf_trace_op {
+    BF_TRACE_MALLOC,
+    BF_TRACE_REALLOC,
+    BF_TRACE_FREE,
+};
+
+struct bf_trace_event {
+    size_t seq;
+    enum bf_trace_op op;
+    uint32_t site;
+    const void *ptr;
+    size_t old_sz;
+    size_t sz;
+};
+
+static struct bf_memory_stats bf_trace_stats;
+static struct bf_memory_site bf_trace_sites[BF_TRACE_NB_SITES] = {
+    {.name = "(other)"},
+};
+static struct bf_trace_event bf_trace_events[BF_TRACE_NB_EVENTS];
+static size_t bf_trace_event_pos;
+
+static struct bf_trace_header *bf_trace_header(void *);
+static void *bf_trace_alloc(void *, enum bf_trace_op, uint32_t,
+                            size_t, size_t);
+static void *bf_trace_free(void *);
+static void bf_trace_account(uint32_t, size_t, size_t);
+static uint32_t bf_trace_site(const char *);
+static void bf_trace_record(enum bf_trace_op, uint32_t, const void *,
+                            size_t, size_t);
+static unsigned int bf_trace_size_class(size_t);
+#endif
+
 void
 bf_set_memory_allocator(const struct bf_memory_allocator *allocator) {
     if (allocator) {
@@ -48,41 +127,168 @@ bf_set_memory_allocator(const struct bf_memory_allocator *allocator) {
 
 void *
 bf_malloc(size_t sz) {
+    return bf_malloc_at(sz, NULL);
+}
+
+void
+bf_free(void *ptr) {
+#ifdef BF_WITH_TRACE
+    if (!ptr)
+        return;
+
+    ptr = bf_trace_free(ptr);
+#endif
+
+    bf_allocator.free(ptr);
+}
+
+void *
+bf_calloc(size_t nb, size_t sz) {
+    return bf_calloc_at(nb, sz, NULL);
+}
+
+void *
+bf_realloc(void *ptr, size_t sz) {
+    return bf_realloc_at(ptr, sz, NULL);
+}
+
+void *
+bf_malloc_at(size_t sz, const char *site) {
     void *ptr;
 
+#ifdef BF_WITH_TRACE
+    if (sz > SIZE_MAX - BF_TRACE_HEADER_SIZE) {
+        bf_set_error("cannot allocate %zu bytes: %s", sz, strerror(ENOMEM));
+        return NULL;
+    }
+
+    ptr = bf_allocator.malloc(BF_TRACE_HEADER_SIZE + sz);
+#else
     ptr = bf_allocator.malloc(sz);
+#endif
     if (!ptr) {
         bf_set_error("cannot allocate %zu bytes: %s", sz, strerror(errno));
         return NULL;
     }
 
-    return ptr;
-}
+#ifdef BF_WITH_TRACE
+    ptr = bf_trace_alloc(ptr, BF_TRACE_MALLOC, bf_trace_site(site), 0, sz);
+#endif
 
-void
-bf_free(void *ptr) {
-    bf_allocator.free(ptr);
+    return ptr;
 }
 
 void *
-bf_calloc(size_t nb, size_t sz) {
+bf_calloc_at(size_t nb, size_t sz, const char *site) {
     void *ptr;
 
+#ifdef BF_WITH_TRACE
+    if (sz > 0 && nb > (SIZE_MAX - BF_TRACE_HEADER_SIZE) / sz) {
+        bf_set_error("cannot allocate %zux%zu bytes: %s",
+                     nb, sz, strerror(ENOMEM));
+        return NULL;
+    }
+
+    ptr = bf_allocator.calloc(1, BF_TRACE_HEADER_SIZE + nb * sz);
+#else
     ptr = bf_allocator.calloc(nb, sz);
+#endif
     if (!ptr) {
         bf_set_error("cannot allocate %zux%zu bytes: %s",
                      nb, sz, strerror(errno));
         return NULL;
     }
 
+#ifdef BF_WITH_TRACE
+    ptr = bf_trace_alloc(ptr, BF_TRACE_MALLOC, bf_trace_site(site),
+                         0, nb * sz);
+#endif
+
     return ptr;
 }
 
 void *
-bf_realloc(void *ptr, size_t sz) {
+bf_realloc_at(void *ptr, size_t sz, const char *site) {
     void *nptr;
+#ifdef BF_WITH_TRACE
+    struct bf_trace_header *header;
+    uint32_t site_idx;
+    size_t old_sz;
+
+    if (sz > SIZE_MAX - BF_TRACE_HEADER_SIZE) {
+        bf_set_error("cannot reallocate %zu bytes: %s", sz, strerror(ENOMEM));
+        return NULL;
+    }
 
+    /* A block keeps the site which allocated it first. */
+    if (ptr) {
+        header = bf_trace_header(ptr);
+        site_idx = header->site;
+        old_sz = header->sz;
+    } else {
+        header = NULL;
+        site_idx = bf_trace_site(site);
+        old_sz = 0;
+    }
+
+    nptr = bf_allocator.realloc(header, BF_TRACE_HEADER_SIZE + sz);
+#else
     nptr = bf_allocator.realloc(ptr, sz);
+#endif
+    if (!nptr) {
+        bf_set_error("cannot reallocate %zu bytes: %s", sz, strerror(errno));
+        return NULL;
+    }
+
+#ifdef BF_WITH_TRACE
+    nptr = bf_trace_alloc(nptr, ptr ? BF_TRACE_REALLOC : BF_TRACE_MALLOC,
+                          site_idx, old_sz, sz);
+#endif
+
+    return nptr;
+}
+
+void *
+bf_allocator_malloc_at(const struct bf_allocator *allocator, size_t sz,
+                       const char *site) {
+    void *ptr;
+
+    if (!allocator)
+        return bf_malloc_at(sz, site);
+
+    ptr = allocator->allocate(allocator->ctx, sz);
+    if (!ptr) {
+        bf_set_error("cannot allocate %zu bytes: %s", sz, strerror(errno));
+        return NULL;
+    }
+
+    return ptr;
+}
+
+void *
+bf_allocator_malloc(const struct bf_allocator *allocator, size_t sz) {
+    return bf_allocator_malloc_at(allocator, sz, NULL);
+}
+
+void
+bf_allocator_free(const struct bf_allocator *allocator, void *ptr, size_t sz) {
+    if (!allocator) {
+        bf_free(ptr);
+        return;
+    }
+
+    allocator->deallocate(allocator->ctx, ptr, sz);
+}
+
+void *
+bf_allocator_realloc_at(const struct bf_allocator *allocator, void *ptr,
+                        size_t old_sz, size_t sz, const char *site) {
+    void *nptr;
+
+    if (!allocator)
+        return bf_realloc_at(ptr, sz, site);
+
+    nptr = allocator->reallocate(allocator->ctx, ptr, old_sz, sz);
     if (!nptr) {
         bf_set_error("cannot reallocate %zu bytes: %s", sz, strerror(errno));
         return NULL;
@@ -90,3 +296,258 @@ bf_realloc(void *ptr, size_t sz) {
 
     return nptr;
 }
+
+void *
+bf_allocator_realloc(const struct bf_allocator *allocator, void *ptr,
+                     size_t old_sz, size_t sz) {
+    return bf_allocator_realloc_at(allocator, ptr, old_sz, sz, NULL);
+}
+
+void
+bf_get_memory_stats(struct bf_memory_stats *stats) {
+#ifdef BF_WITH_TRACE
+    unsigned int i;
+
+    stats->nb_allocs = __atomic_load_n(&bf_trace_stats.nb_allocs,
+                                       __ATOMIC_RELAXED);
+    stats->nb_reallocs = __atomic_load_n(&bf_trace_stats.nb_reallocs,
+                                         __ATOMIC_RELAXED);
+    stats->nb_frees = __atomic_load_n(&bf_trace_stats.nb_frees,
+                                      __ATOMIC_RELAXED);
+    stats->live_bytes = __atomic_load_n(&bf_trace_stats.live_bytes,
+                                        __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&bf_trace_stats.peak_bytes,
+                                        __ATOMIC_RELAXED);
+
+    for (i = 0; i < BF_MEMORY_NB_SIZE_CLASSES; i++) {
+        stats->size_classes[i] =
+            __atomic_load_n(&bf_trace_stats.size_classes[i], __ATOMIC_RELAXED);
+    }
+#else
+    memset(stats, 0, sizeof(struct bf_memory_stats));
+#endif
+}
+
+size_t
+bf_get_memory_sites(struct bf_memory_site *sites, size_t nb_sites) {
+#ifdef BF_WITH_TRACE
+    struct bf_memory_site *site;
+    size_t i, n;
+
+    n = 0;
+
+    for (i = 0; i < BF_TRACE_NB_SITES; i++) {
+        site = &bf_trace_sites[i];
+
+        if (!__atomic_load_n(&site->name, __ATOMIC_ACQUIRE))
+            continue;
+
+        if (n < nb_sites) {
+            sites[n].name = site->name;
+            sites[n].nb_allocs = __atomic_load_n(&site->nb_allocs,
+                                                 __ATOMIC_RELAXED);
+            sites[n].total_bytes = __atomic_load_n(&site->total_bytes,
+                                                   __ATOMIC_RELAXED);
+            sites[n].live_bytes = __atomic_load_n(&site->live_bytes,
+                                                  __ATOMIC_RELAXED);
+        }
+
+        n++;
+    }
+
+    return n;
+#else
+    return 0;
+#endif
+}
+
+void
+bf_reset_memory_stats(void) {
+#ifdef BF_WITH_TRACE
+    size_t i;
+
+    /* Live bytes describe memory which is still allocated, they are never
+     * reset. */
+    __atomic_store_n(&bf_trace_stats.nb_allocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf_trace_stats.nb_reallocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf_trace_stats.nb_frees, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bf_trace_stats.peak_bytes,
+                     __atomic_load_n(&bf_trace_stats.live_bytes,
+                                     __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+
+    for (i = 0; i < BF_MEMORY_NB_SIZE_CLASSES; i++)
+        __atomic_store_n(&bf_trace_stats.size_classes[i], 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < BF_TRACE_NB_SITES; i++) {
+        __atomic_store_n(&bf_trace_sites[i].nb_allocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&bf_trace_sites[i].total_bytes, 0, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+int
+bf_dump_memory_trace(struct bf_buffer *buf) {
+#ifdef BF_WITH_TRACE
+    static const char *op_names[] = {
+        [BF_TRACE_MALLOC] = "malloc",
+        [BF_TRACE_REALLOC] = "realloc",
+        [BF_TRACE_FREE] = "free",
+    };
+
+    struct bf_trace_event event;
+    size_t pos, start;
+
+    /* Dumping allocates memory, so the events recorded during the dump are
+     * not included. */
+    pos = __atomic_load_n(&bf_trace_event_pos, __ATOMIC_ACQUIRE);
+    start = (pos > BF_TRACE_NB_EVENTS) ? pos - BF_TRACE_NB_EVENTS : 0;
+
+    for (; start < pos; start++) {
+        event = bf_trace_events[start % BF_TRACE_NB_EVENTS];
+
+        if (bf_buffer_add_printf(buf, "%zu %s %s %p %zu %zu\n",
+                                 event.seq, op_names[event.op],
+                                 bf_trace_sites[event.site].name,
+                                 event.ptr, event.old_sz, event.sz) == -1) {
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef BF_WITH_TRACE
+static struct bf_trace_header *
+bf_trace_header(void *ptr) {
+    return (struct bf_trace_header *)((char *)ptr - BF_TRACE_HEADER_SIZE);
+}
+
+static void *
+bf_trace_alloc(void *ptr, enum bf_trace_op op, uint32_t site,
+               size_t old_sz, size_t sz) {
+    struct bf_trace_header *header;
+    char *data;
+    unsigned int size_class;
+
+    header = ptr;
+    header->sz = sz;
+    header->site = site;
+
+    data = (char *)ptr + BF_TRACE_HEADER_SIZE;
+
+    if (op == BF_TRACE_REALLOC) {
+        __atomic_add_fetch(&bf_trace_stats.nb_reallocs, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&bf_trace_stats.nb_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bf_trace_sites[site].nb_allocs, 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    size_class = bf_trace_size_class(sz);
+    __atomic_add_fetch(&bf_trace_stats.size_classes[size_class], 1,
+                       __ATOMIC_RELAXED);
+
+    bf_trace_account(site, old_sz, sz);
+    bf_trace_record(op, site, data, old_sz, sz);
+
+    return data;
+}
+
+static void *
+bf_trace_free(void *ptr) {
+    struct bf_trace_header *header;
+
+    header = bf_trace_header(ptr);
+
+    __atomic_add_fetch(&bf_trace_stats.nb_frees, 1, __ATOMIC_RELAXED);
+
+    bf_trace_account(header->site, header->sz, 0);
+    bf_trace_record(BF_TRACE_FREE, header->site, ptr, header->sz, 0);
+
+    return header;
+}
+
+static void
+bf_trace_account(uint32_t site, size_t freed, size_t allocated) {
+    struct bf_memory_site *psite;
+    size_t live, peak;
+
+    psite = &bf_trace_sites[site];
+
+    __atomic_add_fetch(&psite->total_bytes, allocated, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&psite->live_bytes, allocated - freed,
+                       __ATOMIC_RELAXED);
+
+    /* Unsigned arithmetic wraps around, so adding the difference works
+     * when the block shrinks. */
+    live = __atomic_add_fetch(&bf_trace_stats.live_bytes, allocated - freed,
+                              __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&bf_trace_stats.peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak) {
+        if (__atomic_compare_exchange_n(&bf_trace_stats.peak_bytes,
+                                        &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static uint32_t
+bf_trace_site(const char *name) {
+    struct bf_memory_site *site;
+    const char *expected;
+    uint32_t i, idx;
+
+    if (!name)
+        name = "(application)";
+
+    idx = (uint32_t)(((uintptr_t)name >> 4) % (BF_TRACE_NB_SITES - 1));
+
+    /* Slot 0 is reserved for "(other)". */
+    for (i = 0; i < BF_TRACE_NB_SITES - 1; i++) {
+        site = &bf_trace_sites[1 + (idx + i) % (BF_TRACE_NB_SITES - 1)];
+
+        expected = __atomic_load_n(&site->name, __ATOMIC_ACQUIRE);
+        if (!expected) {
+            if (__atomic_compare_exchange_n(&site->name, &expected, name, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                return (uint32_t)(site - bf_trace_sites);
+            }
+        }
+
+        if (expected == name)
+            return (uint32_t)(site - bf_trace_sites);
+    }
+
+    return 0;
+}
+
+static void
+bf_trace_record(enum bf_trace_op op, uint32_t site, const void *ptr,
+                size_t old_sz, size_t sz) {
+    struct bf_trace_event *event;
+    size_t seq;
+
+    seq = __atomic_fetch_add(&bf_trace_event_pos, 1, __ATOMIC_RELAXED);
+
+    event = &bf_trace_events[seq % BF_TRACE_NB_EVENTS];
+    event->seq = seq;
+    event->op = op;
+    event->site = site;
+    event->ptr = ptr;
+    event->old_sz = old_sz;
+    event->sz = sz;
+}
+
+static unsigned int
+bf_trace_size_class(size_t sz) {
+    if (sz == 0)
+        return 0;
+
+    return (unsigned int)(63 - __builtin_clzll(sz));
+}
+#endif
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+/* Size classes are powers of two from 64 bytes to 1MB. A buffer belongs to
+ * the largest class which is lower or equal to its size, so that any buffer
+ * taken from a class is at least as large as the class size. */
+#define BF_POOL_MIN_CLASS_SHIFT 6U
+#define BF_POOL_MAX_CLASS_SHIFT 20U
+#define BF_POOL_NB_CLASSES \
+    (BF_POOL_MAX_CLASS_SHIFT - BF_POOL_MIN_CLASS_SHIFT + 1)
+
+#define BF_POOL_THREAD_CACHE_SIZE 16U
+#define BF_POOL_DEFAULT_MAX_BUFFERS 64U
+
+struct bf_buffer_pool_cache {
+    struct bf_buffer_pool *pool;
+
+    /* Caches are linked together so that the pool can free the caches of
+     * all threads when it is deleted. */
+    struct bf_buffer_pool_cache *prev;
+    struct bf_buffer_pool_cache *next;
+
+    struct bf_buffer *buffers[BF_POOL_NB_CLASSES][BF_POOL_THREAD_CACHE_SIZE];
+    size_t nb_buffers[BF_POOL_NB_CLASSES];
+};
+
+struct bf_buffer_pool {
+    pthread_key_t cache_key;
+
+    pthread_mutex_t mutex;
+    struct bf_buffer **buffers[BF_POOL_NB_CLASSES];
+    size_t nb_buffers[BF_POOL_NB_CLASSES];
+    size_t max_buffers;
+    struct bf_buffer_pool_cache *caches;
+
+    size_t nb_hits;
+    size_t nb_misses;
+};
+
+static struct bf_buffer_pool_cache *bf_buffer_pool_cache(
+    struct bf_buffer_pool *);
+static void bf_buffer_pool_cache_delete(void *);
+static void bf_buffer_pool_cache_flush(struct bf_buffer_pool_cache *,
+                                       unsigned int, size_t);
+static void bf_buffer_pool_cache_refill(struct bf_buffer_pool_cache *,
+                                        unsigned int);
+
+static int bf_buffer_pool_class_for_request(size_t, unsigned int *);
+static int bf_buffer_pool_class_for_buffer(size_t, unsigned int *);
+
+struct bf_buffer_pool *
+bf_buffer_pool_new(size_t max_buffers) {
+    struct bf_buffer_pool *pool;
+    unsigned int i;
+    int ret;
+
+    pool = bf_malloc(sizeof(struct bf_buffer_pool));
+    if (!pool)
+        return NULL;
+
+    memset(pool, 0, sizeof(struct bf_buffer_pool));
+
+    if (max_buffers == 0)
+        max_buffers = BF_POOL_DEFAULT_MAX_BUFFERS;
+    pool->max_buffers = max_buffers;
+
+    for (i = 0; i < BF_POOL_NB_CLASSES; i++) {
+        pool->buffers[i] = bf_calloc(max_buffers, sizeof(struct bf_buffer *));
+        if (!pool->buffers[i])
+            goto error;
+    }
+
+    ret = pthread_key_create(&pool->cache_key, bf_buffer_pool_cache_delete);
+    if (ret != 0) {
+        bf_set_error("cannot create thread key: %s", strerror(ret));
+        goto error;
+    }
+
+    ret = pthread_mutex_init(&pool->mutex, NULL);
+    if (ret != 0) {
+        bf_set_error("cannot initialize mutex: %s", strerror(ret));
+        pthread_key_delete(pool->cache_key);
+        goto error;
+    }
+
+    return pool;
+
+error:
+    for (i = 0; i < BF_POOL_NB_CLASSES; i++)
+        bf_free(pool->buffers[i]);
+    bf_free(pool);
+    return NULL;
+}
+
+void
+bf_buffer_pool_delete(struct bf_buffer_pool *pool) {
+    struct bf_buffer_pool_cache *cache, *next;
+    unsigned int i;
+    size_t j;
+
+    if (!pool)
+        return;
+
+    /* Once the key is deleted, thread specific destructors are not called
+     * anymore, so the caches of all threads must be freed here. */
+    pthread_key_delete(pool->cache_key);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    cache = pool->caches;
+    while (cache) {
+        next = cache->next;
+
+        for (i = 0; i < BF_POOL_NB_CLASSES; i++) {
+            for (j = 0; j < cache->nb_buffers[i]; j++)
+                bf_buffer_delete(cache->buffers[i][j]);
+        }
+
+        bf_free(cache);
+        cache = next;
+    }
+
+    pool->caches = NULL;
+
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_destroy(&pool->mutex);
+
+    for (i = 0; i < BF_POOL_NB_CLASSES; i++) {
+        for (j = 0; j < pool->nb_buffers[i]; j++)
+            bf_buffer_delete(pool->buffers[i][j]);
+
+        bf_free(pool->buffers[i]);
+    }
+
+    bf_free(pool);
+}
+
+struct bf_buffer *
+bf_buffer_pool_get(struct bf_buffer_pool *pool, size_t size) {
+    struct bf_buffer_pool_cache *cache;
+    unsigned int class;
+
+    if (bf_buffer_pool_class_for_request(size, &class) == -1) {
+        __atomic_fetch_add(&pool->nb_misses, 1, __ATOMIC_RELAXED);
+        return bf_buffer_new(size);
+    }
+
+    cache = bf_buffer_pool_cache(pool);
+    if (cache) {
+        if (cache->nb_buffers[class] == 0)
+            bf_buffer_pool_cache_refill(cache, class);
+
+        if (cache->nb_buffers[class] > 0) {
+            __atomic_fetch_add(&pool->nb_hits, 1, __ATOMIC_RELAXED);
+            return cache->buffers[class][--cache->nb_buffers[class]];
+        }
+    }
+
+    __atomic_fetch_add(&pool->nb_misses, 1, __ATOMIC_RELAXED);
+    return bf_buffer_new((size_t)1 << (class + BF_POOL_MIN_CLASS_SHIFT));
+}
+
+void
+bf_buffer_pool_release(struct bf_buffer_pool *pool, struct bf_buffer *buf) {
+    struct bf_buffer_pool_cache *cache;
+    unsigned int class;
+
+    if (!buf)
+        return;
+
+    /* Policies are reset first so that the policy of the previous owner,
+     * which may not be valid anymore, is not used to clear the buffer. */
+    bf_buffer_set_growth_policy(buf, NULL);
+    bf_buffer_set_compaction_policy(buf, NULL);
+    bf_buffer_set_trim_policy(buf, NULL);
+    bf_buffer_set_hash(buf, NULL);
+
+    bf_buffer_clear(buf);
+
+    if (bf_buffer_pool_class_for_buffer(bf_buffer_size(buf), &class) == -1) {
+        bf_buffer_delete(buf);
+        return;
+    }
+
+    cache = bf_buffer_pool_cache(pool);
+    if (!cache) {
+        bf_buffer_delete(buf);
+        return;
+    }
+
+    if (cache->nb_buffers[class] == BF_POOL_THREAD_CACHE_SIZE)
+        bf_buffer_pool_cache_flush(cache, class, BF_POOL_THREAD_CACHE_SIZE / 2);
+
+    cache->buffers[class][cache->nb_buffers[class]++] = buf;
+}
+
+void
+bf_buffer_pool_flush_thread_cache(struct bf_buffer_pool *pool) {
+    struct bf_buffer_pool_cache *cache;
+
+    cache = pthread_getspecific(pool->cache_key);
+    if (!cache)
+        return;
+
+    pthread_setspecific(pool->cache_key, NULL);
+    bf_buffer_pool_cache_delete(cache);
+}
+
+void
+bf_buffer_pool_get_stats(struct bf_buffer_pool *pool,
+                         struct bf_buffer_pool_stats *stats) {
+    stats->nb_hits = __atomic_load_n(&pool->nb_hits, __ATOMIC_RELAXED);
+    stats->nb_misses = __atomic_load_n(&pool->nb_misses, __ATOMIC_RELAXED);
+}
+
+static struct bf_buffer_pool_cache *
+bf_buffer_pool_cache(struct bf_buffer_pool *pool) {
+    struct bf_buffer_pool_cache *cache;
+    int ret;
+
+    cache = pthread_getspecific(pool->cache_key);
+    if (cache)
+        return cache;
+
+    cache = bf_malloc(sizeof(struct bf_buffer_pool_cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(struct bf_buffer_pool_cache));
+    cache->pool = pool;
+
+    ret = pthread_setspecific(pool->cache_key, cache);
+    if (ret != 0) {
+        bf_set_error("cannot set thread specific data: %s", strerror(ret));
+        bf_free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    cache->next = pool->caches;
+    if (pool->caches)
+        pool->caches->prev = cache;
+    pool->caches = cache;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return cache;
+}
+
+static void
+bf_buffer_pool_cache_delete(void *arg) {
+    struct bf_buffer_pool_cache *cache;
+    struct bf_buffer_pool *pool;
+    unsigned int i;
+
+    cache = arg;
+    pool = cache->pool;
+
+    for (i = 0; i < BF_POOL_NB_CLASSES; i++)
+        bf_buffer_pool_cache_flush(cache, i, cache->nb_buffers[i]);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        pool->caches = cache->next;
+    }
+
+    if (cache->next)
+        cache->next->prev = cache->prev;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    bf_free(cache);
+}
+
+static void
+bf_buffer_pool_cache_flush(struct bf_buffer_pool_cache *cache,
+                           unsigned int class, size_t n) {
+    struct bf_buffer_pool *pool;
+
+    pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (n > 0 && pool->nb_buffers[class] < pool->max_buffers) {
+        pool->buffers[class][pool->nb_buffers[class]++] =
+            cache->buffers[class][--cache->nb_buffers[class]];
+        n--;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (n > 0) {
+        bf_buffer_delete(cache->buffers[class][--cache->nb_buffers[class]]);
+        n--;
+    }
+}
+
+static void
+bf_buffer_pool_cache_refill(struct bf_buffer_pool_cache *cache,
+                            unsigned int class) {
+    struct bf_buffer_pool *pool;
+    size_t n;
+
+    pool = cache->pool;
+
+    n = BF_POOL_THREAD_CACHE_SIZE / 2;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (n > 0 && pool->nb_buffers[class] > 0) {
+        cache->buffers[class][cache->nb_buffers[class]++] =
+            pool->buffers[class][--pool->nb_buffers[class]];
+        n--;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static int
+bf_buffer_pool_class_for_request(size_t size, unsigned int *pclass) {
+    unsigned int shift;
+
+    shift = BF_POOL_MIN_CLASS_SHIFT;
+    while (((size_t)1 << shift) < size) {
+        if (shift == BF_POOL_MAX_CLASS_SHIFT)
+            return -1;
+
+        shift++;
+    }
+
+    *pclass = shift - BF_POOL_MIN_CLASS_SHIFT;
+    return 0;
+}
+
+static int
+bf_buffer_pool_class_for_buffer(size_t size, unsigned int *pclass) {
+    unsigned int shift;
+
+    if (size < ((size_t)1 << BF_POOL_MIN_CLASS_SHIFT))
+        return -1;
+    if (size >= ((size_t)1 << (BF_POOL_MAX_CLASS_SHIFT + 1)))
+        return -1;
+
+    shift = BF_POOL_MIN_CLASS_SHIFT;
+    while (((size_t)1 << (shift + 1)) <= size)
+        shift++;
+
+    *pclass = shift - BF_POOL_MIN_CLASS_SHIFT;
+    return 0;
+}
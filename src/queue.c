@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_CACHE_LINE_SIZE 64U
+
+/*
+ * A queue is a ring buffer mapped twice (see ring.c) shared by exactly one
+ * producer thread and one consumer thread. The producer only writes tail and
+ * the consumer only writes head; both are free running counters, and the
+ * offset of a position in the ring is the counter modulo the size of the
+ * ring, which is a power of two.
+ *
+ * Each thread keeps a copy of the counter of the other thread and only loads
+ * the shared one when its copy says there is not enough free space or
+ * content. Fields written by different threads are padded to different cache
+ * lines so that they do not bounce between cores.
+ */
+
+struct bf_queue {
+    char *data;
+    size_t sz;
+    size_t mask;
+
+    char pad1[BF_CACHE_LINE_SIZE];
+
+    /* Producer */
+    size_t tail;
+    size_t cached_head;
+
+    char pad2[BF_CACHE_LINE_SIZE];
+
+    /* Consumer */
+    size_t head;
+    size_t cached_tail;
+
+    char pad3[BF_CACHE_LINE_SIZE];
+};
+
+static size_t bf_queue_producer_free_space(struct bf_queue *);
+static size_t bf_queue_consumer_length(struct bf_queue *);
+
+struct bf_queue *
+bf_queue_new(size_t size) {
+    struct bf_queue *queue;
+    size_t page_size, sz;
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    sz = page_size;
+    while (sz < size) {
+        if (sz > SIZE_MAX / 2) {
+            bf_set_error("queue size too large");
+            return NULL;
+        }
+
+        sz *= 2;
+    }
+
+    queue = bf_malloc(sizeof(struct bf_queue));
+    if (!queue)
+        return NULL;
+
+    memset(queue, 0, sizeof(struct bf_queue));
+
+    queue->data = bf_mirror_map(sz);
+    if (!queue->data) {
+        bf_free(queue);
+        return NULL;
+    }
+
+    queue->sz = sz;
+    queue->mask = sz - 1;
+
+    return queue;
+}
+
+void
+bf_queue_delete(struct bf_queue *queue) {
+    if (!queue)
+        return;
+
+    bf_mirror_unmap(queue->data, queue->sz);
+    bf_free(queue);
+}
+
+size_t
+bf_queue_size(const struct bf_queue *queue) {
+    return queue->sz;
+}
+
+size_t
+bf_queue_free_space(struct bf_queue *queue) {
+    queue->cached_head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    return bf_queue_producer_free_space(queue);
+}
+
+void *
+bf_queue_reserve(struct bf_queue *queue, size_t sz) {
+    if (bf_queue_producer_free_space(queue) < sz
+     && bf_queue_free_space(queue) < sz) {
+        bf_set_error("not enough free space in queue");
+        return NULL;
+    }
+
+    return queue->data + (queue->tail & queue->mask);
+}
+
+int
+bf_queue_increase_length(struct bf_queue *queue, size_t n) {
+    if (n > bf_queue_producer_free_space(queue)) {
+        bf_set_error("length increment too large");
+        return -1;
+    }
+
+    __atomic_store_n(&queue->tail, queue->tail + n, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+bf_queue_add(struct bf_queue *queue, const void *data, size_t sz) {
+    char *ptr;
+
+    ptr = bf_queue_reserve(queue, sz);
+    if (!ptr)
+        return -1;
+
+    memcpy(ptr, data, sz);
+
+    __atomic_store_n(&queue->tail, queue->tail + sz, __ATOMIC_RELEASE);
+    return 0;
+}
+
+ssize_t
+bf_queue_read(struct bf_queue *queue, int fd, size_t n) {
+    ssize_t ret;
+    size_t free_space;
+
+    free_space = bf_queue_free_space(queue);
+    if (n > free_space)
+        n = free_space;
+
+    if (n == 0) {
+        bf_set_error("queue is full");
+        return -1;
+    }
+
+    ret = read(fd, queue->data + (queue->tail & queue->mask), n);
+    if (ret > 0) {
+        __atomic_store_n(&queue->tail, queue->tail + (size_t)ret,
+                         __ATOMIC_RELEASE);
+    }
+
+    return ret;
+}
+
+void *
+bf_queue_data(const struct bf_queue *queue) {
+    return queue->data + (queue->head & queue->mask);
+}
+
+size_t
+bf_queue_length(struct bf_queue *queue) {
+    queue->cached_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return bf_queue_consumer_length(queue);
+}
+
+void
+bf_queue_skip(struct bf_queue *queue, size_t n) {
+    if (n > bf_queue_consumer_length(queue)) {
+        size_t len;
+
+        len = bf_queue_length(queue);
+        if (n > len)
+            n = len;
+    }
+
+    __atomic_store_n(&queue->head, queue->head + n, __ATOMIC_RELEASE);
+}
+
+ssize_t
+bf_queue_write(struct bf_queue *queue, int fd) {
+    ssize_t ret;
+
+    ret = write(fd, bf_queue_data(queue), bf_queue_length(queue));
+    if (ret > 0) {
+        __atomic_store_n(&queue->head, queue->head + (size_t)ret,
+                         __ATOMIC_RELEASE);
+    }
+
+    return ret;
+}
+
+static size_t
+bf_queue_producer_free_space(struct bf_queue *queue) {
+    return queue->sz - (queue->tail - queue->cached_head);
+}
+
+static size_t
+bf_queue_consumer_length(struct bf_queue *queue) {
+    return queue->cached_tail - queue->head;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef BF_PLATFORM_LINUX
+#   define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#ifdef BF_PLATFORM_LINUX
+#   include <sys/sendfile.h>
+#   include <sys/uio.h>
+#endif
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_SEND_FILE_CHUNK_SIZE 16384U
+
+/*
+ * A relay moves data between two file descriptors without copying them to
+ * user space: data are spliced from the input file descriptor into a pipe
+ * owned by the relay, then from the pipe to the output file descriptor.
+ *
+ * Not all file descriptors support splice(). The first time the kernel
+ * rejects it, the content of the pipe is read into a buffer, the pipe is
+ * closed, and the relay falls back to read() and write() for the rest of
+ * its life. Data are therefore never stored in both the pipe and the buffer
+ * at the same time, and their order is preserved.
+ */
+
+struct bf_relay {
+    int pipe[2];
+    size_t pipe_len;
+
+    struct bf_buffer *buf;
+    int use_splice;
+};
+
+#ifdef BF_PLATFORM_LINUX
+static int bf_relay_disable_splice(struct bf_relay *);
+static int bf_splice_unsupported(int);
+#endif
+
+struct bf_relay *
+bf_relay_new(void) {
+    struct bf_relay *relay;
+
+    relay = bf_malloc(sizeof(struct bf_relay));
+    if (!relay)
+        return NULL;
+
+    memset(relay, 0, sizeof(struct bf_relay));
+
+    relay->pipe[0] = -1;
+    relay->pipe[1] = -1;
+
+    relay->buf = bf_buffer_new(0);
+    if (!relay->buf) {
+        bf_free(relay);
+        return NULL;
+    }
+
+#ifdef BF_PLATFORM_LINUX
+    if (pipe2(relay->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        relay->use_splice = 1;
+    } else {
+        relay->pipe[0] = -1;
+        relay->pipe[1] = -1;
+    }
+#endif
+
+    return relay;
+}
+
+void
+bf_relay_delete(struct bf_relay *relay) {
+    if (!relay)
+        return;
+
+    if (relay->pipe[0] >= 0) {
+        close(relay->pipe[0]);
+        close(relay->pipe[1]);
+    }
+
+    bf_buffer_delete(relay->buf);
+    bf_free(relay);
+}
+
+size_t
+bf_relay_length(const struct bf_relay *relay) {
+    return relay->pipe_len + bf_buffer_length(relay->buf);
+}
+
+ssize_t
+bf_relay_read(struct bf_relay *relay, int fd, size_t n) {
+#ifdef BF_PLATFORM_LINUX
+    if (relay->use_splice) {
+        ssize_t ret;
+
+        ret = splice(fd, NULL, relay->pipe[1], NULL, n,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0)
+            relay->pipe_len += (size_t)ret;
+
+        if (ret >= 0 || !bf_splice_unsupported(errno))
+            return ret;
+
+        if (bf_relay_disable_splice(relay) == -1)
+            return -1;
+    }
+#endif
+
+    return bf_buffer_read(relay->buf, fd, n);
+}
+
+ssize_t
+bf_relay_write(struct bf_relay *relay, int fd) {
+#ifdef BF_PLATFORM_LINUX
+    if (relay->use_splice) {
+        ssize_t ret;
+
+        if (relay->pipe_len == 0)
+            return 0;
+
+        ret = splice(relay->pipe[0], NULL, fd, NULL, relay->pipe_len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0)
+            relay->pipe_len -= (size_t)ret;
+
+        if (ret >= 0 || !bf_splice_unsupported(errno))
+            return ret;
+
+        if (bf_relay_disable_splice(relay) == -1)
+            return -1;
+    }
+#endif
+
+    return bf_buffer_write(relay->buf, fd);
+}
+
+ssize_t
+bf_send_file(int fd, int file_fd, off_t *poffset, size_t n) {
+    char chunk[BF_SEND_FILE_CHUNK_SIZE];
+    ssize_t ret;
+
+#ifdef BF_PLATFORM_LINUX
+    ret = sendfile(fd, file_fd, poffset, n);
+    if (ret >= 0 || !bf_splice_unsupported(errno))
+        return ret;
+#endif
+
+    if (n > sizeof(chunk))
+        n = sizeof(chunk);
+
+    ret = pread(file_fd, chunk, n, *poffset);
+    if (ret <= 0)
+        return ret;
+
+    /* Only bytes which were actually written are consumed, the next call
+     * reads the rest again. */
+    ret = write(fd, chunk, (size_t)ret);
+    if (ret > 0)
+        *poffset += ret;
+
+    return ret;
+}
+
+ssize_t
+bf_buffer_vmsplice(struct bf_buffer *buf, int fd, struct bf_slice *slice) {
+#ifdef BF_PLATFORM_LINUX
+    struct iovec iov;
+    ssize_t ret;
+    int error;
+#endif
+
+    memset(slice, 0, sizeof(struct bf_slice));
+
+#ifdef BF_PLATFORM_LINUX
+    if (bf_buffer_length(buf) == 0)
+        return 0;
+
+    /* The pipe references the pages of the buffer until its content is read.
+     * The slice keeps these pages alive, and forces the buffer to copy its
+     * data instead of writing over them. */
+    if (bf_buffer_slice(buf, 0, bf_buffer_length(buf), slice) == -1)
+        return -1;
+
+    iov.iov_base = (void *)slice->data;
+    iov.iov_len = slice->len;
+
+    ret = vmsplice(fd, &iov, 1, 0);
+    if (ret > 0) {
+        slice->len = (size_t)ret;
+        bf_buffer_skip(buf, (size_t)ret);
+        return ret;
+    }
+
+    error = errno;
+    bf_slice_release(slice);
+    errno = error;
+
+    if (ret == 0 || !bf_splice_unsupported(errno))
+        return ret;
+#endif
+
+    return bf_buffer_write(buf, fd);
+}
+
+#ifdef BF_PLATFORM_LINUX
+static int
+bf_relay_disable_splice(struct bf_relay *relay) {
+    while (relay->pipe_len > 0) {
+        ssize_t ret;
+
+        ret = bf_buffer_read(relay->buf, relay->pipe[0], relay->pipe_len);
+        if (ret == -1)
+            return -1;
+
+        relay->pipe_len -= (size_t)ret;
+    }
+
+    close(relay->pipe[0]);
+    close(relay->pipe[1]);
+
+    relay->pipe[0] = -1;
+    relay->pipe[1] = -1;
+
+    relay->use_splice = 0;
+    return 0;
+}
+
+static int
+bf_splice_unsupported(int error) {
+    return error == EINVAL || error == ENOSYS;
+}
+#endif
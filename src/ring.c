@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef BF_PLATFORM_LINUX
+#   define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#ifdef BF_PLATFORM_LINUX
+#   include <sys/mman.h>
+#endif
+
+#include "internal.h"
+#include "buffer.h"
+
+/*
+ * The same memory file of sz bytes is mapped twice, back to back:
+ *
+ *                  sz                          sz
+ *   <----------------------------> <---------------------------->
+ *
+ *            skip        len
+ *   <---------------> <-------------------->
+ *
+ *   +-----------------+------------+-------+-----------------+---+
+ *   |                 |      content       |                 |   |
+ *   +-----------------+------------+-------+-----------------+---+
+ *                                   mirror of the beginning
+ *
+ * Content which wraps around the end of the first mapping is visible
+ * contiguously in the second one, so both the content and the free space
+ * following it are always contiguous. Skipping data only moves skip, and
+ * nothing is ever moved or reallocated.
+ */
+
+struct bf_ring {
+    char *data;
+    size_t sz;
+    size_t skip;
+    size_t len;
+};
+
+struct bf_ring *
+bf_ring_new(size_t size) {
+    struct bf_ring *ring;
+    size_t page_size;
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (size == 0)
+        size = page_size;
+    size = (size + page_size - 1) / page_size * page_size;
+
+    ring = bf_malloc(sizeof(struct bf_ring));
+    if (!ring)
+        return NULL;
+
+    memset(ring, 0, sizeof(struct bf_ring));
+
+    ring->data = bf_mirror_map(size);
+    if (!ring->data) {
+        bf_free(ring);
+        return NULL;
+    }
+
+    ring->sz = size;
+
+    return ring;
+}
+
+void
+bf_ring_delete(struct bf_ring *ring) {
+    if (!ring)
+        return;
+
+    bf_mirror_unmap(ring->data, ring->sz);
+    bf_free(ring);
+}
+
+void *
+bf_ring_data(const struct bf_ring *ring) {
+    return ring->data + ring->skip;
+}
+
+size_t
+bf_ring_length(const struct bf_ring *ring) {
+    return ring->len;
+}
+
+size_t
+bf_ring_size(const struct bf_ring *ring) {
+    return ring->sz;
+}
+
+size_t
+bf_ring_free_space(const struct bf_ring *ring) {
+    return ring->sz - ring->len;
+}
+
+void
+bf_ring_clear(struct bf_ring *ring) {
+    ring->skip = 0;
+    ring->len = 0;
+}
+
+void *
+bf_ring_reserve(struct bf_ring *ring, size_t sz) {
+    if (sz > ring->sz - ring->len) {
+        bf_set_error("not enough free space in ring buffer");
+        return NULL;
+    }
+
+    return ring->data + ring->skip + ring->len;
+}
+
+int
+bf_ring_increase_length(struct bf_ring *ring, size_t n) {
+    if (n > ring->sz - ring->len) {
+        bf_set_error("length increment too large");
+        return -1;
+    }
+
+    ring->len += n;
+    return 0;
+}
+
+int
+bf_ring_add(struct bf_ring *ring, const void *data, size_t sz) {
+    char *ptr;
+
+    ptr = bf_ring_reserve(ring, sz);
+    if (!ptr)
+        return -1;
+
+    memcpy(ptr, data, sz);
+    ring->len += sz;
+
+    return 0;
+}
+
+void
+bf_ring_skip(struct bf_ring *ring, size_t n) {
+    if (n > ring->len)
+        n = ring->len;
+
+    ring->len -= n;
+    ring->skip += n;
+
+    if (ring->skip >= ring->sz)
+        ring->skip -= ring->sz;
+
+    if (ring->len == 0)
+        ring->skip = 0;
+}
+
+ssize_t
+bf_ring_read(struct bf_ring *ring, int fd, size_t n) {
+    ssize_t ret;
+
+    if (n > ring->sz - ring->len)
+        n = ring->sz - ring->len;
+
+    if (n == 0) {
+        bf_set_error("ring buffer is full");
+        return -1;
+    }
+
+    ret = read(fd, ring->data + ring->skip + ring->len, n);
+    if (ret > 0)
+        ring->len += (size_t)ret;
+
+    return ret;
+}
+
+ssize_t
+bf_ring_write(struct bf_ring *ring, int fd) {
+    ssize_t ret;
+
+    ret = write(fd, ring->data + ring->skip, ring->len);
+    if (ret > 0)
+        bf_ring_skip(ring, (size_t)ret);
+
+    return ret;
+}
+
+#ifdef BF_PLATFORM_LINUX
+char *
+bf_mirror_map(size_t sz) {
+    char *addr, *ptr;
+    int fd;
+
+    fd = memfd_create("libbuffer-ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        bf_set_error("cannot create memory file: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)sz) == -1) {
+        bf_set_error("cannot truncate memory file: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* Reserve the address range first so that the two mappings are
+     * guaranteed to be adjacent. */
+    addr = mmap(NULL, sz * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        bf_set_error("cannot reserve memory: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    ptr = mmap(addr, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+               fd, 0);
+    if (ptr == MAP_FAILED)
+        goto error;
+
+    ptr = mmap(addr + sz, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+               fd, 0);
+    if (ptr == MAP_FAILED)
+        goto error;
+
+    close(fd);
+    return addr;
+
+error:
+    bf_set_error("cannot map memory file: %s", strerror(errno));
+    munmap(addr, sz * 2);
+    close(fd);
+    return NULL;
+}
+
+void
+bf_mirror_unmap(char *data, size_t sz) {
+    munmap(data, sz * 2);
+}
+#else
+char *
+bf_mirror_map(size_t sz) {
+    bf_set_error("ring buffers are not supported on this platform");
+    return NULL;
+}
+
+void
+bf_mirror_unmap(char *data, size_t sz) {
+}
+#endif
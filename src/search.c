@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#   define BF_SEARCH_X86
+#   include <immintrin.h>
+#endif
+
+#include "internal.h"
+#include "buffer.h"
+
+/*
+ * Searching for a single byte is left to memchr(), which is already
+ * vectorized by the C library. Sets of bytes and substrings are searched
+ * with SSE2 or AVX2 depending on the processor, selected the first time a
+ * search function is called. Sets of more than 16 bytes are matched with a
+ * 256 bit table, one byte at a time.
+ */
+
+#define BF_SEARCH_SIMD_MAX_SET 16U
+
+typedef const char *(*bf_find_set_fn)(const char *, const char *,
+                                      const char *, size_t, int);
+typedef const char *(*bf_find_mem_fn)(const char *, const char *,
+                                      const char *, size_t);
+
+static const char *bf_find_set_scalar(const char *, const char *,
+                                      const char *, size_t, int);
+static const char *bf_find_mem_scalar(const char *, const char *,
+                                      const char *, size_t);
+
+#ifdef BF_SEARCH_X86
+static const char *bf_find_set_sse2(const char *, const char *,
+                                    const char *, size_t, int);
+static const char *bf_find_set_avx2(const char *, const char *,
+                                    const char *, size_t, int);
+static const char *bf_find_mem_sse2(const char *, const char *,
+                                    const char *, size_t);
+static const char *bf_find_mem_avx2(const char *, const char *,
+                                    const char *, size_t);
+#endif
+
+static bf_find_set_fn bf_find_set_impl;
+static bf_find_mem_fn bf_find_mem_impl;
+
+static void bf_search_init(void);
+
+const void *
+bf_memfind_any(const void *data, size_t sz, const char *set, size_t set_sz) {
+    const char *start;
+
+    if (set_sz == 0)
+        return NULL;
+    if (set_sz == 1)
+        return memchr(data, set[0], sz);
+
+    bf_search_init();
+
+    start = data;
+    return bf_find_set_impl(start, start + sz, set, set_sz, 1);
+}
+
+const void *
+bf_memfind_not_any(const void *data, size_t sz, const char *set,
+                   size_t set_sz) {
+    const char *start;
+
+    start = data;
+
+    if (set_sz == 0)
+        return (sz > 0) ? start : NULL;
+
+    bf_search_init();
+
+    return bf_find_set_impl(start, start + sz, set, set_sz, 0);
+}
+
+const void *
+bf_memfind(const void *data, size_t sz, const void *needle, size_t needle_sz) {
+    const char *start;
+
+    start = data;
+
+    if (needle_sz == 0)
+        return start;
+    if (needle_sz > sz)
+        return NULL;
+    if (needle_sz == 1)
+        return memchr(data, ((const char *)needle)[0], sz);
+
+    bf_search_init();
+
+    return bf_find_mem_impl(start, start + sz, needle, needle_sz);
+}
+
+ssize_t
+bf_buffer_find(const struct bf_buffer *buf, size_t offset, int c) {
+    const char *data, *ptr;
+    size_t len;
+
+    data = bf_buffer_data(buf);
+    len = bf_buffer_length(buf);
+
+    if (offset >= len)
+        return -1;
+
+    ptr = memchr(data + offset, c, len - offset);
+    return ptr ? ptr - data : -1;
+}
+
+ssize_t
+bf_buffer_find_any(const struct bf_buffer *buf, size_t offset,
+                   const char *set, size_t set_sz) {
+    const char *data, *ptr;
+    size_t len;
+
+    data = bf_buffer_data(buf);
+    len = bf_buffer_length(buf);
+
+    if (offset >= len)
+        return -1;
+
+    ptr = bf_memfind_any(data + offset, len - offset, set, set_sz);
+    return ptr ? ptr - data : -1;
+}
+
+ssize_t
+bf_buffer_find_not_any(const struct bf_buffer *buf, size_t offset,
+                       const char *set, size_t set_sz) {
+    const char *data, *ptr;
+    size_t len;
+
+    data = bf_buffer_data(buf);
+    len = bf_buffer_length(buf);
+
+    if (offset >= len)
+        return -1;
+
+    ptr = bf_memfind_not_any(data + offset, len - offset, set, set_sz);
+    return ptr ? ptr - data : -1;
+}
+
+ssize_t
+bf_buffer_find_mem(const struct bf_buffer *buf, size_t offset,
+                   const void *needle, size_t needle_sz) {
+    const char *data, *ptr;
+    size_t len;
+
+    data = bf_buffer_data(buf);
+    len = bf_buffer_length(buf);
+
+    if (offset > len)
+        return -1;
+    if (needle_sz == 0)
+        return (ssize_t)offset;
+
+    ptr = bf_memfind(data + offset, len - offset, needle, needle_sz);
+    return ptr ? ptr - data : -1;
+}
+
+ssize_t
+bf_buffer_find_string(const struct bf_buffer *buf, size_t offset,
+                      const char *str) {
+    return bf_buffer_find_mem(buf, offset, str, strlen(str));
+}
+
+static void
+bf_search_init(void) {
+    bf_find_set_fn find_set;
+    bf_find_mem_fn find_mem;
+
+    if (__atomic_load_n(&bf_find_mem_impl, __ATOMIC_ACQUIRE))
+        return;
+
+    find_set = bf_find_set_scalar;
+    find_mem = bf_find_mem_scalar;
+
+#ifdef BF_SEARCH_X86
+    __builtin_cpu_init();
+
+    find_set = bf_find_set_sse2;
+    find_mem = bf_find_mem_sse2;
+
+    if (__builtin_cpu_supports("avx2")) {
+        find_set = bf_find_set_avx2;
+        find_mem = bf_find_mem_avx2;
+    }
+#endif
+
+    __atomic_store_n(&bf_find_set_impl, find_set, __ATOMIC_RELEASE);
+    __atomic_store_n(&bf_find_mem_impl, find_mem, __ATOMIC_RELEASE);
+}
+
+static const char *
+bf_find_set_scalar(const char *ptr, const char *end,
+                   const char *set, size_t set_sz, int match) {
+    uint64_t table[4];
+    size_t i;
+
+    memset(table, 0, sizeof(table));
+    for (i = 0; i < set_sz; i++) {
+        unsigned char c;
+
+        c = (unsigned char)set[i];
+        table[c >> 6] |= (uint64_t)1 << (c & 63);
+    }
+
+    for (; ptr < end; ptr++) {
+        unsigned char c;
+        int found;
+
+        c = (unsigned char)*ptr;
+        found = (table[c >> 6] >> (c & 63)) & 1;
+
+        if (found == match)
+            return ptr;
+    }
+
+    return NULL;
+}
+
+static const char *
+bf_find_mem_scalar(const char *ptr, const char *end,
+                   const char *needle, size_t needle_sz) {
+    const char *last;
+
+    last = end - needle_sz;
+
+    while (ptr <= last) {
+        ptr = memchr(ptr, needle[0], (size_t)(last - ptr) + 1);
+        if (!ptr)
+            return NULL;
+
+        if (memcmp(ptr + 1, needle + 1, needle_sz - 1) == 0)
+            return ptr;
+
+        ptr++;
+    }
+
+    return NULL;
+}
+
+#ifdef BF_SEARCH_X86
+static const char *
+bf_find_set_sse2(const char *ptr, const char *end,
+                 const char *set, size_t set_sz, int match) {
+    __m128i chars[BF_SEARCH_SIMD_MAX_SET];
+    unsigned int invert;
+    size_t i;
+
+    if (set_sz > BF_SEARCH_SIMD_MAX_SET)
+        return bf_find_set_scalar(ptr, end, set, set_sz, match);
+
+    for (i = 0; i < set_sz; i++)
+        chars[i] = _mm_set1_epi8(set[i]);
+
+    invert = match ? 0 : 0xffff;
+
+    while (end - ptr >= 16) {
+        __m128i block, eq;
+        unsigned int mask;
+
+        block = _mm_loadu_si128((const __m128i *)ptr);
+
+        eq = _mm_cmpeq_epi8(block, chars[0]);
+        for (i = 1; i < set_sz; i++)
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, chars[i]));
+
+        mask = ((unsigned int)_mm_movemask_epi8(eq)) ^ invert;
+        if (mask != 0)
+            return ptr + __builtin_ctz(mask);
+
+        ptr += 16;
+    }
+
+    return bf_find_set_scalar(ptr, end, set, set_sz, match);
+}
+
+__attribute__((target("avx2")))
+static const char *
+bf_find_set_avx2(const char *ptr, const char *end,
+                 const char *set, size_t set_sz, int match) {
+    __m256i chars[BF_SEARCH_SIMD_MAX_SET];
+    unsigned int invert;
+    size_t i;
+
+    if (set_sz > BF_SEARCH_SIMD_MAX_SET)
+        return bf_find_set_scalar(ptr, end, set, set_sz, match);
+
+    for (i = 0; i < set_sz; i++)
+        chars[i] = _mm256_set1_epi8(set[i]);
+
+    invert = match ? 0 : 0xffffffff;
+
+    while (end - ptr >= 32) {
+        __m256i block, eq;
+        unsigned int mask;
+
+        block = _mm256_loadu_si256((const __m256i *)ptr);
+
+        eq = _mm256_cmpeq_epi8(block, chars[0]);
+        for (i = 1; i < set_sz; i++)
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, chars[i]));
+
+        mask = ((unsigned int)_mm256_movemask_epi8(eq)) ^ invert;
+        if (mask != 0)
+            return ptr + __builtin_ctz(mask);
+
+        ptr += 32;
+    }
+
+    return bf_find_set_sse2(ptr, end, set, set_sz, match);
+}
+
+/* Substrings are searched by comparing both the first and the last byte of
+ * the needle with each position of a block, and only comparing the whole
+ * needle where both match. */
+
+static const char *
+bf_find_mem_sse2(const char *ptr, const char *end,
+                 const char *needle, size_t needle_sz) {
+    __m128i first, last;
+
+    first = _mm_set1_epi8(needle[0]);
+    last = _mm_set1_epi8(needle[needle_sz - 1]);
+
+    while ((size_t)(end - ptr) >= needle_sz + 15) {
+        __m128i block_first, block_last;
+        unsigned int mask;
+
+        block_first = _mm_loadu_si128((const __m128i *)ptr);
+        block_last = _mm_loadu_si128((const __m128i *)(ptr + needle_sz - 1));
+
+        mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                          _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask != 0) {
+            unsigned int bit;
+
+            bit = (unsigned int)__builtin_ctz(mask);
+            if (memcmp(ptr + bit + 1, needle + 1, needle_sz - 2) == 0)
+                return ptr + bit;
+
+            mask &= mask - 1;
+        }
+
+        ptr += 16;
+    }
+
+    return bf_find_mem_scalar(ptr, end, needle, needle_sz);
+}
+
+__attribute__((target("avx2")))
+static const char *
+bf_find_mem_avx2(const char *ptr, const char *end,
+                 const char *needle, size_t needle_sz) {
+    __m256i first, last;
+
+    first = _mm256_set1_epi8(needle[0]);
+    last = _mm256_set1_epi8(needle[needle_sz - 1]);
+
+    while ((size_t)(end - ptr) >= needle_sz + 31) {
+        __m256i block_first, block_last;
+        unsigned int mask;
+
+        block_first = _mm256_loadu_si256((const __m256i *)ptr);
+        block_last = _mm256_loadu_si256(
+            (const __m256i *)(ptr + needle_sz - 1));
+
+        mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                             _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask != 0) {
+            unsigned int bit;
+
+            bit = (unsigned int)__builtin_ctz(mask);
+            if (memcmp(ptr + bit + 1, needle + 1, needle_sz - 2) == 0)
+                return ptr + bit;
+
+            mask &= mask - 1;
+        }
+
+        ptr += 32;
+    }
+
+    return bf_find_mem_sse2(ptr, end, needle, needle_sz);
+}
+#endif
@@ -0,0 +1,721 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#ifdef BF_PLATFORM_LINUX
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <sys/uio.h>
+#   include <linux/io_uring.h>
+#   ifdef __NR_io_uring_setup
+#       define BF_URING_NATIVE
+#   endif
+#endif
+
+#include "internal.h"
+#include "buffer.h"
+
+#define BF_URING_DEFAULT_NB_ENTRIES 256U
+#define BF_URING_MAX_IO_SIZE        ((size_t)1 << 30)
+
+/*
+ * Each queued operation uses a slot until its completion has been returned
+ * to the caller; the index of the slot is the user data of the submission
+ * queue entry. There are twice as many slots as submission queue entries,
+ * which is the size of the completion queue, so that completions can never
+ * be dropped by the kernel.
+ *
+ * When io_uring is not available, operations are kept in a list of pending
+ * slots; they are executed with read() and write() when the uring is
+ * submitted, and moved to a list of completed slots.
+ */
+
+struct bf_uring_slot {
+    struct bf_buffer *buf;
+    int fd;
+    enum bf_uring_op op;
+    size_t len;
+    void *udata;
+
+    ssize_t result;
+    int error;
+
+    int next;
+};
+
+struct bf_uring_registration {
+    struct bf_buffer *buf;
+    void *data;
+    size_t sz;
+};
+
+#ifdef BF_URING_NATIVE
+struct bf_uring_sq {
+    unsigned int *head;
+    unsigned int *tail;
+    unsigned int *array;
+    unsigned int mask;
+    unsigned int nb_entries;
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    unsigned int nb_unsubmitted;
+};
+
+struct bf_uring_cq {
+    unsigned int *head;
+    unsigned int *tail;
+    unsigned int mask;
+
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct bf_uring {
+    int fd;
+
+#ifdef BF_URING_NATIVE
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+
+    struct bf_uring_sq sq;
+    struct bf_uring_cq cq;
+#endif
+
+    struct bf_uring_slot *slots;
+    unsigned int nb_slots;
+    int free_slots;
+
+    int pending_head, pending_tail;
+    int done_head, done_tail;
+
+    struct bf_uring_registration *registrations;
+    size_t nb_registrations;
+};
+
+static int bf_uring_queue(struct bf_uring *, struct bf_buffer *, int,
+                          enum bf_uring_op, void *, size_t);
+static int bf_uring_alloc_slot(struct bf_uring *);
+static void bf_uring_free_slot(struct bf_uring *, int);
+static void bf_uring_push(struct bf_uring *, int *, int *, int);
+static int bf_uring_pop(struct bf_uring *, int *, int *);
+static void bf_uring_execute(struct bf_uring *, int);
+static void bf_uring_complete(struct bf_uring *, int,
+                              struct bf_uring_completion *);
+
+#ifdef BF_URING_NATIVE
+static int bf_uring_setup(struct bf_uring *, unsigned int);
+static void bf_uring_teardown(struct bf_uring *);
+static int bf_uring_enter(struct bf_uring *, unsigned int, unsigned int);
+static int bf_uring_register(struct bf_uring *, unsigned int,
+                             const void *, unsigned int);
+static int bf_uring_queue_sqe(struct bf_uring *, int);
+static int bf_uring_fixed_index(const struct bf_uring *, int);
+#endif
+
+struct bf_uring *
+bf_uring_new(unsigned int nb_entries, int flags) {
+    struct bf_uring *uring;
+    unsigned int i;
+
+    if (nb_entries == 0)
+        nb_entries = BF_URING_DEFAULT_NB_ENTRIES;
+
+    if (nb_entries > 32768) {
+        bf_set_error("too many entries");
+        return NULL;
+    }
+
+    uring = bf_malloc(sizeof(struct bf_uring));
+    if (!uring)
+        return NULL;
+
+    memset(uring, 0, sizeof(struct bf_uring));
+
+    uring->fd = -1;
+
+    uring->pending_head = -1;
+    uring->pending_tail = -1;
+    uring->done_head = -1;
+    uring->done_tail = -1;
+
+#ifdef BF_URING_NATIVE
+    if (!(flags & BF_URING_FALLBACK)) {
+        /* If the kernel does not support io_uring, or does not support it
+         * well enough, we silently use the fallback. */
+        if (bf_uring_setup(uring, nb_entries) == 0)
+            nb_entries = uring->sq.nb_entries;
+    }
+#endif
+
+    uring->nb_slots = nb_entries * 2;
+    uring->slots = bf_calloc(uring->nb_slots, sizeof(struct bf_uring_slot));
+    if (!uring->slots) {
+        bf_uring_delete(uring);
+        return NULL;
+    }
+
+    uring->free_slots = -1;
+    for (i = uring->nb_slots; i > 0; i--)
+        bf_uring_free_slot(uring, (int)(i - 1));
+
+    return uring;
+}
+
+void
+bf_uring_delete(struct bf_uring *uring) {
+    if (!uring)
+        return;
+
+#ifdef BF_URING_NATIVE
+    /* Closing the file descriptor cancels operations in progress and
+     * releases registered buffers. */
+    if (uring->fd >= 0)
+        bf_uring_teardown(uring);
+#endif
+
+    bf_free(uring->registrations);
+    bf_free(uring->slots);
+    bf_free(uring);
+}
+
+int
+bf_uring_is_native(const struct bf_uring *uring) {
+    return uring->fd >= 0;
+}
+
+int
+bf_uring_register_buffers(struct bf_uring *uring,
+                          struct bf_buffer **bufs, size_t nb_bufs) {
+    struct bf_uring_registration *registrations;
+    size_t i;
+
+    registrations = NULL;
+
+    if (nb_bufs > 0) {
+        registrations = bf_calloc(nb_bufs,
+                                  sizeof(struct bf_uring_registration));
+        if (!registrations)
+            return -1;
+
+        for (i = 0; i < nb_bufs; i++) {
+            struct bf_uring_registration *registration;
+
+            registration = registrations + i;
+
+            registration->buf = bufs[i];
+            bf_buffer_get_storage(bufs[i], &registration->data,
+                                  &registration->sz);
+
+            if (registration->sz == 0) {
+                bf_set_error("cannot register an empty buffer");
+                bf_free(registrations);
+                return -1;
+            }
+        }
+    }
+
+#ifdef BF_URING_NATIVE
+    if (uring->fd >= 0) {
+        struct iovec *iov;
+
+        if (uring->nb_registrations > 0) {
+            if (bf_uring_register(uring, IORING_UNREGISTER_BUFFERS,
+                                  NULL, 0) == -1) {
+                bf_free(registrations);
+                return -1;
+            }
+        }
+
+        bf_free(uring->registrations);
+        uring->registrations = NULL;
+        uring->nb_registrations = 0;
+
+        if (nb_bufs == 0)
+            return 0;
+
+        iov = bf_calloc(nb_bufs, sizeof(struct iovec));
+        if (!iov) {
+            bf_free(registrations);
+            return -1;
+        }
+
+        for (i = 0; i < nb_bufs; i++) {
+            iov[i].iov_base = registrations[i].data;
+            iov[i].iov_len = registrations[i].sz;
+        }
+
+        if (bf_uring_register(uring, IORING_REGISTER_BUFFERS,
+                              iov, (unsigned int)nb_bufs) == -1) {
+            bf_free(iov);
+            bf_free(registrations);
+            return -1;
+        }
+
+        bf_free(iov);
+    }
+#endif
+
+    bf_free(uring->registrations);
+    uring->registrations = registrations;
+    uring->nb_registrations = nb_bufs;
+
+    return 0;
+}
+
+int
+bf_uring_queue_read(struct bf_uring *uring, struct bf_buffer *buf, int fd,
+                    size_t n, void *udata) {
+    if (n > BF_URING_MAX_IO_SIZE)
+        n = BF_URING_MAX_IO_SIZE;
+
+    if (!bf_buffer_reserve(buf, n))
+        return -1;
+
+    return bf_uring_queue(uring, buf, fd, BF_URING_READ, udata, n);
+}
+
+int
+bf_uring_queue_write(struct bf_uring *uring, struct bf_buffer *buf, int fd,
+                     void *udata) {
+    size_t n;
+
+    n = bf_buffer_length(buf);
+    if (n > BF_URING_MAX_IO_SIZE)
+        n = BF_URING_MAX_IO_SIZE;
+
+    return bf_uring_queue(uring, buf, fd, BF_URING_WRITE, udata, n);
+}
+
+int
+bf_uring_submit(struct bf_uring *uring, unsigned int nb_waits) {
+    int slot, nb_submitted;
+
+#ifdef BF_URING_NATIVE
+    if (uring->fd >= 0)
+        return bf_uring_enter(uring, uring->sq.nb_unsubmitted, nb_waits);
+#endif
+
+    /* Without io_uring, operations are executed synchronously, so waiting
+     * for completions is never necessary. */
+    nb_submitted = 0;
+    while ((slot = bf_uring_pop(uring, &uring->pending_head,
+                                &uring->pending_tail)) >= 0) {
+        bf_uring_execute(uring, slot);
+        bf_uring_push(uring, &uring->done_head, &uring->done_tail, slot);
+        nb_submitted++;
+    }
+
+    return nb_submitted;
+}
+
+int
+bf_uring_next_completion(struct bf_uring *uring,
+                         struct bf_uring_completion *completion) {
+    int slot;
+
+#ifdef BF_URING_NATIVE
+    if (uring->fd >= 0) {
+        struct io_uring_cqe *cqe;
+        unsigned int head, tail;
+
+        head = *uring->cq.head;
+        tail = __atomic_load_n(uring->cq.tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return 0;
+
+        cqe = uring->cq.cqes + (head & uring->cq.mask);
+        slot = (int)cqe->user_data;
+
+        if (cqe->res >= 0) {
+            uring->slots[slot].result = cqe->res;
+            uring->slots[slot].error = 0;
+        } else {
+            uring->slots[slot].result = -1;
+            uring->slots[slot].error = -cqe->res;
+        }
+
+        __atomic_store_n(uring->cq.head, head + 1, __ATOMIC_RELEASE);
+
+        bf_uring_complete(uring, slot, completion);
+        return 1;
+    }
+#endif
+
+    slot = bf_uring_pop(uring, &uring->done_head, &uring->done_tail);
+    if (slot == -1)
+        return 0;
+
+    bf_uring_complete(uring, slot, completion);
+    return 1;
+}
+
+static int
+bf_uring_queue(struct bf_uring *uring, struct bf_buffer *buf, int fd,
+               enum bf_uring_op op, void *udata, size_t len) {
+    struct bf_uring_slot *slot;
+    int idx;
+
+    idx = bf_uring_alloc_slot(uring);
+    if (idx == -1)
+        return -1;
+
+    slot = uring->slots + idx;
+
+    slot->buf = buf;
+    slot->fd = fd;
+    slot->op = op;
+    slot->len = len;
+    slot->udata = udata;
+
+#ifdef BF_URING_NATIVE
+    if (uring->fd >= 0) {
+        if (bf_uring_queue_sqe(uring, idx) == -1) {
+            bf_uring_free_slot(uring, idx);
+            return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    bf_uring_push(uring, &uring->pending_head, &uring->pending_tail, idx);
+    return 0;
+}
+
+static int
+bf_uring_alloc_slot(struct bf_uring *uring) {
+    int idx;
+
+    idx = uring->free_slots;
+    if (idx == -1) {
+        bf_set_error("too many operations in progress");
+        return -1;
+    }
+
+    uring->free_slots = uring->slots[idx].next;
+    return idx;
+}
+
+static void
+bf_uring_free_slot(struct bf_uring *uring, int idx) {
+    memset(uring->slots + idx, 0, sizeof(struct bf_uring_slot));
+
+    uring->slots[idx].next = uring->free_slots;
+    uring->free_slots = idx;
+}
+
+static void
+bf_uring_push(struct bf_uring *uring, int *phead, int *ptail, int idx) {
+    uring->slots[idx].next = -1;
+
+    if (*ptail == -1) {
+        *phead = idx;
+    } else {
+        uring->slots[*ptail].next = idx;
+    }
+
+    *ptail = idx;
+}
+
+static int
+bf_uring_pop(struct bf_uring *uring, int *phead, int *ptail) {
+    int idx;
+
+    idx = *phead;
+    if (idx == -1)
+        return -1;
+
+    *phead = uring->slots[idx].next;
+    if (*phead == -1)
+        *ptail = -1;
+
+    return idx;
+}
+
+static void
+bf_uring_execute(struct bf_uring *uring, int idx) {
+    struct bf_uring_slot *slot;
+    ssize_t ret;
+
+    slot = uring->slots + idx;
+
+    switch (slot->op) {
+    case BF_URING_READ:
+        ret = read(slot->fd, bf_buffer_data(slot->buf)
+                             + bf_buffer_length(slot->buf), slot->len);
+        break;
+
+    case BF_URING_WRITE:
+        ret = write(slot->fd, bf_buffer_data(slot->buf), slot->len);
+        break;
+
+    default:
+        ret = -1;
+        errno = EINVAL;
+        break;
+    }
+
+    slot->result = ret;
+    slot->error = (ret == -1) ? errno : 0;
+}
+
+static void
+bf_uring_complete(struct bf_uring *uring, int idx,
+                  struct bf_uring_completion *completion) {
+    struct bf_uring_slot *slot;
+
+    slot = uring->slots + idx;
+
+    /* The buffer is only updated now, so that the memory the kernel reads
+     * from or writes to does not move while the operation is in progress. */
+    if (slot->result > 0) {
+        switch (slot->op) {
+        case BF_URING_READ:
+            bf_buffer_increase_length(slot->buf, (size_t)slot->result);
+            break;
+
+        case BF_URING_WRITE:
+            bf_buffer_skip(slot->buf, (size_t)slot->result);
+            break;
+        }
+    }
+
+    completion->buf = slot->buf;
+    completion->fd = slot->fd;
+    completion->op = slot->op;
+    completion->result = slot->result;
+    completion->error = slot->error;
+    completion->udata = slot->udata;
+
+    bf_uring_free_slot(uring, idx);
+}
+
+#ifdef BF_URING_NATIVE
+static int
+bf_uring_setup(struct bf_uring *uring, unsigned int nb_entries) {
+    struct io_uring_params params;
+    struct bf_uring_sq *sq;
+    struct bf_uring_cq *cq;
+    char *sq_ring, *cq_ring;
+    long fd;
+
+    memset(&params, 0, sizeof(struct io_uring_params));
+
+    fd = syscall(__NR_io_uring_setup, nb_entries, &params);
+    if (fd == -1)
+        return -1;
+
+    uring->fd = (int)fd;
+
+    /* Operations use the current file position, which requires Linux 5.6;
+     * older kernels are handled by the fallback. */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)
+     || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        bf_uring_teardown(uring);
+        return -1;
+    }
+
+    uring->sq_ring_sz = params.sq_off.array
+                      + params.sq_entries * sizeof(unsigned int);
+    uring->cq_ring_sz = params.cq_off.cqes
+                      + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (uring->cq_ring_sz > uring->sq_ring_sz)
+        uring->sq_ring_sz = uring->cq_ring_sz;
+
+    /* Both rings are in the same mapping. */
+    uring->sq_ring = mmap(NULL, uring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd,
+                          IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        bf_uring_teardown(uring);
+        return -1;
+    }
+
+    sq = &uring->sq;
+
+    sq->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq->sqes = mmap(NULL, sq->sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (sq->sqes == MAP_FAILED) {
+        sq->sqes = NULL;
+        bf_uring_teardown(uring);
+        return -1;
+    }
+
+    sq_ring = uring->sq_ring;
+    cq_ring = uring->sq_ring;
+
+    sq->head = (unsigned int *)(sq_ring + params.sq_off.head);
+    sq->tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    sq->array = (unsigned int *)(sq_ring + params.sq_off.array);
+    sq->mask = *(unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    sq->nb_entries = params.sq_entries;
+
+    cq = &uring->cq;
+
+    cq->head = (unsigned int *)(cq_ring + params.cq_off.head);
+    cq->tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    cq->mask = *(unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    cq->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void
+bf_uring_teardown(struct bf_uring *uring) {
+    if (uring->sq.sqes)
+        munmap(uring->sq.sqes, uring->sq.sqes_sz);
+    if (uring->sq_ring)
+        munmap(uring->sq_ring, uring->sq_ring_sz);
+
+    close(uring->fd);
+    uring->fd = -1;
+}
+
+static int
+bf_uring_enter(struct bf_uring *uring, unsigned int nb_submissions,
+               unsigned int nb_waits) {
+    unsigned int flags;
+    long ret;
+
+    flags = (nb_waits > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, uring->fd, nb_submissions,
+                      nb_waits, flags, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        bf_set_error("cannot submit operations: %s", strerror(errno));
+        return -1;
+    }
+
+    uring->sq.nb_unsubmitted -= (unsigned int)ret;
+    return (int)ret;
+}
+
+static int
+bf_uring_register(struct bf_uring *uring, unsigned int opcode,
+                  const void *arg, unsigned int nb_args) {
+    if (syscall(__NR_io_uring_register, uring->fd, opcode,
+                arg, nb_args) == -1) {
+        bf_set_error("cannot register buffers: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bf_uring_queue_sqe(struct bf_uring *uring, int idx) {
+    struct bf_uring_sq *sq;
+    struct bf_uring_slot *slot;
+    struct io_uring_sqe *sqe;
+    unsigned int head, tail, sqe_idx;
+    int fixed_idx;
+    char *ptr;
+
+    sq = &uring->sq;
+    slot = uring->slots + idx;
+
+    tail = *sq->tail;
+    head = __atomic_load_n(sq->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= sq->nb_entries) {
+        /* The submission queue is full, submit entries to make space. */
+        if (bf_uring_enter(uring, sq->nb_unsubmitted, 0) == -1)
+            return -1;
+
+        head = __atomic_load_n(sq->head, __ATOMIC_ACQUIRE);
+        if (tail - head >= sq->nb_entries) {
+            bf_set_error("submission queue full");
+            return -1;
+        }
+    }
+
+    ptr = bf_buffer_data(slot->buf);
+    if (slot->op == BF_URING_READ)
+        ptr += bf_buffer_length(slot->buf);
+
+    sqe_idx = tail & sq->mask;
+    sqe = sq->sqes + sqe_idx;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    fixed_idx = bf_uring_fixed_index(uring, idx);
+
+    if (slot->op == BF_URING_READ) {
+        sqe->opcode = (fixed_idx >= 0) ? IORING_OP_READ_FIXED
+                                       : IORING_OP_READ;
+    } else {
+        sqe->opcode = (fixed_idx >= 0) ? IORING_OP_WRITE_FIXED
+                                       : IORING_OP_WRITE;
+    }
+
+    if (fixed_idx >= 0)
+        sqe->buf_index = (uint16_t)fixed_idx;
+
+    sqe->fd = slot->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)ptr;
+    sqe->len = (uint32_t)slot->len;
+    sqe->user_data = (unsigned int)idx;
+
+    sq->array[sqe_idx] = sqe_idx;
+    __atomic_store_n(sq->tail, tail + 1, __ATOMIC_RELEASE);
+
+    sq->nb_unsubmitted++;
+    return 0;
+}
+
+static int
+bf_uring_fixed_index(const struct bf_uring *uring, int idx) {
+    const struct bf_uring_slot *slot;
+    size_t i;
+
+    slot = uring->slots + idx;
+
+    /* A registered buffer can only be used as long as its storage was not
+     * reallocated since the registration. */
+    for (i = 0; i < uring->nb_registrations; i++) {
+        const struct bf_uring_registration *registration;
+        void *data;
+        size_t sz;
+
+        registration = uring->registrations + i;
+        if (registration->buf != slot->buf)
+            continue;
+
+        bf_buffer_get_storage(slot->buf, &data, &sz);
+        if (data == registration->data && sz == registration->sz)
+            return (int)i;
+
+        return -1;
+    }
+
+    return -1;
+}
+#endif
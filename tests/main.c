@@ -14,6 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include <utest.h>
 
 #include "buffer.h"
@@ -28,6 +35,184 @@
                     data_, sz_);                                  \
     } while (0)
 
+#define BFT_QUEUE_NB_BYTES (4 * 1024 * 1024)
+
+#define BFT_LOG_NB_THREADS 4
+#define BFT_LOG_NB_RECORDS 20000
+
+struct bft_log_producer {
+    struct bf_log *log;
+    uint32_t id;
+};
+
+struct bft_pool_user {
+    struct bf_buffer_pool *pool;
+    int ready_fd;
+    int done_fd;
+};
+
+static size_t bft_nb_reallocs;
+static size_t bft_nb_live_allocs;
+
+static void *
+bft_counting_realloc(void *ptr, size_t sz) {
+    bft_nb_reallocs++;
+    return realloc(ptr, sz);
+}
+
+static void *
+bft_tracking_malloc(size_t sz) {
+    __atomic_fetch_add(&bft_nb_live_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(sz);
+}
+
+static void
+bft_tracking_free(void *ptr) {
+    if (ptr)
+        __atomic_fetch_sub(&bft_nb_live_allocs, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static void *
+bft_tracking_calloc(size_t nb, size_t sz) {
+    __atomic_fetch_add(&bft_nb_live_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(nb, sz);
+}
+
+static void *
+bft_tracking_realloc(void *ptr, size_t sz) {
+    if (!ptr)
+        __atomic_fetch_add(&bft_nb_live_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, sz);
+}
+
+static void *
+bft_pool_user(void *arg) {
+    struct bft_pool_user *user;
+    struct bf_buffer *buf;
+    char c;
+
+    user = arg;
+
+    /* Leave a buffer in the cache of the thread, and keep the thread alive
+     * until the pool has been deleted. */
+    buf = bf_buffer_pool_get(user->pool, 100);
+    bf_buffer_add_string(buf, "abc");
+    bf_buffer_pool_release(user->pool, buf);
+
+    if (write(user->ready_fd, "x", 1) != 1)
+        return NULL;
+    if (read(user->done_fd, &c, 1) != 1)
+        return NULL;
+
+    return NULL;
+}
+
+static void *
+bft_queue_producer(void *arg) {
+    struct bf_queue *queue;
+    size_t i, j, n;
+    char *ptr;
+
+    queue = arg;
+
+    for (i = 0; i < BFT_QUEUE_NB_BYTES; i += n) {
+        n = BFT_QUEUE_NB_BYTES - i;
+        if (n > 1000)
+            n = 1000;
+
+        while (!(ptr = bf_queue_reserve(queue, n)))
+            continue;
+
+        for (j = 0; j < n; j++)
+            ptr[j] = (char)((i + j) % 251);
+
+        bf_queue_increase_length(queue, n);
+    }
+
+    return NULL;
+}
+
+static void *
+bft_log_producer(void *arg) {
+    struct bft_log_producer *producer;
+    uint32_t record[4];
+    uint32_t i;
+
+    producer = arg;
+
+    for (i = 0; i < BFT_LOG_NB_RECORDS; i++) {
+        record[0] = producer->id;
+        record[1] = i;
+        record[2] = ~producer->id;
+        record[3] = ~i;
+
+        bf_log_add(producer->log, record, sizeof(record));
+    }
+
+    return NULL;
+}
+
+static int
+bft_filter_round_trip(enum bf_filter_codec codec, const char *data,
+                      size_t sz) {
+    struct bf_filter *compressor, *decompressor;
+    struct bf_buffer *in, *compressed, *out;
+    size_t i, n;
+    int ok;
+
+    compressor = bf_filter_new(codec, BF_FILTER_COMPRESS, 0);
+    decompressor = bf_filter_new(codec, BF_FILTER_DECOMPRESS, 0);
+
+    in = bf_buffer_new(0);
+    compressed = bf_buffer_new(0);
+    out = bf_buffer_new(0);
+
+    ok = 1;
+
+    /* Data are compressed and decompressed a few kilobytes at a time. */
+    for (i = 0; i < sz; i += n) {
+        n = (sz - i < 10000) ? sz - i : 10000;
+
+        bf_buffer_add(in, data + i, n);
+        if (bf_filter_process(compressor, in, compressed,
+                              BF_FILTER_NO_FLUSH) != 0) {
+            ok = 0;
+        }
+    }
+
+    if (bf_filter_process(compressor, in, compressed, BF_FILTER_FINISH) != 1)
+        ok = 0;
+    if (bf_buffer_length(in) != 0 || bf_buffer_length(compressed) >= sz)
+        ok = 0;
+
+    while (bf_buffer_length(compressed) > 7000) {
+        bf_buffer_add(in, bf_buffer_data(compressed), 7000);
+        bf_buffer_skip(compressed, 7000);
+
+        if (bf_filter_process(decompressor, in, out, BF_FILTER_NO_FLUSH) != 0)
+            ok = 0;
+    }
+
+    bf_buffer_add_buffer(in, compressed);
+    if (bf_filter_process(decompressor, in, out, BF_FILTER_FINISH) != 1)
+        ok = 0;
+
+    if (bf_buffer_length(out) != sz
+     || memcmp(bf_buffer_data(out), data, sz) != 0) {
+        ok = 0;
+    }
+
+    bf_buffer_delete(in);
+    bf_buffer_delete(compressed);
+    bf_buffer_delete(out);
+
+    bf_filter_delete(compressor);
+    bf_filter_delete(decompressor);
+
+    return ok;
+}
+
 TEST(initialization) {
     struct bf_buffer *buf;
 
@@ -77,6 +262,49 @@ TEST(add) {
     bf_buffer_delete(buf);
 }
 
+TEST(add_numbers) {
+    struct bf_buffer *buf;
+
+    buf = bf_buffer_new(0);
+
+#define BFT_ADD_NUMBER(expr_, str_)                  \
+    do {                                             \
+        bf_buffer_clear(buf);                        \
+        TEST_INT_EQ(expr_, 0);                       \
+        BFT_BUFFER_EQ(buf, str_, sizeof(str_) - 1);  \
+    } while (0)
+
+    BFT_ADD_NUMBER(bf_buffer_add_u64(buf, 0), "0");
+    BFT_ADD_NUMBER(bf_buffer_add_u64(buf, 7), "7");
+    BFT_ADD_NUMBER(bf_buffer_add_u64(buf, 42), "42");
+    BFT_ADD_NUMBER(bf_buffer_add_u64(buf, 100), "100");
+    BFT_ADD_NUMBER(bf_buffer_add_u64(buf, UINT64_MAX),
+                   "18446744073709551615");
+
+    BFT_ADD_NUMBER(bf_buffer_add_i64(buf, 0), "0");
+    BFT_ADD_NUMBER(bf_buffer_add_i64(buf, -1), "-1");
+    BFT_ADD_NUMBER(bf_buffer_add_i64(buf, 12345), "12345");
+    BFT_ADD_NUMBER(bf_buffer_add_i64(buf, INT64_MIN),
+                   "-9223372036854775808");
+
+    BFT_ADD_NUMBER(bf_buffer_add_hex(buf, 0), "0");
+    BFT_ADD_NUMBER(bf_buffer_add_hex(buf, 0xdeadbeef), "deadbeef");
+    BFT_ADD_NUMBER(bf_buffer_add_hex(buf, UINT64_MAX), "ffffffffffffffff");
+    BFT_ADD_NUMBER(bf_buffer_add_hex_padded(buf, 0xab, 4), "00ab");
+    BFT_ADD_NUMBER(bf_buffer_add_hex_padded(buf, 0xabcde, 4), "abcde");
+
+    BFT_ADD_NUMBER(bf_buffer_add_double(buf, 0.0), "0");
+    BFT_ADD_NUMBER(bf_buffer_add_double(buf, 0.1), "0.1");
+    BFT_ADD_NUMBER(bf_buffer_add_double(buf, -2.5), "-2.5");
+    BFT_ADD_NUMBER(bf_buffer_add_double(buf, 1e300), "1e+300");
+    BFT_ADD_NUMBER(bf_buffer_add_double(buf, 0.1 + 0.2),
+                   "0.30000000000000004");
+
+#undef BFT_ADD_NUMBER
+
+    bf_buffer_delete(buf);
+}
+
 TEST(skip) {
     struct bf_buffer *buf;
 
@@ -137,6 +365,49 @@ TEST(remove) {
     bf_buffer_delete(buf);
 }
 
+TEST(find) {
+    struct bf_buffer *buf;
+    size_t i;
+
+    buf = bf_buffer_new(0);
+
+    TEST_INT_EQ(bf_buffer_find(buf, 0, 'a'), -1);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0, "ab", 2), -1);
+    TEST_INT_EQ(bf_buffer_find_not_any(buf, 0, "ab", 2), -1);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, "ab"), -1);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, ""), 0);
+
+    /* Long enough to go through the vectorized code and its tail. */
+    for (i = 0; i < 100; i++)
+        bf_buffer_add_string(buf, "  ");
+    bf_buffer_add_string(buf, "GET /index HTTP/1.1\r\nHost: x\r\n\r\n");
+    for (i = 0; i < 5; i++)
+        bf_buffer_add_string(buf, "a");
+
+    TEST_INT_EQ(bf_buffer_find(buf, 0, 'G'), 200);
+    TEST_INT_EQ(bf_buffer_find(buf, 201, 'G'), -1);
+
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0, "\r\n", 2), 219);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 220, "\r\n", 2), 220);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0, "/:", 2), 204);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0,
+                                   "ABCDFHIJKLMNOPQRSUVWXYZ:;", 25), 211);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0, "xyz", 3), 209);
+    TEST_INT_EQ(bf_buffer_find_any(buf, 0, "#!", 2), -1);
+
+    TEST_INT_EQ(bf_buffer_find_not_any(buf, 0, " ", 1), 200);
+    TEST_INT_EQ(bf_buffer_find_not_any(buf, 0, " GET", 4), 204);
+    TEST_INT_EQ(bf_buffer_find_not_any(buf, 233, "a", 1), -1);
+
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, "\r\n\r\n"), 228);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, "HTTP/1.1"), 211);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, "aaaaa"), 232);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 0, "aaaaaa"), -1);
+    TEST_INT_EQ(bf_buffer_find_string(buf, 212, "HTTP"), -1);
+
+    bf_buffer_delete(buf);
+}
+
 TEST(dup) {
     struct bf_buffer *buf;
     char *tmp;
@@ -148,16 +419,16 @@ TEST(dup) {
     bf_buffer_add_string(buf, "abcde");
     tmp = bf_buffer_dup(buf);
     TEST_MEM_EQ(tmp, 5, "abcde", 5);
-    free(tmp);
+    bf_free(tmp);
 
     tmp = bf_buffer_dup_string(buf);
     TEST_MEM_EQ(tmp, 6, "abcde\0", 6);
-    free(tmp);
+    bf_free(tmp);
 
     bf_buffer_clear(buf);
     tmp = bf_buffer_dup_string(buf);
     TEST_MEM_EQ(tmp, 1, "\0", 1);
-    free(tmp);
+    bf_free(tmp);
 
     bf_buffer_delete(buf);
 }
@@ -187,6 +458,1260 @@ TEST(free_space_after_skip) {
     TEST_UINT_EQ(bf_buffer_free_space(buf), 8);
 }
 
+TEST(growth_policy) {
+    struct bf_memory_allocator allocator = {
+        .malloc = malloc,
+        .free = free,
+        .calloc = calloc,
+        .realloc = bft_counting_realloc,
+    };
+    struct bf_growth_policy policy;
+    struct bf_buffer *buf;
+    int i;
+
+    bf_set_memory_allocator(&allocator);
+
+    buf = bf_buffer_new(0);
+
+    bft_nb_reallocs = 0;
+    for (i = 0; i < 10000; i++)
+        bf_buffer_add_printf(buf, "%08d", i);
+    TEST_UINT_EQ(bf_buffer_length(buf), 80000);
+    TEST_TRUE(bft_nb_reallocs <= 16);
+
+    policy.factor = 1.0;
+    policy.min_step = 0;
+    policy.round_to = 100;
+    policy.max_size = 300;
+    policy.mmap_threshold = 0;
+    bf_buffer_set_growth_policy(buf, &policy);
+
+    bf_buffer_reset(buf);
+    TEST_INT_EQ(bf_buffer_add(buf, "abc", 3), 0);
+    TEST_UINT_EQ(bf_buffer_size(buf), 100);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 297));
+    TEST_UINT_EQ(bf_buffer_size(buf), 300);
+    TEST_PTR_NULL(bf_buffer_reserve(buf, 298));
+
+    bf_buffer_delete(buf);
+
+    bf_set_memory_allocator(NULL);
+}
+
+TEST(mmap_threshold) {
+    struct bf_growth_policy policy = {
+        .factor = 2.0,
+        .mmap_threshold = 65536,
+    };
+    struct bf_buffer *buf;
+    char *data;
+    size_t len;
+    int i;
+
+    buf = bf_buffer_new(0);
+    bf_buffer_set_growth_policy(buf, &policy);
+
+    for (i = 0; i < 100000; i++)
+        bf_buffer_add_printf(buf, "%08d", i);
+    TEST_UINT_EQ(bf_buffer_length(buf), 800000);
+    TEST_MEM_EQ(bf_buffer_data(buf), 16, "0000000000000001", 16);
+    TEST_MEM_EQ((char *)bf_buffer_data(buf) + 799992, 8, "00099999", 8);
+    TEST_UINT_EQ(bf_buffer_size(buf) % 4096, 0);
+
+    bf_buffer_skip(buf, 8);
+    data = bf_buffer_extract(buf, &len);
+    TEST_UINT_EQ(len, 799992);
+    TEST_MEM_EQ(data, 8, "00000001", 8);
+    bf_free(data);
+
+    /* Once emptied, the buffer goes back to the heap. */
+    bf_buffer_add_string(buf, "foo");
+    BFT_BUFFER_EQ(buf, "foo", 3);
+    TEST_UINT_EQ(bf_buffer_size(buf), 3);
+
+    bf_buffer_delete(buf);
+}
+
+TEST(compaction_policy) {
+    struct bf_compaction_policy policy;
+    struct bf_compaction_stats stats;
+    struct bf_buffer *buf;
+
+    buf = bf_buffer_new(8);
+
+    bf_buffer_add_string(buf, "abcdefgh");
+    bf_buffer_skip(buf, 6);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 4));
+    TEST_UINT_EQ(bf_buffer_size(buf), 8);
+    BFT_BUFFER_EQ(buf, "gh", 2);
+
+    bf_buffer_get_compaction_stats(buf, &stats);
+    TEST_UINT_EQ(stats.nb_compactions, 1);
+    TEST_UINT_EQ(stats.bytes_moved, 2);
+    TEST_UINT_EQ(stats.bytes_avoided, 32);
+
+    policy.mode = BF_COMPACTION_THRESHOLD;
+    policy.threshold = 0.5;
+    bf_buffer_set_compaction_policy(buf, &policy);
+
+    bf_buffer_clear(buf);
+    bf_buffer_add_string(buf, "abcdefgh");
+    bf_buffer_skip(buf, 2);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 1));
+    TEST_UINT_EQ(bf_buffer_size(buf), 40);
+    BFT_BUFFER_EQ(buf, "cdefgh", 6);
+
+    policy.mode = BF_COMPACTION_LAZY;
+
+    /* Compacting is enough */
+    bf_buffer_skip(buf, 5);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 34));
+    TEST_UINT_EQ(bf_buffer_size(buf), 40);
+    BFT_BUFFER_EQ(buf, "h", 1);
+
+    bf_buffer_get_compaction_stats(buf, &stats);
+    TEST_UINT_EQ(stats.nb_compactions, 2);
+    TEST_UINT_EQ(stats.bytes_moved, 3);
+
+    /* Compacting is not enough: the buffer grows without moving data. */
+    bf_buffer_add_string(buf, "ijk");
+    bf_buffer_skip(buf, 2);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 40));
+    TEST_UINT_EQ(bf_buffer_size(buf), 80);
+    BFT_BUFFER_EQ(buf, "jk", 2);
+
+    bf_buffer_get_compaction_stats(buf, &stats);
+    TEST_UINT_EQ(stats.nb_compactions, 2);
+    TEST_UINT_EQ(stats.bytes_moved, 3);
+
+    bf_buffer_delete(buf);
+}
+
+TEST(trim_policy) {
+    struct bf_trim_policy policy;
+    struct bf_buffer *buf;
+    char data[8192];
+    int i;
+
+    memset(data, 'a', sizeof(data));
+
+    buf = bf_buffer_new(0);
+    bf_buffer_add(buf, data, 8192);
+    bf_buffer_skip(buf, 8000);
+    TEST_INT_EQ(bf_buffer_trim(buf, 1000), 0);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1000);
+    BFT_BUFFER_EQ(buf, data, 192);
+    TEST_INT_EQ(bf_buffer_trim(buf, 10), 0);
+    TEST_UINT_EQ(bf_buffer_size(buf), 192);
+    bf_buffer_delete(buf);
+
+    buf = bf_buffer_new_inline(16);
+    bf_buffer_add(buf, data, 100);
+    bf_buffer_skip(buf, 92);
+    TEST_INT_EQ(bf_buffer_trim(buf, 0), 0);
+    TEST_UINT_EQ(bf_buffer_size(buf), 16);
+    BFT_BUFFER_EQ(buf, data, 8);
+    bf_buffer_delete(buf);
+
+    policy.floor = 4096;
+    policy.low_water = 0.25;
+    policy.nb_idle_ops = 4;
+
+    buf = bf_buffer_new(0);
+    bf_buffer_set_trim_policy(buf, &policy);
+
+    for (i = 0; i < 128; i++)
+        bf_buffer_add(buf, data, 8192);
+    bf_buffer_skip(buf, 1048576 - 100);
+
+    /* The first check still sees the content the buffer was filled with. */
+    for (i = 0; i < 3; i++)
+        bf_buffer_skip(buf, 10);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1048576);
+
+    /* Growing the content above the low-water mark restarts the count. */
+    bf_buffer_skip(buf, 10);
+    TEST_PTR_NOT_NULL(bf_buffer_reserve(buf, 524288));
+    for (i = 0; i < 3; i++)
+        bf_buffer_skip(buf, 10);
+    bf_buffer_clear(buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1048576);
+
+    for (i = 0; i < 3; i++)
+        bf_buffer_clear(buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1048576);
+
+    bf_buffer_clear(buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 4096);
+    TEST_UINT_EQ(bf_buffer_length(buf), 0);
+
+    /* A buffer regularly filled above the floor is never trimmed. */
+    for (i = 0; i < 8; i++) {
+        bf_buffer_add(buf, data, 6000);
+        bf_buffer_clear(buf);
+        bf_buffer_clear(buf);
+        bf_buffer_clear(buf);
+        bf_buffer_clear(buf);
+        TEST_TRUE(bf_buffer_size(buf) >= 6000);
+    }
+
+    bf_buffer_delete(buf);
+}
+
+TEST(binary) {
+    struct bf_reader reader;
+    struct bf_buffer *buf;
+    const void *data;
+    uint64_t u64;
+    uint32_t u32;
+    uint16_t u16;
+    int64_t i64;
+    uint8_t u8;
+    size_t len;
+
+    buf = bf_buffer_new(0);
+
+    bf_buffer_put_u8(buf, 0xab);
+    bf_buffer_put_be16(buf, 0x0102);
+    bf_buffer_put_le16(buf, 0x0102);
+    bf_buffer_put_be32(buf, 0x01020304);
+    bf_buffer_put_le32(buf, 0x01020304);
+    BFT_BUFFER_EQ(buf, "\xab\x01\x02\x02\x01\x01\x02\x03\x04\x04\x03\x02\x01",
+                  13);
+
+    bf_buffer_clear(buf);
+    bf_buffer_put_uvarint(buf, 300);
+    bf_buffer_put_svarint(buf, -2);
+    BFT_BUFFER_EQ(buf, "\xac\x02\x03", 3);
+
+    bf_buffer_clear(buf);
+    bf_buffer_put_be64(buf, UINT64_C(0x0102030405060708));
+    bf_buffer_put_le64(buf, UINT64_C(0x0102030405060708));
+    bf_buffer_put_uvarint(buf, UINT64_MAX);
+    bf_buffer_put_svarint(buf, INT64_MIN);
+    bf_buffer_put_blob(buf, "abc", 3);
+    bf_buffer_put_u8(buf, 0x80);
+
+    bf_reader_init(&reader, buf);
+
+    TEST_INT_EQ(bf_reader_get_be64(&reader, &u64), 0);
+    TEST_UINT_EQ(u64, UINT64_C(0x0102030405060708));
+    TEST_INT_EQ(bf_reader_get_le64(&reader, &u64), 0);
+    TEST_UINT_EQ(u64, UINT64_C(0x0102030405060708));
+    TEST_INT_EQ(bf_reader_get_uvarint(&reader, &u64), 0);
+    TEST_UINT_EQ(u64, UINT64_MAX);
+    TEST_INT_EQ(bf_reader_get_svarint(&reader, &i64), 0);
+    TEST_INT_EQ(i64, INT64_MIN);
+    TEST_INT_EQ(bf_reader_get_blob(&reader, &data, &len), 0);
+    TEST_MEM_EQ(data, len, "abc", 3);
+
+    /* Nothing is skipped until the reader is committed. */
+    TEST_UINT_EQ(bf_buffer_length(buf), 41);
+    bf_reader_commit(&reader);
+    TEST_UINT_EQ(bf_buffer_length(buf), 1);
+    TEST_UINT_EQ(bf_reader_remaining(&reader), 1);
+
+    /* Incomplete data. */
+    TEST_INT_EQ(bf_reader_get_uvarint(&reader, &u64), -1);
+    TEST_INT_EQ(bf_reader_get_be16(&reader, &u16), -1);
+    TEST_UINT_EQ(bf_reader_position(&reader), 0);
+
+    bf_buffer_put_u8(buf, 0x01);
+    bf_buffer_put_le32(buf, 0xdeadbeef);
+    bf_reader_init(&reader, buf);
+    TEST_INT_EQ(bf_reader_get_uvarint(&reader, &u64), 0);
+    TEST_UINT_EQ(u64, 128);
+    TEST_INT_EQ(bf_reader_get_le32(&reader, &u32), 0);
+    TEST_UINT_EQ(u32, 0xdeadbeef);
+    TEST_INT_EQ(bf_reader_get_u8(&reader, &u8), -1);
+
+    bf_buffer_delete(buf);
+}
+
+TEST(framer) {
+    struct bf_framer *framer;
+    struct bf_buffer *buf;
+    const void *data;
+    size_t len;
+
+    buf = bf_buffer_new(0);
+    framer = bf_framer_new(buf, "\r\n", 2);
+
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 0);
+
+    bf_buffer_add_string(buf, "GET / HTTP/1.1\r");
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 0);
+
+    bf_buffer_add_string(buf, "\nHost: ");
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 1);
+    TEST_MEM_EQ(data, len, "GET / HTTP/1.1", 14);
+
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 0);
+    BFT_BUFFER_EQ(buf, "Host: ", 6);
+
+    bf_buffer_add_string(buf, "x\r\n\r\nbody");
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 1);
+    TEST_MEM_EQ(data, len, "Host: x", 7);
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 1);
+    TEST_UINT_EQ(len, 0);
+    TEST_INT_EQ(bf_framer_next(framer, &data, &len), 0);
+    BFT_BUFFER_EQ(buf, "body", 4);
+
+    bf_framer_delete(framer);
+    bf_buffer_delete(buf);
+}
+
+TEST(arena) {
+    struct bf_buffer *buf1, *buf2;
+    struct bf_arena *arena;
+    int i;
+
+    arena = bf_arena_new(64);
+
+    buf1 = bf_buffer_new_with_allocator(0, bf_arena_allocator(arena));
+    buf2 = bf_buffer_new_with_allocator(8, bf_arena_allocator(arena));
+
+    for (i = 0; i < 100; i++) {
+        bf_buffer_add_string(buf1, "abc");
+        bf_buffer_add_string(buf2, "de");
+    }
+
+    TEST_UINT_EQ(bf_buffer_length(buf1), 300);
+    TEST_MEM_EQ(bf_buffer_data(buf1), 6, "abcabc", 6);
+    TEST_MEM_EQ((char *)bf_buffer_data(buf1) + 294, 6, "abcabc", 6);
+
+    TEST_UINT_EQ(bf_buffer_length(buf2), 200);
+    TEST_MEM_EQ(bf_buffer_data(buf2), 4, "dede", 4);
+    TEST_MEM_EQ((char *)bf_buffer_data(buf2) + 196, 4, "dede", 4);
+
+    bf_buffer_delete(buf1);
+
+    /* Buffers do not have to be deleted before the arena. */
+    bf_arena_delete(arena);
+}
+
+TEST(inline_storage) {
+    BF_BUFFER_STORAGE(storage, 16);
+    struct bf_buffer *buf;
+    char *data;
+    size_t len;
+
+    buf = bf_buffer_new_inline(16);
+    TEST_UINT_EQ(bf_buffer_size(buf), 16);
+    TEST_INT_EQ(bf_buffer_add_string(buf, "foo bar baz"), 0);
+    TEST_UINT_EQ(bf_buffer_size(buf), 16);
+    BFT_BUFFER_EQ(buf, "foo bar baz", 11);
+
+    /* Content which does not fit inline is moved to the heap. */
+    TEST_INT_EQ(bf_buffer_add_string(buf, " qux quux"), 0);
+    TEST_TRUE(bf_buffer_size(buf) > 16);
+    BFT_BUFFER_EQ(buf, "foo bar baz qux quux", 20);
+
+    data = bf_buffer_extract(buf, &len);
+    TEST_UINT_EQ(len, 20);
+    TEST_MEM_EQ(data, len, "foo bar baz qux quux", 20);
+    bf_free(data);
+
+    TEST_UINT_EQ(bf_buffer_size(buf), 16);
+    TEST_INT_EQ(bf_buffer_add_string(buf, "abc"), 0);
+    data = bf_buffer_extract(buf, &len);
+    TEST_MEM_EQ(data, len, "abc", 3);
+    bf_free(data);
+
+    bf_buffer_delete(buf);
+
+    TEST_PTR_NULL(bf_buffer_init_inline(&storage, 8));
+
+    buf = bf_buffer_init_inline(&storage, sizeof(storage));
+    TEST_TRUE(bf_buffer_size(buf) >= 16);
+    bf_buffer_add_string(buf, "foo");
+    BFT_BUFFER_EQ(buf, "foo", 3);
+    bf_buffer_reserve(buf, 1000);
+    BFT_BUFFER_EQ(buf, "foo", 3);
+    bf_buffer_reset(buf);
+    TEST_TRUE(bf_buffer_size(buf) >= 16);
+    bf_buffer_delete(buf);
+}
+
+TEST(aligned) {
+    struct bf_buffer *buf;
+    char *data;
+    size_t len;
+    int i;
+
+    TEST_PTR_NULL(bf_buffer_new_aligned(0, 48, 0));
+
+    buf = bf_buffer_new_aligned(100, 4096, 0);
+    TEST_UINT_EQ((uintptr_t)bf_buffer_data(buf) % 4096, 0);
+
+    /* Alignment is preserved when the buffer grows. */
+    for (i = 0; i < 1000; i++)
+        bf_buffer_add_string(buf, "abcdefgh");
+    TEST_UINT_EQ(bf_buffer_length(buf), 8000);
+    TEST_UINT_EQ((uintptr_t)bf_buffer_data(buf) % 4096, 0);
+    TEST_MEM_EQ((char *)bf_buffer_data(buf) + 7992, 8, "abcdefgh", 8);
+
+    data = bf_buffer_extract(buf, &len);
+    TEST_UINT_EQ(len, 8000);
+    TEST_MEM_EQ(data, 8, "abcdefgh", 8);
+    bf_free(data);
+
+    bf_buffer_add_string(buf, "foo");
+    TEST_UINT_EQ((uintptr_t)bf_buffer_data(buf) % 4096, 0);
+    BFT_BUFFER_EQ(buf, "foo", 3);
+    bf_buffer_delete(buf);
+
+    buf = bf_buffer_new_aligned(0, 64, BF_BUFFER_HUGE_PAGES);
+    bf_buffer_add_string(buf, "foo");
+    bf_buffer_reserve(buf, 3 * 1024 * 1024);
+    BFT_BUFFER_EQ(buf, "foo", 3);
+    TEST_UINT_EQ((uintptr_t)bf_buffer_data(buf) % 64, 0);
+    bf_buffer_reset(buf);
+    BFT_BUFFER_EMPTY(buf);
+    bf_buffer_delete(buf);
+}
+
+TEST(mmap) {
+    struct bf_buffer *buf;
+    char path[] = "/tmp/libbuffer-test.XXXXXX";
+    int fd;
+
+    fd = mkstemp(path);
+    TEST_TRUE(fd >= 0);
+    TEST_INT_EQ(write(fd, "foo bar baz", 11), 11);
+
+    buf = bf_buffer_new_mmap(path);
+    BFT_BUFFER_EQ(buf, "foo bar baz", 11);
+    TEST_UINT_EQ(bf_buffer_free_space(buf), 0);
+
+    bf_buffer_skip(buf, 4);
+    BFT_BUFFER_EQ(buf, "bar baz", 7);
+
+    /* Modifying the buffer copies its content out of the mapping. */
+    TEST_INT_EQ(bf_buffer_add_string(buf, "!"), 0);
+    BFT_BUFFER_EQ(buf, "bar baz!", 8);
+    TEST_UINT_EQ(bf_buffer_remove_after(buf, 0, 4), 4);
+    BFT_BUFFER_EQ(buf, "baz!", 4);
+    bf_buffer_delete(buf);
+
+    buf = bf_buffer_new_mmap_fd(fd);
+    TEST_UINT_EQ(bf_buffer_remove(buf, 4), 4);
+    BFT_BUFFER_EQ(buf, "foo bar", 7);
+    bf_buffer_delete(buf);
+
+    /* The file itself is never modified. */
+    buf = bf_buffer_new_mmap_fd(fd);
+    BFT_BUFFER_EQ(buf, "foo bar baz", 11);
+    bf_buffer_clear(buf);
+    BFT_BUFFER_EMPTY(buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 0);
+    bf_buffer_delete(buf);
+
+    TEST_INT_EQ(ftruncate(fd, 0), 0);
+    buf = bf_buffer_new_mmap_fd(fd);
+    BFT_BUFFER_EMPTY(buf);
+    bf_buffer_delete(buf);
+
+    close(fd);
+    unlink(path);
+
+    TEST_PTR_NULL(bf_buffer_new_mmap(path));
+}
+
+TEST(relay) {
+    struct bf_relay *relay;
+    struct bf_slice slice;
+    struct bf_buffer *buf;
+    char path[] = "/tmp/libbuffer-test.XXXXXX";
+    char data[16];
+    int in[2], out[2], fd;
+    off_t offset;
+
+    TEST_INT_EQ(pipe(in), 0);
+    TEST_INT_EQ(pipe(out), 0);
+
+    relay = bf_relay_new();
+
+    TEST_INT_EQ(write(in[1], "foo bar", 7), 7);
+    TEST_INT_EQ(bf_relay_read(relay, in[0], 16), 7);
+    TEST_UINT_EQ(bf_relay_length(relay), 7);
+    TEST_INT_EQ(bf_relay_write(relay, out[1]), 7);
+    TEST_UINT_EQ(bf_relay_length(relay), 0);
+    TEST_INT_EQ(read(out[0], data, sizeof(data)), 7);
+    TEST_MEM_EQ(data, 7, "foo bar", 7);
+
+    /* Files opened in append mode do not support splice(), the relay must
+     * fall back to write() without losing data. */
+    fd = mkstemp(path);
+    TEST_TRUE(fd >= 0);
+    close(fd);
+    fd = open(path, O_RDWR | O_APPEND);
+    TEST_TRUE(fd >= 0);
+
+    TEST_INT_EQ(write(in[1], "baz", 3), 3);
+    TEST_INT_EQ(bf_relay_read(relay, in[0], 16), 3);
+    TEST_INT_EQ(bf_relay_write(relay, fd), 3);
+    TEST_INT_EQ(write(in[1], "qux", 3), 3);
+    TEST_INT_EQ(bf_relay_read(relay, in[0], 16), 3);
+    TEST_INT_EQ(bf_relay_write(relay, fd), 3);
+    TEST_INT_EQ(pread(fd, data, sizeof(data), 0), 6);
+    TEST_MEM_EQ(data, 6, "bazqux", 6);
+
+    bf_relay_delete(relay);
+
+    offset = 3;
+    TEST_INT_EQ(bf_send_file(out[1], fd, &offset, 16), 3);
+    TEST_INT_EQ(offset, 6);
+    TEST_INT_EQ(bf_send_file(out[1], fd, &offset, 16), 0);
+    TEST_INT_EQ(read(out[0], data, sizeof(data)), 3);
+    TEST_MEM_EQ(data, 3, "qux", 3);
+
+    close(fd);
+    unlink(path);
+
+    buf = bf_buffer_new(0);
+    bf_buffer_add_string(buf, "hello");
+    TEST_INT_EQ(bf_buffer_vmsplice(buf, out[1], &slice), 5);
+    BFT_BUFFER_EMPTY(buf);
+    TEST_INT_EQ(read(out[0], data, sizeof(data)), 5);
+    TEST_MEM_EQ(data, 5, "hello", 5);
+    bf_slice_release(&slice);
+
+    /* Data added after vmsplice() do not overwrite data which are still
+     * referenced by the pipe. */
+    bf_buffer_add_string(buf, "AAAAAAAA");
+    TEST_INT_EQ(bf_buffer_vmsplice(buf, out[1], &slice), 8);
+    bf_buffer_add_string(buf, "BBBBBBBB");
+    TEST_INT_EQ(read(out[0], data, sizeof(data)), 8);
+    TEST_MEM_EQ(data, 8, "AAAAAAAA", 8);
+    BFT_BUFFER_EQ(buf, "BBBBBBBB", 8);
+    bf_slice_release(&slice);
+    bf_buffer_delete(buf);
+
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+}
+
+TEST(uring) {
+    struct bf_uring_completion completion;
+    struct bf_uring *uring;
+    struct bf_buffer *buf;
+    int flags[] = {0, BF_URING_FALLBACK};
+    int fds[2];
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        TEST_INT_EQ(pipe(fds), 0);
+
+        uring = bf_uring_new(4, flags[i]);
+        TEST_PTR_NOT_NULL(uring);
+
+        buf = bf_buffer_new(0);
+        bf_buffer_add_string(buf, "foo bar");
+        TEST_INT_EQ(bf_uring_register_buffers(uring, &buf, 1), 0);
+
+        TEST_INT_EQ(bf_uring_queue_write(uring, buf, fds[1], &i), 0);
+        TEST_INT_EQ(bf_uring_submit(uring, 1), 1);
+        TEST_INT_EQ(bf_uring_next_completion(uring, &completion), 1);
+        TEST_TRUE(completion.buf == buf);
+        TEST_TRUE(completion.op == BF_URING_WRITE);
+        TEST_INT_EQ(completion.result, 7);
+        TEST_TRUE(completion.udata == &i);
+        BFT_BUFFER_EMPTY(buf);
+        TEST_INT_EQ(bf_uring_next_completion(uring, &completion), 0);
+
+        TEST_INT_EQ(bf_uring_queue_read(uring, buf, fds[0], 16, NULL), 0);
+        TEST_INT_EQ(bf_uring_submit(uring, 1), 1);
+        TEST_INT_EQ(bf_uring_next_completion(uring, &completion), 1);
+        TEST_TRUE(completion.op == BF_URING_READ);
+        TEST_INT_EQ(completion.result, 7);
+        BFT_BUFFER_EQ(buf, "foo bar", 7);
+
+        /* Errors are reported in completions. */
+        TEST_INT_EQ(bf_uring_queue_write(uring, buf, fds[0], NULL), 0);
+        TEST_INT_EQ(bf_uring_submit(uring, 1), 1);
+        TEST_INT_EQ(bf_uring_next_completion(uring, &completion), 1);
+        TEST_INT_EQ(completion.result, -1);
+        TEST_INT_EQ(completion.error, EBADF);
+        BFT_BUFFER_EQ(buf, "foo bar", 7);
+
+        close(fds[1]);
+
+        TEST_INT_EQ(bf_uring_queue_read(uring, buf, fds[0], 16, NULL), 0);
+        TEST_INT_EQ(bf_uring_submit(uring, 1), 1);
+        TEST_INT_EQ(bf_uring_next_completion(uring, &completion), 1);
+        TEST_INT_EQ(completion.result, 0);
+        BFT_BUFFER_EQ(buf, "foo bar", 7);
+
+        bf_uring_delete(uring);
+        bf_buffer_delete(buf);
+        close(fds[0]);
+    }
+}
+
+TEST(slices) {
+    struct bf_buffer *buf, *buf2;
+    struct bf_slice slice, slice2;
+    struct bf_chain *chain;
+    const void *data;
+    char tmp[32];
+    int fds[2];
+
+    buf = bf_buffer_new(32);
+    bf_buffer_add_string(buf, "foo bar baz");
+
+    TEST_INT_EQ(bf_buffer_slice(buf, 4, 8, &slice), -1);
+    TEST_INT_EQ(bf_buffer_slice(buf, 4, 3, &slice), 0);
+    TEST_MEM_EQ(slice.data, slice.len, "bar", 3);
+    TEST_TRUE(slice.data == (char *)bf_buffer_data(buf) + 4);
+
+    /* Appending with enough free space does not copy data. */
+    data = bf_buffer_data(buf);
+    bf_buffer_add_string(buf, " qux");
+    TEST_TRUE(bf_buffer_data(buf) == data);
+    BFT_BUFFER_EQ(buf, "foo bar baz qux", 15);
+
+    /* Modifying referenced data copies them first. */
+    bf_buffer_remove_before(buf, 8, 4);
+    BFT_BUFFER_EQ(buf, "foo baz qux", 11);
+    TEST_MEM_EQ(slice.data, slice.len, "bar", 3);
+
+    /* Slices outlive their buffer. */
+    bf_buffer_delete(buf);
+    TEST_MEM_EQ(slice.data, slice.len, "bar", 3);
+
+    bf_slice_dup(&slice, &slice2);
+    bf_slice_release(&slice);
+    TEST_PTR_NULL(slice.data);
+    TEST_MEM_EQ(slice2.data, slice2.len, "bar", 3);
+
+    /* Empty buffers reference the data of the slice. */
+    buf = bf_buffer_new(0);
+    TEST_INT_EQ(bf_buffer_add_slice(buf, &slice2), 0);
+    TEST_TRUE(bf_buffer_data(buf) == slice2.data);
+    TEST_INT_EQ(bf_buffer_add_slice(buf, &slice2), 0);
+    BFT_BUFFER_EQ(buf, "barbar", 6);
+    TEST_MEM_EQ(slice2.data, slice2.len, "bar", 3);
+    bf_buffer_delete(buf);
+
+    chain = bf_chain_new(4);
+    bf_chain_add_string(chain, "ab");
+    TEST_INT_EQ(bf_chain_add_slice(chain, &slice2), 0);
+    bf_slice_release(&slice2);
+    bf_chain_add_string(chain, "cd");
+    TEST_UINT_EQ(bf_chain_length(chain), 7);
+
+    TEST_INT_EQ(pipe(fds), 0);
+    TEST_INT_EQ(bf_chain_write(chain, fds[1]), 7);
+    TEST_INT_EQ(read(fds[0], tmp, sizeof(tmp)), 7);
+    TEST_MEM_EQ(tmp, 7, "abbarcd", 7);
+    close(fds[0]);
+    close(fds[1]);
+
+    bf_chain_add_slice(chain, &slice2);
+    TEST_UINT_EQ(bf_chain_length(chain), 0);
+    bf_chain_delete(chain);
+
+    /* Shared buffers are copied when one of them is modified. */
+    buf = bf_buffer_new(0);
+    bf_buffer_add_string(buf, "abc");
+    buf2 = bf_buffer_share(buf);
+    TEST_TRUE(bf_buffer_data(buf2) == bf_buffer_data(buf));
+    bf_buffer_add_string(buf2, "def");
+    bf_buffer_add_string(buf, "ghi");
+    BFT_BUFFER_EQ(buf, "abcghi", 6);
+    BFT_BUFFER_EQ(buf2, "abcdef", 6);
+    bf_buffer_delete(buf2);
+
+    /* The last buffer referencing shared data takes them back. */
+    buf2 = bf_buffer_share(buf);
+    bf_buffer_delete(buf2);
+    data = bf_buffer_data(buf);
+    bf_buffer_insert(buf, 0, "x", 1);
+    BFT_BUFFER_EQ(buf, "xabcghi", 7);
+    bf_buffer_delete(buf);
+}
+
+TEST(buffer_pool) {
+    struct bf_memory_allocator allocator = {
+        .malloc = bft_tracking_malloc,
+        .free = bft_tracking_free,
+        .calloc = bft_tracking_calloc,
+        .realloc = bft_tracking_realloc,
+    };
+    struct bf_buffer_pool_stats stats;
+    struct bf_trim_policy trim_policy;
+    struct bft_pool_user user;
+    struct bf_buffer_pool *pool;
+    struct bf_buffer *buf, *buf2;
+    struct bf_hash hash;
+    int ready[2], done[2];
+    pthread_t thread;
+    char c;
+
+    pool = bf_buffer_pool_new(0);
+
+    buf = bf_buffer_pool_get(pool, 100);
+    TEST_UINT_EQ(bf_buffer_size(buf), 128);
+    bf_buffer_add_string(buf, "abc");
+    bf_buffer_pool_release(pool, buf);
+
+    buf2 = bf_buffer_pool_get(pool, 65);
+    TEST_TRUE(buf2 == buf);
+    BFT_BUFFER_EMPTY(buf2);
+
+    buf = bf_buffer_pool_get(pool, 100);
+    TEST_TRUE(buf != buf2);
+
+    bf_buffer_pool_release(pool, buf);
+    bf_buffer_pool_release(pool, buf2);
+    bf_buffer_pool_flush_thread_cache(pool);
+
+    buf = bf_buffer_pool_get(pool, 128);
+    bf_buffer_pool_release(pool, buf);
+
+    /* Released buffers do not keep the hash of their previous owner. */
+    buf = bf_buffer_pool_get(pool, 100);
+    bf_hash_init(&hash, BF_HASH_CRC32C, 0);
+    bf_buffer_set_hash(buf, &hash);
+    bf_buffer_add_string(buf, "abc");
+    bf_buffer_pool_release(pool, buf);
+
+    buf = bf_buffer_pool_get(pool, 100);
+    bf_buffer_add_string(buf, "def");
+    TEST_UINT_EQ(hash.len, 3);
+    bf_buffer_pool_release(pool, buf);
+
+    /* Nor their trim policy, which is not used to clear them. */
+    trim_policy.floor = 0;
+    trim_policy.low_water = 0.5;
+    trim_policy.nb_idle_ops = 1;
+
+    buf = bf_buffer_pool_get(pool, 1000);
+    bf_buffer_set_trim_policy(buf, &trim_policy);
+    bf_buffer_add_string(buf, "abc");
+    bf_buffer_pool_release(pool, buf);
+
+    buf2 = bf_buffer_pool_get(pool, 1000);
+    TEST_TRUE(buf2 == buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1024);
+    bf_buffer_add_string(buf, "abc");
+    bf_buffer_clear(buf);
+    TEST_UINT_EQ(bf_buffer_size(buf), 1024);
+    bf_buffer_pool_release(pool, buf);
+
+    bf_buffer_pool_get_stats(pool, &stats);
+    TEST_UINT_EQ(stats.nb_hits, 5);
+    TEST_UINT_EQ(stats.nb_misses, 3);
+
+    bf_buffer_pool_delete(pool);
+
+    /* Deleting a pool frees the caches of threads which are still
+     * running. */
+    TEST_INT_EQ(pipe(ready), 0);
+    TEST_INT_EQ(pipe(done), 0);
+
+    bf_set_memory_allocator(&allocator);
+    bft_nb_live_allocs = 0;
+
+    user.pool = bf_buffer_pool_new(0);
+    user.ready_fd = ready[1];
+    user.done_fd = done[0];
+    pthread_create(&thread, NULL, bft_pool_user, &user);
+    TEST_INT_EQ(read(ready[0], &c, 1), 1);
+
+    bf_buffer_pool_delete(user.pool);
+    TEST_UINT_EQ(bft_nb_live_allocs, 0);
+
+    TEST_INT_EQ(write(done[1], "x", 1), 1);
+    pthread_join(thread, NULL);
+
+    bf_set_memory_allocator(NULL);
+
+    close(ready[0]);
+    close(ready[1]);
+    close(done[0]);
+    close(done[1]);
+}
+
+TEST(chain) {
+    struct bf_chain *chain;
+    char tmp[32];
+    int fds[2];
+
+    chain = bf_chain_new(4);
+    TEST_UINT_EQ(bf_chain_length(chain), 0);
+
+    bf_chain_add_string(chain, "abcdefghij");
+    TEST_UINT_EQ(bf_chain_length(chain), 10);
+
+    bf_chain_skip(chain, 5);
+    TEST_UINT_EQ(bf_chain_length(chain), 5);
+
+    bf_chain_add_string(chain, "klm");
+    TEST_UINT_EQ(bf_chain_length(chain), 8);
+
+    TEST_INT_EQ(pipe(fds), 0);
+    TEST_INT_EQ(bf_chain_write(chain, fds[1]), 8);
+    TEST_UINT_EQ(bf_chain_length(chain), 0);
+    TEST_INT_EQ(read(fds[0], tmp, sizeof(tmp)), 8);
+    TEST_MEM_EQ(tmp, 8, "fghijklm", 8);
+
+    TEST_INT_EQ(write(fds[1], "nopqrs", 6), 6);
+    TEST_INT_EQ(bf_chain_read(chain, fds[0], 6), 4);
+    TEST_INT_EQ(bf_chain_read(chain, fds[0], 6), 2);
+    TEST_UINT_EQ(bf_chain_length(chain), 6);
+    TEST_INT_EQ(bf_chain_write(chain, fds[1]), 6);
+    TEST_INT_EQ(read(fds[0], tmp, sizeof(tmp)), 6);
+    TEST_MEM_EQ(tmp, 6, "nopqrs", 6);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    bf_chain_delete(chain);
+}
+
+TEST(ring) {
+    struct bf_ring *ring;
+    size_t sz;
+    char *ptr;
+
+    ring = bf_ring_new(1);
+    sz = bf_ring_size(ring);
+    TEST_UINT_EQ(bf_ring_length(ring), 0);
+    TEST_UINT_EQ(bf_ring_free_space(ring), sz);
+
+    ptr = bf_ring_reserve(ring, sz - 2);
+    memset(ptr, 'x', sz - 2);
+    bf_ring_increase_length(ring, sz - 2);
+    TEST_PTR_NULL(bf_ring_reserve(ring, 3));
+
+    bf_ring_skip(ring, sz - 4);
+    TEST_UINT_EQ(bf_ring_length(ring), 2);
+
+    /* The content now wraps around the end of the ring. */
+    TEST_INT_EQ(bf_ring_add(ring, "abcdef", 6), 0);
+    TEST_MEM_EQ(bf_ring_data(ring), bf_ring_length(ring), "xxabcdef", 8);
+
+    bf_ring_skip(ring, 4);
+    TEST_MEM_EQ(bf_ring_data(ring), bf_ring_length(ring), "cdef", 4);
+    TEST_MEM_EQ(ptr, 4, "cdef", 4);
+
+    bf_ring_skip(ring, 4);
+    TEST_UINT_EQ(bf_ring_length(ring), 0);
+    TEST_UINT_EQ(bf_ring_free_space(ring), sz);
+
+    bf_ring_delete(ring);
+}
+
+TEST(queue) {
+    struct bf_queue *queue;
+    pthread_t thread;
+    const char *data;
+    size_t sz, i, j, len;
+    int ok;
+
+    queue = bf_queue_new(1);
+    sz = bf_queue_size(queue);
+    TEST_UINT_EQ(sz & (sz - 1), 0);
+    TEST_UINT_EQ(bf_queue_free_space(queue), sz);
+    TEST_UINT_EQ(bf_queue_length(queue), 0);
+
+    TEST_PTR_NOT_NULL(bf_queue_reserve(queue, sz - 2));
+    bf_queue_increase_length(queue, sz - 2);
+    TEST_PTR_NULL(bf_queue_reserve(queue, 3));
+
+    bf_queue_skip(queue, sz - 4);
+    TEST_UINT_EQ(bf_queue_length(queue), 2);
+
+    /* The content wraps around the end of the queue. */
+    TEST_INT_EQ(bf_queue_add(queue, "abcdef", 6), 0);
+    TEST_UINT_EQ(bf_queue_length(queue), 8);
+    TEST_MEM_EQ((char *)bf_queue_data(queue) + 2, 6, "abcdef", 6);
+
+    bf_queue_skip(queue, 100);
+    TEST_UINT_EQ(bf_queue_length(queue), 0);
+    TEST_UINT_EQ(bf_queue_free_space(queue), sz);
+
+    /* Data produced by another thread are received in order. */
+    TEST_INT_EQ(pthread_create(&thread, NULL, bft_queue_producer, queue), 0);
+
+    ok = 1;
+    for (i = 0; i < BFT_QUEUE_NB_BYTES; i += len) {
+        len = bf_queue_length(queue);
+        data = bf_queue_data(queue);
+
+        for (j = 0; j < len; j++) {
+            if (data[j] != (char)((i + j) % 251))
+                ok = 0;
+        }
+
+        bf_queue_skip(queue, len);
+    }
+
+    pthread_join(thread, NULL);
+    TEST_TRUE(ok);
+    TEST_UINT_EQ(bf_queue_length(queue), 0);
+
+    bf_queue_delete(queue);
+}
+
+TEST(log) {
+    struct bft_log_producer producers[BFT_LOG_NB_THREADS];
+    pthread_t threads[BFT_LOG_NB_THREADS];
+    uint32_t next[BFT_LOG_NB_THREADS];
+    const uint32_t *record;
+    struct bf_buffer *buf;
+    struct bf_log *log;
+    char tmp[32], *ptr;
+    size_t i, nb_bytes;
+    int fds[2], ok;
+
+    log = bf_log_new(1);
+    buf = bf_buffer_new(0);
+
+    TEST_PTR_NULL(bf_log_reserve(log, bf_log_size(log)));
+
+    ptr = bf_log_reserve(log, 8);
+    memcpy(ptr, "foo", 3);
+    TEST_INT_EQ(bf_log_add_printf(log, "bar %d", 42), 0);
+
+    /* Uncommitted records block the following ones. */
+    TEST_UINT_EQ(bf_log_drain(log, buf), 0);
+    TEST_INT_EQ(bf_log_commit(log, ptr, 3), 0);
+    TEST_UINT_EQ(bf_log_drain(log, buf), 9);
+    BFT_BUFFER_EQ(buf, "foobar 42", 9);
+
+    /* Records committed with an invalid length are skipped instead of
+     * blocking the following ones. */
+    bf_buffer_clear(buf);
+    ptr = bf_log_reserve(log, 8);
+    memcpy(ptr, "foo", 3);
+    TEST_INT_EQ(bf_log_add(log, "bar", 3), 0);
+    TEST_INT_EQ(bf_log_commit(log, ptr, 9), -1);
+    TEST_UINT_EQ(bf_log_drain(log, buf), 3);
+    BFT_BUFFER_EQ(buf, "bar", 3);
+
+    TEST_INT_EQ(pipe(fds), 0);
+    bf_log_add(log, "abc", 3);
+    bf_log_add(log, "", 0);
+    bf_log_add(log, "defgh", 5);
+    TEST_INT_EQ(bf_log_write(log, fds[1]), 8);
+    TEST_INT_EQ(read(fds[0], tmp, sizeof(tmp)), 8);
+    TEST_MEM_EQ(tmp, 8, "abcdefgh", 8);
+    TEST_INT_EQ(bf_log_write(log, fds[1]), 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Records appended concurrently are all received, and the records of
+     * each thread are received in order. */
+    for (i = 0; i < BFT_LOG_NB_THREADS; i++) {
+        producers[i].log = log;
+        producers[i].id = (uint32_t)i;
+        pthread_create(&threads[i], NULL, bft_log_producer, &producers[i]);
+    }
+
+    bf_buffer_clear(buf);
+    nb_bytes = BFT_LOG_NB_THREADS * BFT_LOG_NB_RECORDS * 16;
+    while (bf_buffer_length(buf) < nb_bytes)
+        bf_log_drain(log, buf);
+
+    for (i = 0; i < BFT_LOG_NB_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    TEST_UINT_EQ(bf_buffer_length(buf), nb_bytes);
+
+    memset(next, 0, sizeof(next));
+    ok = 1;
+
+    record = bf_buffer_data(buf);
+    for (i = 0; i < nb_bytes / 16; i++, record += 4) {
+        if (record[0] >= BFT_LOG_NB_THREADS || record[1] != next[record[0]]
+         || record[2] != ~record[0] || record[3] != ~record[1]) {
+            ok = 0;
+            break;
+        }
+
+        next[record[0]]++;
+    }
+
+    TEST_TRUE(ok);
+
+    bf_buffer_delete(buf);
+    bf_log_delete(log);
+}
+
+TEST(filter) {
+    struct bf_filter *compressor, *decompressor;
+    struct bf_buffer *in, *compressed, *out;
+    uint32_t state;
+    size_t i, sz;
+    char *data;
+
+    /* Text with repetitions followed by data which do not compress. */
+    sz = 300000;
+    data = malloc(sz);
+    for (i = 0; i < sz / 2; i++)
+        data[i] = "abcdefghij klmnopq\n"[(i * 7 / 3) % 19];
+
+    state = 1;
+    for (; i < sz; i++) {
+        state = state * 1103515245 + 12345;
+        data[i] = (char)(state >> 16);
+    }
+
+    TEST_TRUE(bft_filter_round_trip(BF_FILTER_LZ, data, sz));
+    TEST_TRUE(bft_filter_round_trip(BF_FILTER_LZ, data, 100));
+#ifdef BF_WITH_ZLIB
+    TEST_TRUE(bft_filter_round_trip(BF_FILTER_DEFLATE, data, sz));
+    TEST_TRUE(bft_filter_round_trip(BF_FILTER_GZIP, data, sz));
+#else
+    TEST_PTR_NULL(bf_filter_new(BF_FILTER_GZIP, BF_FILTER_COMPRESS, 0));
+#endif
+
+    free(data);
+
+    compressor = bf_filter_new(BF_FILTER_LZ, BF_FILTER_COMPRESS, 0);
+    decompressor = bf_filter_new(BF_FILTER_LZ, BF_FILTER_DECOMPRESS, 0);
+    in = bf_buffer_new(0);
+    compressed = bf_buffer_new(0);
+    out = bf_buffer_new(0);
+
+    /* Flushing makes all the data processed so far available. */
+    bf_buffer_add_string(in, "foo bar foo bar foo bar");
+    TEST_INT_EQ(bf_filter_process(compressor, in, compressed,
+                                  BF_FILTER_NO_FLUSH), 0);
+    TEST_UINT_EQ(bf_buffer_length(in), 23);
+    TEST_INT_EQ(bf_filter_process(compressor, in, compressed,
+                                  BF_FILTER_FLUSH), 0);
+    BFT_BUFFER_EMPTY(in);
+    TEST_INT_EQ(bf_filter_process(decompressor, compressed, out,
+                                  BF_FILTER_NO_FLUSH), 0);
+    BFT_BUFFER_EQ(out, "foo bar foo bar foo bar", 23);
+
+    /* The stream ends with the last call. */
+    TEST_INT_EQ(bf_filter_process(decompressor, compressed, out,
+                                  BF_FILTER_FINISH), -1);
+
+    /* Filters can be reused. */
+    bf_filter_reset(compressor);
+    bf_filter_reset(decompressor);
+    bf_buffer_clear(compressed);
+    bf_buffer_clear(out);
+
+    bf_buffer_add_string(in, "abc");
+    TEST_INT_EQ(bf_filter_process(compressor, in, compressed,
+                                  BF_FILTER_FINISH), 1);
+    TEST_INT_EQ(bf_filter_process(decompressor, compressed, out,
+                                  BF_FILTER_FINISH), 1);
+    BFT_BUFFER_EQ(out, "abc", 3);
+
+    bf_buffer_delete(in);
+    bf_buffer_delete(compressed);
+    bf_buffer_delete(out);
+
+    bf_filter_delete(compressor);
+    bf_filter_delete(decompressor);
+}
+
+TEST(hash) {
+    static const char data[] =
+        "The quick brown fox jumps over the lazy dog, 0123456789.";
+    struct bf_buffer *buf;
+    struct bf_hash hash, buf_hash;
+    size_t sz, i;
+    int fds[2];
+
+    sz = sizeof(data) - 1;
+
+    /* Reference values */
+    TEST_UINT_EQ(bf_crc32c(0, "123456789", 9), 0xe3069283);
+    TEST_UINT_EQ(bf_crc32c(0, "", 0), 0);
+    TEST_UINT_EQ(bf_xxh64("", 0, 0), 0xef46db3751d8e999ULL);
+    TEST_UINT_EQ(bf_xxh64("a", 1, 0), 0xd24ec4f1a98c6e5bULL);
+    TEST_UINT_EQ(bf_xxh64("abc", 3, 0), 0x44bc2cf5ad770999ULL);
+
+    /* Incremental updates */
+    for (i = 0; i <= sz; i++) {
+        bf_hash_init(&hash, BF_HASH_CRC32C, 0);
+        bf_hash_update(&hash, data, i);
+        bf_hash_update(&hash, data + i, sz - i);
+        TEST_UINT_EQ(bf_hash_digest(&hash), bf_crc32c(0, data, sz));
+
+        bf_hash_init(&hash, BF_HASH_XXH64, 42);
+        bf_hash_update(&hash, data, i);
+        bf_hash_update(&hash, data + i, sz - i);
+        TEST_UINT_EQ(bf_hash_digest(&hash), bf_xxh64(data, sz, 42));
+    }
+
+    /* Buffers */
+    buf = bf_buffer_new(0);
+    bf_hash_init(&buf_hash, BF_HASH_XXH64, 0);
+    bf_buffer_set_hash(buf, &buf_hash);
+
+    bf_buffer_add_string(buf, "foo ");
+    bf_buffer_add_printf(buf, "%d ", 42);
+    bf_buffer_add_i64(buf, -1);
+    bf_buffer_add_hex(buf, 0xff);
+
+    TEST_INT_EQ(pipe(fds), 0);
+    TEST_INT_EQ(write(fds[1], data, sz), (ssize_t)sz);
+    TEST_INT_EQ(bf_buffer_read(buf, fds[0], sz), (ssize_t)sz);
+    close(fds[0]);
+    close(fds[1]);
+
+    TEST_UINT_EQ(buf_hash.len, bf_buffer_length(buf));
+    TEST_UINT_EQ(bf_hash_digest(&buf_hash),
+                 bf_xxh64(bf_buffer_data(buf), bf_buffer_length(buf), 0));
+
+    /* Inserting data before the end would make the digest differ from the
+     * content. */
+    TEST_INT_EQ(bf_buffer_insert(buf, 0, "x", 1), -1);
+    TEST_UINT_EQ(buf_hash.len, bf_buffer_length(buf));
+
+    /* Skipped data are not part of the buffer anymore, but were hashed. */
+    bf_buffer_skip(buf, 4);
+    TEST_UINT_EQ(buf_hash.len, bf_buffer_length(buf) + 4);
+
+    bf_buffer_set_hash(buf, NULL);
+    bf_buffer_add_string(buf, "bar");
+    TEST_UINT_EQ(buf_hash.len, bf_buffer_length(buf) + 1);
+
+    bf_buffer_delete(buf);
+}
+
+TEST(stats) {
+    struct bf_buffer_stats stats, global_stats;
+    struct bf_buffer *buf;
+    int fds[2];
+
+    buf = bf_buffer_new(0);
+
+    bf_reset_buffer_stats();
+    bf_buffer_reset_stats(buf);
+
+    bf_buffer_add_string(buf, "abcdef");
+    bf_buffer_insert(buf, 2, "xy", 2);
+    bf_buffer_remove_after(buf, 0, 2);
+    BFT_BUFFER_EQ(buf, "xycdef", 6);
+
+    TEST_INT_EQ(pipe(fds), 0);
+    TEST_INT_EQ(bf_buffer_write(buf, fds[1]), 6);
+    TEST_INT_EQ(bf_buffer_read(buf, fds[0], 4), 4);
+    close(fds[0]);
+    close(fds[1]);
+
+    bf_buffer_get_stats(buf, &stats);
+    bf_get_buffer_stats(&global_stats);
+
+#ifdef BF_WITH_STATS
+    TEST_UINT_EQ(stats.memmove_bytes, 4 + 6);
+    TEST_TRUE(stats.peak_size >= 8);
+    TEST_UINT_EQ(stats.nb_reads, 1);
+    TEST_UINT_EQ(stats.read_bytes, 4);
+    TEST_UINT_EQ(stats.nb_writes, 1);
+    TEST_UINT_EQ(stats.write_bytes, 6);
+
+    TEST_UINT_EQ(global_stats.memmove_bytes, stats.memmove_bytes);
+    TEST_UINT_EQ(global_stats.nb_reads, 1);
+    TEST_UINT_EQ(global_stats.write_bytes, 6);
+    TEST_TRUE(global_stats.peak_size >= stats.peak_size);
+
+    bf_buffer_reset_stats(buf);
+    bf_reset_buffer_stats();
+
+    bf_buffer_get_stats(buf, &stats);
+    bf_get_buffer_stats(&global_stats);
+    TEST_UINT_EQ(stats.nb_reads, 0);
+    TEST_UINT_EQ(global_stats.nb_reads, 0);
+#else
+    TEST_UINT_EQ(stats.nb_reads, 0);
+    TEST_UINT_EQ(stats.peak_size, 0);
+    TEST_UINT_EQ(global_stats.nb_writes, 0);
+#endif
+
+    bf_buffer_delete(buf);
+}
+
+TEST(memory_trace) {
+    struct bf_memory_stats stats;
+    struct bf_memory_site sites[64];
+    struct bf_buffer *buf, *trace;
+    size_t nb_sites, i, live_bytes;
+    void *ptr;
+    int found;
+
+    bf_reset_memory_stats();
+
+    bf_get_memory_stats(&stats);
+    live_bytes = stats.live_bytes;
+
+    ptr = bf_malloc(100);
+    ptr = bf_realloc(ptr, 1000);
+
+    buf = bf_buffer_new(5000);
+
+    bf_get_memory_stats(&stats);
+
+#ifdef BF_WITH_TRACE
+    TEST_UINT_EQ(stats.nb_allocs, 3);
+    TEST_UINT_EQ(stats.nb_reallocs, 1);
+    TEST_UINT_EQ(stats.nb_frees, 0);
+    TEST_TRUE(stats.live_bytes >= live_bytes + 1000 + 5000);
+    TEST_TRUE(stats.peak_bytes >= stats.live_bytes);
+
+    /* 100 and 1000 bytes allocations */
+    TEST_UINT_EQ(stats.size_classes[6], 1);
+    TEST_UINT_EQ(stats.size_classes[9], 1);
+    TEST_UINT_EQ(stats.size_classes[12], 1);
+
+    nb_sites = bf_get_memory_sites(sites, 64);
+    TEST_TRUE(nb_sites <= 64);
+
+    found = 0;
+    for (i = 0; i < nb_sites; i++) {
+        if (strcmp(sites[i].name, "bf_buffer_resize") == 0) {
+            TEST_UINT_EQ(sites[i].nb_allocs, 1);
+            TEST_UINT_EQ(sites[i].total_bytes, 5000);
+            found = 1;
+        }
+    }
+    TEST_TRUE(found);
+
+    trace = bf_buffer_new(0);
+    TEST_INT_EQ(bf_dump_memory_trace(trace), 0);
+    bf_buffer_add(trace, "", 1);
+    TEST_PTR_NOT_NULL(strstr(bf_buffer_data(trace),
+                             " realloc (application) "));
+    TEST_PTR_NOT_NULL(strstr(bf_buffer_data(trace),
+                             " malloc bf_buffer_resize "));
+    bf_buffer_delete(trace);
+#else
+    TEST_UINT_EQ(stats.nb_allocs, 0);
+    TEST_UINT_EQ(stats.live_bytes, live_bytes);
+    TEST_UINT_EQ(bf_get_memory_sites(sites, 64), 0);
+
+    trace = bf_buffer_new(0);
+    TEST_INT_EQ(bf_dump_memory_trace(trace), 0);
+    TEST_UINT_EQ(bf_buffer_length(trace), 0);
+    bf_buffer_delete(trace);
+
+    (void)nb_sites;
+    (void)i;
+    (void)found;
+#endif
+
+    bf_buffer_delete(buf);
+    bf_free(ptr);
+
+    bf_get_memory_stats(&stats);
+#ifdef BF_WITH_TRACE
+    TEST_TRUE(stats.nb_frees >= 2);
+#endif
+}
+
 int
 main(int argc, char **argv) {
     struct test_suite *suite;
@@ -199,9 +1724,33 @@ main(int argc, char **argv) {
     TEST_RUN(suite, initialization);
     TEST_RUN(suite, insert);
     TEST_RUN(suite, add);
+    TEST_RUN(suite, add_numbers);
     TEST_RUN(suite, remove);
+    TEST_RUN(suite, find);
     TEST_RUN(suite, dup);
     TEST_RUN(suite, free_space_after_skip);
+    TEST_RUN(suite, growth_policy);
+    TEST_RUN(suite, mmap_threshold);
+    TEST_RUN(suite, compaction_policy);
+    TEST_RUN(suite, trim_policy);
+    TEST_RUN(suite, binary);
+    TEST_RUN(suite, framer);
+    TEST_RUN(suite, arena);
+    TEST_RUN(suite, inline_storage);
+    TEST_RUN(suite, aligned);
+    TEST_RUN(suite, mmap);
+    TEST_RUN(suite, relay);
+    TEST_RUN(suite, uring);
+    TEST_RUN(suite, slices);
+    TEST_RUN(suite, buffer_pool);
+    TEST_RUN(suite, chain);
+    TEST_RUN(suite, ring);
+    TEST_RUN(suite, queue);
+    TEST_RUN(suite, log);
+    TEST_RUN(suite, filter);
+    TEST_RUN(suite, hash);
+    TEST_RUN(suite, stats);
+    TEST_RUN(suite, memory_trace);
 
     test_suite_print_results_and_exit(suite);
 }